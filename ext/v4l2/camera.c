@@ -19,18 +19,22 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 
 #include "camera.h"
+#include "codec.h"
+#include "convert.h"
 
 #ifdef RUBY_EXTLIB
 #include <ruby.h>
-#else /* defined(RUBY_EXTLIB) */
-#include <sys/select.h>
+#include <ruby/thread.h>
 #endif /* defined(RUBY_EXTLIB) */
 
 #define BZERO(x)                  bzero(&x, sizeof(x))
@@ -41,15 +45,27 @@
 #define DEFAULT_FORMAT            V4L2_PIX_FMT_MJPEG
 #define DEFAULT_WIDTH             640
 #define DEFAULT_HEIGHT            480
-#define DEFAULT_FRAMERATE_NUM     30
-#define DEFAULT_FRAMERATE_DENOM   1
+#define DEFAULT_FRAMERATE_NUM     1
+#define DEFAULT_FRAMERATE_DENOM   30
 
 #define NEED_CAPABILITY           (V4L2_CAP_VIDEO_CAPTURE|V4L2_CAP_STREAMING)
-#define IS_CAPABLE(x)             (((x) & NEED_CAPABILITY) == NEED_CAPABILITY)
-
-#define NUM_PLANE                 3
+#define NEED_CAPABILITY_MPLANE    (V4L2_CAP_VIDEO_CAPTURE_MPLANE|\
+                                   V4L2_CAP_STREAMING)
+#define IS_JPEG(fmt)              ((fmt) == V4L2_PIX_FMT_MJPEG ||\
+                                   (fmt) == V4L2_PIX_FMT_JPEG)
+#define HAS_CAPABILITY(x,need)    (((x) & (need)) == (need))
+#define IS_MPLANE(type)           ((type) == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+
+#define DEFAULT_NUM_BUFFERS       3
+#define MIN_NUM_BUFFERS           2
+#define MAX_NUM_BUFFERS           VIDEO_MAX_FRAME
 #define CAMERA_UP_PERIOD          15
+#define THREAD_POLL_PERIOD        100     /* [ms] */
+#define MAILBOX_WAIT_PERIOD       5       /* [ms] */
 #define COPIED                    0x8000
+#define HUGEPAGE_SIZE             (2 * 1024 * 1024)
+#define CHROMA(x)                 (((x) + 1) / 2)
+#define ROUND_UP(x,n)             ((((x) + (n) - 1) / (n)) * (n))
                                   
 #define ST_ERROR                  (-1)
 #define ST_NONE                   (0) /* fialized */
@@ -60,6 +76,7 @@
 #define ST_BREAK                  (5)
 #define ST_STOPPING               (6)
 #define ST_FINALIZED              (7)
+#define ST_TIMEOUT                (8)
 
 static int xioctl(int fh, unsigned long request, void *arg)
 {
@@ -73,12 +90,14 @@ static int xioctl(int fh, unsigned long request, void *arg)
 }
 
 static int
-device_open(char* path, int *_fd, char* name, char* driver, char* bus)
+device_open(char* path, int *_fd, uint32_t* type,
+            char* name, char* driver, char* bus)
 {
   int ret;
   int err;
   int fd;
   struct v4l2_capability cap;
+  uint32_t caps;
 
   do {
     /*
@@ -107,8 +126,18 @@ device_open(char* path, int *_fd, char* name, char* driver, char* bus)
 
     /*
      * check capability
+     * (シングルプレーンAPIに対応していない場合はマルチプレーンAPIを使う)
      */
-    if (!IS_CAPABLE(cap.capabilities)) {
+    caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)?
+              cap.device_caps: cap.capabilities;
+
+    if (HAS_CAPABILITY(caps, NEED_CAPABILITY)) {
+      *type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    } else if (HAS_CAPABILITY(caps, NEED_CAPABILITY_MPLANE)) {
+      *type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+    } else {
       fprintf(stderr, "This device not have camera function that required.");
       break;
     }
@@ -139,24 +168,43 @@ device_open(char* path, int *_fd, char* name, char* driver, char* bus)
   return ret;
 }
 
+static void
+init_format(struct v4l2_format* fmt, uint32_t type,
+            uint32_t fcc, int wd, int ht)
+{
+  bzero(fmt, sizeof(*fmt));
+
+  fmt->type = type;
+
+  if (IS_MPLANE(type)) {
+    fmt->fmt.pix_mp.width       = wd;
+    fmt->fmt.pix_mp.height      = ht;
+    fmt->fmt.pix_mp.pixelformat = fcc;
+    fmt->fmt.pix_mp.field       = V4L2_FIELD_ANY;
+
+  } else {
+    fmt->fmt.pix.width          = wd;
+    fmt->fmt.pix.height         = ht;
+    fmt->fmt.pix.pixelformat    = fcc;
+    fmt->fmt.pix.field          = V4L2_FIELD_ANY;
+  }
+}
+
+/*
+ * ドライバが実際に選択した設定(サイズやストライド等)をfmtに返す
+ */
 static int
-set_format(int fd, uint32_t fcc, int wd, int ht)
+set_format(int fd, uint32_t type, uint32_t fcc, int wd, int ht,
+           struct v4l2_format* fmt)
 {
   int ret;
   int err;
-  struct v4l2_format fmt;
 
   ret = 0;
 
-  BZERO(fmt);
+  init_format(fmt, type, fcc, wd, ht);
 
-  fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  fmt.fmt.pix.width       = wd;
-  fmt.fmt.pix.height      = ht;
-  fmt.fmt.pix.pixelformat = fcc;
-  fmt.fmt.pix.field       = V4L2_FIELD_ANY;
-
-  err = xioctl(fd, VIDIOC_S_FMT, &fmt);
+  err = xioctl(fd, VIDIOC_S_FMT, fmt);
   if (err < 0) {
     perror("ioctl(VIDIOC_S_FMT)");
     ret = !0;
@@ -166,7 +214,7 @@ set_format(int fd, uint32_t fcc, int wd, int ht)
 }
 
 static int
-set_param(int fd, int num, int denom)
+set_param(int fd, uint32_t type, int num, int denom)
 {
   int ret;
   int err;
@@ -176,71 +224,473 @@ set_param(int fd, int num, int denom)
   ret = 0;
 
   BZERO(param);
-  param.type       = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  param.type       = type;
   tpf              = &param.parm.capture.timeperframe;
   tpf->numerator   = num;
   tpf->denominator = denom;
 
   err = xioctl(fd, VIDIOC_S_PARM, &param);
   if (err < 0) {
-    perror("ioctl(VIDIOC_S_PARM:V4L2_BUF_TYPE_VIDEO_CAPTURE)");
+    perror("ioctl(VIDIOC_S_PARM)");
     ret = !0;
   }
 
   return ret;
 }
 
+/*
+ * ドライバが実際に設定したフレーム間隔を取得する
+ */
 static int
-mb_init(mblock_t* mb, int fd, struct v4l2_buffer* buf)
+get_param(int fd, uint32_t type, int* num, int* denom)
 {
   int ret;
-  void* ptr;
+  int err;
+  struct v4l2_streamparm param;
+  struct v4l2_fract* tpf;
 
   ret = 0;
-  ptr = mmap(NULL, buf->length, PROT_READ, MAP_SHARED, fd, buf->m.offset);
 
-  if (ptr != NULL) {
-    mb->ptr  = ptr;
-    mb->size = buf->length;
-  } else{
+  BZERO(param);
+  param.type = type;
+  tpf        = &param.parm.capture.timeperframe;
+
+  err = xioctl(fd, VIDIOC_G_PARM, &param);
+  if (err < 0) {
+    perror("ioctl(VIDIOC_G_PARM)");
     ret = !0;
+
+  } else if (tpf->numerator > 0 && tpf->denominator > 0) {
+    *num   = tpf->numerator;
+    *denom = tpf->denominator;
+  }
+
+  return ret;
+}
+
+static int
+mb_init(mblock_t* mb, int fd, struct v4l2_buffer* buf)
+{
+  int ret;
+  int i;
+  void* ptr;
+  size_t len;
+  off_t off;
+
+  ret        = 0;
+  mb->nplane = (IS_MPLANE(buf->type))? (int)buf->length: 1;
+
+  if (mb->nplane > MAX_PLANE) {
+    fprintf(stderr, "mb_init():too many planes.\n");
+    mb->nplane = 0;
+    ret        = !0;
+  }
+
+  for (i = 0; i < mb->nplane; i++) {
+    if (IS_MPLANE(buf->type)) {
+      len = buf->m.planes[i].length;
+      off = buf->m.planes[i].m.mem_offset;
+    } else {
+      len = buf->length;
+      off = buf->m.offset;
+    }
+
+    ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+    if (ptr == MAP_FAILED) {
+      ret = !0;
+      break;
+    }
+
+    mb->plane[i].ptr  = ptr;
+    mb->plane[i].size = len;
+  }
+
+  return ret;
+}
+
+/*
+ * USERPTR用のバッファをページ境界に揃えて確保する
+ * (hugepage指定時はHugeTLBページを試し、駄目なら通常ページで確保して
+ *  THPを要求する)
+ */
+static int
+mb_alloc(mblock_t* mb, int nplane, size_t size[], int hugepage)
+{
+  int ret;
+  int i;
+  void* ptr;
+  size_t len;
+  size_t page;
+
+  ret        = 0;
+  mb->nplane = nplane;
+  page       = sysconf(_SC_PAGESIZE);
+
+  for (i = 0; i < mb->nplane; i++) {
+    ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (hugepage) {
+      len = ROUND_UP(size[i], HUGEPAGE_SIZE);
+      ptr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    }
+#endif /* defined(MAP_HUGETLB) */
+
+    if (ptr == MAP_FAILED) {
+      len = ROUND_UP(size[i], page);
+      ptr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED) {
+        perror("mmap()");
+        ret = !0;
+        break;
+      }
+
+#ifdef MADV_HUGEPAGE
+      if (hugepage) madvise(ptr, len, MADV_HUGEPAGE);
+#endif /* defined(MADV_HUGEPAGE) */
+    }
+
+    mb->plane[i].ptr  = ptr;
+    mb->plane[i].size = len;
   }
 
   return ret;
 }
 
+/*
+ * MJPEGのフレームに補う標準のハフマンテーブル (JPEG規格 K.3の表を1つの
+ * DHTセグメントにまとめたもの)
+ */
+static const uint8_t std_dht[] = {
+  0xff, 0xc4, 0x01, 0xa2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01,
+  0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+  0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x10, 0x00, 0x02,
+  0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00,
+  0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31,
+  0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+  0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33,
+  0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43,
+  0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57,
+  0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73,
+  0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+  0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+  0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+  0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2,
+  0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0x01, 0x00, 0x03, 0x01,
+  0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+  0x0b, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05,
+  0x04, 0x04, 0x00, 0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04,
+  0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+  0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33,
+  0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25,
+  0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+  0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+  0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+  0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+  0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94,
+  0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+  0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+  0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+  0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+/*
+ * DHTを挟み込む分の余裕 (MJPEGの場合は出力サイズにあらかじめ含めておく)
+ */
+#define DHT_HEADROOM(fmt)         (IS_JPEG(fmt)? sizeof(std_dht): 0)
+
+#define M_SOF0                    0xc0
+#define M_SOF15                   0xcf
+#define M_DHT                     0xc4
+#define M_JPG                     0xc8
+#define M_DAC                     0xcc
+#define M_RST0                    0xd0
+#define M_RST7                    0xd7
+#define M_SOI                     0xd8
+#define M_EOI                     0xd9
+#define M_SOS                     0xda
+#define M_TEM                     0x01
+
+/*
+ * SOSまでのマーカーの並びと末尾のEOIを確認する。*endにはEOIの直後(後ろ
+ * の詰め物を除いた長さ)を、*dht_posにはDHTが無い場合のSOSの位置(有る
+ * 場合は0)を返す。破損している場合は!0を返す(SOSまでが正常であれば、
+ * 末尾が壊れていても*dht_posは設定する)。
+ */
+static int
+scan_jpeg(const uint8_t* p, size_t n, size_t* end, size_t* dht_pos)
+{
+  size_t i;
+  size_t len;
+  int has_sof;
+  int has_dht;
+  int m;
+
+  *dht_pos = 0;
+
+  if (n < 4 || p[0] != 0xff || p[1] != M_SOI) return !0;
+
+  has_sof = 0;
+  has_dht = 0;
+
+  i = 2;
+
+  while (1) {
+    if (i + 4 > n || p[i] != 0xff) return !0;
+
+    // マーカーの前の詰め物(0xff)は読み飛ばす
+    m = p[i + 1];
+    if (m == 0xff) {
+      i++;
+      continue;
+    }
+
+    if (m == M_TEM || (m >= M_RST0 && m <= M_RST7)) {
+      i += 2;
+      continue;
+    }
+
+    if (m == 0x00 || m == M_SOI || m == M_EOI) return !0;
+
+    len = ((size_t)p[i + 2] << 8) | p[i + 3];
+    if (len < 2 || i + 2 + len > n) return !0;
+
+    if (m == M_DHT) {
+      has_dht = !0;
+
+    } else if (m >= M_SOF0 && m <= M_SOF15 && m != M_JPG && m != M_DAC) {
+      has_sof = !0;
+
+    } else if (m == M_SOS) {
+      break;
+    }
+
+    i += 2 + len;
+  }
+
+  if (!has_sof) return !0;
+
+  if (!has_dht) *dht_pos = i;
+
+  // UVCのカメラはEOIの後ろを0で埋めてくる場合がある
+  while (n > i + 2 && p[n - 1] == 0x00) n--;
+
+  if (p[n - 2] != 0xff || p[n - 1] != M_EOI) return !0;
+
+  *end = n;
+
+  return 0;
+}
+
+/*
+ * デキューしたMJPEGのフレームを検査する (DHTの位置は検査方法によらず求め、
+ * 破損していた場合のフラグはJPEG_CHECK_NONE以外の場合のみ立てる)
+ */
 static void
-mb_copyto(mblock_t* src, void* dst, size_t* used)
+check_jpeg(camera_t* cam, mblock_t* mb)
+{
+  mplane_t* pl;
+  size_t end;
+  int err;
+
+  if (mb->nplane != 1) return;
+
+  pl = mb->plane;
+
+  err = scan_jpeg((uint8_t*)pl->ptr + pl->offset, pl->used - pl->offset,
+                  &end, &mb->dht_pos);
+  if (err) {
+    if (cam->jpeg_check != JPEG_CHECK_NONE) {
+      mb->info.flags |= V4L2_BUF_FLAG_ERROR;
+    }
+    return;
+  }
+
+  mb->used -= (pl->used - pl->offset) - end;
+  pl->used  = pl->offset + end;
+}
+
+/*
+ * プレーン中の画像データの範囲を求める (値は一度だけ読み出し、プレーン
+ * の大きさに丸める)
+ */
+static size_t
+pl_extent(mplane_t* pl, size_t* off)
+{
+  size_t used;
+
+  used = pl->used;
+  *off = pl->offset;
+
+  if (used > pl->size) used = pl->size;
+  if (*off > used) *off = used;
+
+  return used - *off;
+}
+
+/*
+ * 全プレーンの画像データを連結してコピーする (limitを超える分は切り捨て
+ * る)。コピーしたバイト数を返す。
+ */
+static size_t
+mb_copyto(mblock_t* src, void* dst, size_t limit)
+{
+  mplane_t* pl;
+  uint8_t* p;
+  size_t off;
+  size_t n;
+  int i;
+
+  p = (uint8_t*)dst;
+
+  for (i = 0; i < src->nplane; i++) {
+    pl = src->plane + i;
+    n  = pl_extent(pl, &off);
+
+    if (n > limit) n = limit;
+
+    memcpy(p, (uint8_t*)pl->ptr + off, n);
+    p     += n;
+    limit -= n;
+  }
+
+  return p - (uint8_t*)dst;
+}
+
+/*
+ * get_image()の結果としてコピーする (MJPEGでDHTを省略している場合は、
+ * SOSの前に標準のDHTを挟み込みながらコピーする)
+ * DHTを挟み込めなかった場合は!0を返す。
+ */
+static int
+copy_image(camera_t* cam, mblock_t* src, void* dst, size_t* used)
+{
+  uint8_t* s;
+  uint8_t* d;
+  size_t pos;
+  size_t off;
+  size_t n;
+
+  pos = src->dht_pos;
+
+  if (pos == 0) {
+    *used = mb_copyto(src, dst, cam->image_size);
+    return 0;
+  }
+
+  // DHTを補うのは単一プレーンの場合のみ (check_jpeg()を参照)
+  n = pl_extent(src->plane, &off);
+  if (pos > n) pos = n;
+
+  // 通常はDHT_HEADROOMの分だけ余裕があるので、ここには来ない
+  if (n + sizeof(std_dht) > cam->image_size) {
+    *used = mb_copyto(src, dst, cam->image_size);
+    return !0;
+  }
+
+  s = (uint8_t*)src->plane[0].ptr + off;
+  d = (uint8_t*)dst;
+
+  memcpy(d, s, pos);
+  memcpy(d + pos, std_dht, sizeof(std_dht));
+  memcpy(d + pos + sizeof(std_dht), s + pos, n - pos);
+
+  *used = n + sizeof(std_dht);
+
+  return 0;
+}
+
+/*
+ * 破損したフレームとして捨てるか否か
+ */
+static int
+is_dropped(camera_t* cam, mblock_t* mb)
 {
-  memcpy(dst, src->ptr, src->used);
-  *used = src->used;
+  return (cam->jpeg_check == JPEG_CHECK_DROP && IS_JPEG(cam->format) &&
+          (mb->info.flags & V4L2_BUF_FLAG_ERROR));
 }
 
 static void
 mb_discard(mblock_t* mb)
 {
-  if (mb->ptr != NULL) {
-    munmap(mb->ptr, mb->size);
-    mb->ptr = NULL;
+  int i;
+
+  for (i = 0; i < mb->nplane; i++) {
+    if (mb->plane[i].ptr != NULL) {
+      munmap(mb->plane[i].ptr, mb->plane[i].size);
+      mb->plane[i].ptr = NULL;
+    }
+
+    if (mb->plane[i].dmabuf >= 0) {
+      close(mb->plane[i].dmabuf);
+      mb->plane[i].dmabuf = -1;
+    }
+  }
+}
+
+/*
+ * MMAPのバッファをプレーン毎にdmabufとしてエクスポートする
+ */
+static int
+mb_export(mblock_t* mb, int fd, uint32_t type, int idx)
+{
+  int ret;
+  int err;
+  int i;
+  struct v4l2_exportbuffer exp;
+
+  ret = 0;
+
+  for (i = 0; i < mb->nplane; i++) {
+    BZERO(exp);
+
+    exp.type  = type;
+    exp.index = idx;
+    exp.plane = i;
+    exp.flags = O_RDONLY | O_CLOEXEC;
+
+    err = xioctl(fd, VIDIOC_EXPBUF, &exp);
+    if (err < 0) {
+      perror("ioctl(VIDIOC_EXPBUF)");
+      ret = !0;
+      break;
+    }
+
+    mb->plane[i].dmabuf = exp.fd;
   }
+
+  return ret;
 }
 
 static int
-request_buffer(int fd, int n, mblock_t* mb)
+request_buffer(camera_t* cam)
 {
   int ret;
   int err;
   int i;
+  int j;
+  int fd;
+  uint32_t type;
+  mblock_t* mb;
 
   struct v4l2_requestbuffers req;
   struct v4l2_buffer buf;
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
   /*
    * initialize
    */
-  ret = 0;
-
-  bzero(mb, sizeof(*mb) * n);
+  ret  = 0;
+  mb   = NULL;
+  fd   = cam->fd;
+  type = cam->buf_type;
 
   /*
    * body
@@ -251,9 +701,9 @@ request_buffer(int fd, int n, mblock_t* mb)
      */
     BZERO(req);
 
-    req.count  = n;
-    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.count  = cam->num_buffers;
+    req.type   = type;
+    req.memory = cam->memory;
 
     err = xioctl(fd, VIDIOC_REQBUFS, &req);
     if (err < 0) {
@@ -262,16 +712,54 @@ request_buffer(int fd, int n, mblock_t* mb)
       break;
     }
 
+    // ドライバは要求と異なる数を割り当てる場合がある
+    if (req.count < MIN_NUM_BUFFERS) {
+      fprintf(stderr, "request_buffer():insufficient buffer memory.\n");
+      ret = !0;
+      break;
+    }
+
+    mb = (mblock_t*)calloc(req.count, sizeof(mblock_t));
+    if (mb == NULL) {
+      ret = !0;
+      break;
+    }
+
+    for (i = 0; i < (int)req.count; i++) {
+      for (j = 0; j < MAX_PLANE; j++) mb[i].plane[j].dmabuf = -1;
+    }
+
+    /*
+     * allocate buffer from user area (USERPTR)
+     */
+    if (cam->memory == V4L2_MEMORY_USERPTR) {
+      for (i = 0; i < (int)req.count; i++) {
+        err = mb_alloc(mb + i, cam->num_planes, cam->plane_size, cam->hugepage);
+        if (err) {
+          ret = !0;
+          break;
+        }
+      }
+
+      if (ret) break;
+    }
+
     /*
-     * get camera buffer and mapping to user area
+     * get camera buffer and mapping to user area (MMAP)
      */
-    for (i = 0; i < n; i++) {
+    for (i = 0; i < (int)req.count && cam->memory == V4L2_MEMORY_MMAP; i++) {
       BZERO(buf);
 
-      buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      buf.type   = type;
       buf.memory = V4L2_MEMORY_MMAP;
       buf.index  = i;
 
+      if (IS_MPLANE(type)) {
+        BZERO(planes);
+        buf.m.planes = planes;
+        buf.length   = VIDEO_MAX_PLANES;
+      }
+
       err = xioctl(fd, VIDIOC_QUERYBUF, &buf);
       if (err < 0) {
         perror( "ioctl(VIDIOC_QUERYBUF)");
@@ -284,57 +772,161 @@ request_buffer(int fd, int n, mblock_t* mb)
         ret = !0;
         break;
       }
+
+      if (cam->export_dmabuf) {
+        err = mb_export(mb + i, fd, type, i);
+        if (err) {
+          ret = !0;
+          break;
+        }
+      }
     }
 
     if (ret) break;
 
+    /*
+     * set return parameters
+     */
+    cam->num_buffers = req.count;
+    cam->mb          = mb;
+
+    /*
+     * GCにバッファの分のメモリ使用量を通知しておく(rubyから見えない領域
+     * なので、通知しないとGCの起動が遅れる)
+     */
+    cam->buffer_memory = 0;
+    for (i = 0; i < (int)req.count; i++) {
+      for (j = 0; j < mb[i].nplane; j++) {
+        cam->buffer_memory += mb[i].plane[j].size;
+      }
+    }
+
+#ifdef RUBY_EXTLIB
+    rb_gc_adjust_memory_usage((ssize_t)cam->buffer_memory);
+#endif /* defined(RUBY_EXTLIB) */
+
   } while (0);
 
   /*
    * post process
    */
-  if (ret) {
-    for (i = 0; i < n; i++) {
-      if (mb[i].ptr != NULL) mb_discard(mb + i);
-    }
+  if (ret && mb != NULL) {
+    for (i = 0; i < (int)req.count; i++) mb_discard(mb + i);
+
+    free(mb);
   }
 
   return ret;
 }
 
+static void
+release_buffer(camera_t* cam)
+{
+  int i;
+
+  if (cam->mb != NULL) {
+    for (i = 0; i < cam->num_buffers; i++) mb_discard(cam->mb + i);
+
+    free(cam->mb);
+    cam->mb = NULL;
+
+#ifdef RUBY_EXTLIB
+    rb_gc_adjust_memory_usage(-(ssize_t)cam->buffer_memory);
+#endif /* defined(RUBY_EXTLIB) */
+    cam->buffer_memory = 0;
+  }
+}
+
+/*
+ * デバイスを開き直して、ドライバ側のバッファも含めて解放する
+ * (フォーマット等の変更はバッファを確保したままでは行えないため)
+ */
 static int
-enqueue_buffer(int fd, int i)
+reset_device(camera_t* cam)
 {
-  int err;
   int ret;
-  struct v4l2_buffer buf;
 
   ret = 0;
 
-  BZERO(buf);
+  close(cam->fd);
+  release_buffer(cam);
 
-  buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buf.memory = V4L2_MEMORY_MMAP;
-  buf.index  = i;
+  cam->fd = open(cam->device, O_RDWR);
+  cam->fd_serial++;
 
-  err = xioctl(fd, VIDIOC_QBUF, &buf);
-  if (err) {
-    perror("ioctl(VIDIOC_QBUF)");
+  if (cam->fd < 0) {
+    perror("open()");
+    cam->state = ST_ERROR;
     ret = !0;
   }
 
   return ret;
 }
 
-static int
-start(int fd)
-{
+/*
+ * 設定変更時に呼び出す。前回のキャプチャで確保したバッファを保持している
+ * 場合は、値が変わる時だけデバイスをリセットする。
+ */
+#define reconfigure(cam,changed) \
+                                  (((cam)->mb != NULL && (changed))? \
+                                   reset_device(cam): 0)
+
+static int
+enqueue_buffer(camera_t* cam, int i)
+{
+  int err;
+  int ret;
+  struct v4l2_buffer buf;
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  mblock_t* mb;
+  int j;
+
+  ret = 0;
+  mb  = cam->mb + i;
+
+  BZERO(buf);
+
+  buf.type   = cam->buf_type;
+  buf.memory = cam->memory;
+  buf.index  = i;
+
+  if (IS_MPLANE(cam->buf_type)) {
+    BZERO(planes);
+    buf.m.planes = planes;
+    buf.length   = VIDEO_MAX_PLANES;
+
+    if (cam->memory == V4L2_MEMORY_USERPTR) {
+      buf.length = mb->nplane;
+
+      for (j = 0; j < mb->nplane; j++) {
+        planes[j].m.userptr = (unsigned long)mb->plane[j].ptr;
+        planes[j].length    = mb->plane[j].size;
+      }
+    }
+
+  } else if (cam->memory == V4L2_MEMORY_USERPTR) {
+    buf.m.userptr = (unsigned long)mb->plane[0].ptr;
+    buf.length    = mb->plane[0].size;
+  }
+
+  err = xioctl(cam->fd, VIDIOC_QBUF, &buf);
+  if (err) {
+    perror("ioctl(VIDIOC_QBUF)");
+    ret = !0;
+  }
+
+  return ret;
+}
+
+static int
+start(int fd, uint32_t type)
+{
   int ret;
   int err;
   enum v4l2_buf_type typ;
 
   ret = 0;
-  typ = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  typ = type;
 
   err = xioctl(fd, VIDIOC_STREAMON, &typ);
   if (err < 0) {
@@ -346,14 +938,14 @@ start(int fd)
 }
 
 static int
-stop(int fd)
+stop(int fd, uint32_t type)
 {
   int ret;
   int err;
   enum v4l2_buf_type typ;
 
   ret = 0;
-  typ = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  typ = type;
 
   err = xioctl(fd, VIDIOC_STREAMOFF, &typ);
   if (err < 0) {
@@ -365,28 +957,68 @@ stop(int fd)
 }
 
 static int
-query_captured_buffer(int fd, int* plane, size_t* used)
+query_captured_buffer(camera_t* cam, int* plane)
 {
   int ret;
   int err;
   struct v4l2_buffer buf;
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  mblock_t* dst;
+  size_t used;
+  size_t off;
+  int i;
 
   ret = 0;
 
   BZERO(buf);
 
-  buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buf.memory = V4L2_MEMORY_MMAP;
+  buf.type   = cam->buf_type;
+  buf.memory = cam->memory;
+
+  if (IS_MPLANE(cam->buf_type)) {
+    BZERO(planes);
+    buf.m.planes = planes;
+    buf.length   = VIDEO_MAX_PLANES;
+  }
 
-  err = xioctl(fd, VIDIOC_DQBUF, &buf);
+  err = xioctl(cam->fd, VIDIOC_DQBUF, &buf);
   if (err < 0) {
       perror( "ioctl(VIDIOC_DQBUF)");
       ret = !0;
   }
 
   if (!ret) {
+    dst       = cam->mb + buf.index;
+    dst->used = 0;
+
+    // bytesusedはdata_offsetを含む(ドライバの不正な値はバッファ内に丸める)
+    for (i = 0; i < dst->nplane; i++) {
+      if (IS_MPLANE(cam->buf_type)) {
+        used = planes[i].bytesused;
+        off  = planes[i].data_offset;
+      } else {
+        used = buf.bytesused;
+        off  = 0;
+      }
+
+      if (used > dst->plane[i].size) used = dst->plane[i].size;
+      if (off > used) off = used;
+
+      dst->plane[i].used   = used;
+      dst->plane[i].offset = off;
+      dst->used           += used - off;
+    }
+
+    dst->info.timestamp = buf.timestamp;
+    dst->info.sequence  = buf.sequence;
+    dst->info.flags     = buf.flags;
+    dst->info.field     = buf.field;
+    dst->info.skipped   = 0;
+    dst->dht_pos        = 0;
+
+    if (IS_JPEG(cam->format)) check_jpeg(cam, dst);
+
     *plane = buf.index;
-    *used  = buf.bytesused;
   }
 
   return ret;
@@ -397,26 +1029,46 @@ update_image_size(camera_t* cam)
 {
   int ret;
   size_t size;
+  int bpl;
 
   ret = 0;
 
+  /*
+   * ここで求めるのはstart前の見積もりで、start時にドライバが通知した値で
+   * 置き換えられる。圧縮フォーマットの場合は最大サイズの目安。
+   */
   switch (cam->format) {
+  case V4L2_PIX_FMT_NV12:
   case V4L2_PIX_FMT_NV21:
-    size = (cam->width * cam->height * 3) / 2;
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YVU420:
+  case V4L2_PIX_FMT_NV12M:
+  case V4L2_PIX_FMT_YUV420M:
+    // 幅・高さが奇数の場合、色差は切り上げた画素数分になる
+    size = (cam->width * cam->height) +
+           (CHROMA(cam->width) * CHROMA(cam->height) * 2);
+    bpl  = cam->width;
     break;
 
-  case V4L2_PIX_FMT_YUYV:
   case V4L2_PIX_FMT_NV16:
+    size = (cam->width * cam->height) + (CHROMA(cam->width) * 2 * cam->height);
+    bpl  = cam->width;
+    break;
+
+  case V4L2_PIX_FMT_YUYV:
   case V4L2_PIX_FMT_RGB565:
     size = cam->width * cam->height * 2;
+    bpl  = cam->width * 2;
     break;
 
   case V4L2_PIX_FMT_MJPEG:
     size = cam->width * cam->height;
+    bpl  = 0;
     break;
 
   case V4L2_PIX_FMT_H264:
     size = cam->width * cam->height * 3;
+    bpl  = 0;
     break;
 
   default:
@@ -424,124 +1076,1710 @@ update_image_size(camera_t* cam)
     ret = !0;
   }
 
-  if (!ret) cam->image_size = size;
+  if (!ret) {
+    cam->image_size     = size + DHT_HEADROOM(cam->format);
+    cam->bytes_per_line = bpl;
+    cam->num_planes     = 1;
+    cam->plane_bpl[0]   = bpl;
+    cam->plane_size[0]  = size;
+  }
+
+  return ret;
+}
+
+/*
+ * S_FMTでドライバが選択した設定をコンテキストに反映する
+ */
+static void
+apply_format(camera_t* cam, struct v4l2_format* fmt)
+{
+  struct v4l2_pix_format_mplane* mp;
+  size_t size;
+  int i;
+
+  if (IS_MPLANE(fmt->type)) {
+    mp          = &fmt->fmt.pix_mp;
+
+    cam->format = mp->pixelformat;
+    cam->width  = mp->width;
+    cam->height = mp->height;
+
+    update_image_size(cam);
+
+    // プレーン毎のサイズの合計を画像サイズとする
+    for (i = 0, size = 0; i < mp->num_planes && i < MAX_PLANE; i++) {
+      size += mp->plane_fmt[i].sizeimage;
+    }
+
+    if (size > 0) {
+      cam->image_size     = size + DHT_HEADROOM(cam->format);
+      cam->bytes_per_line = mp->plane_fmt[0].bytesperline;
+      cam->num_planes     = i;
+
+      for (i = 0; i < cam->num_planes; i++) {
+        cam->plane_bpl[i]  = mp->plane_fmt[i].bytesperline;
+        cam->plane_size[i] = mp->plane_fmt[i].sizeimage;
+      }
+    }
+
+  } else {
+    cam->format = fmt->fmt.pix.pixelformat;
+    cam->width  = fmt->fmt.pix.width;
+    cam->height = fmt->fmt.pix.height;
+
+    update_image_size(cam);
+
+    // ドライバがサイズを通知しない場合は見積もりのまま使用する
+    if (fmt->fmt.pix.sizeimage > 0) {
+      cam->image_size     = fmt->fmt.pix.sizeimage +
+                            DHT_HEADROOM(cam->format);
+      cam->bytes_per_line = fmt->fmt.pix.bytesperline;
+      cam->plane_bpl[0]   = fmt->fmt.pix.bytesperline;
+      cam->plane_size[0]  = fmt->fmt.pix.sizeimage;
+    }
+  }
+}
+
+static int
+open_wakeup(int fds[2])
+{
+  int ret;
+  int err;
+  int i;
+
+  ret = 0;
+
+  do {
+    err = pipe(fds);
+    if (err < 0) {
+      perror("pipe()");
+      ret = !0;
+      break;
+    }
+
+    for (i = 0; i < 2; i++) {
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+      fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+  } while (0);
+
+  return ret;
+}
+
+static void
+drain_wakeup(camera_t* cam)
+{
+  char buf[16];
+
+  while (read(cam->wakeup[0], buf, sizeof(buf)) > 0);
+}
+
+/*
+ * デバイスが読み出し可能になるか、camera_interrupt()が呼ばれるまで待つ。
+ * (GVLを保持していない状態で呼ばれるので、Rubyの機能は使用しないこと)
+ * デバイスを監視しない場合はfdに-1を指定する。
+ *
+ *   戻り値
+ *     0: 読み出し可能
+ *     1: 割り込まれた
+ *     2: タイムアウト
+ *    -1: エラー
+ */
+static int
+wait_fd(camera_t* cam, int fd, int timeout)
+{
+  int ret;
+  int err;
+  struct pollfd pfd[2];
+
+  pfd[0].fd      = cam->wakeup[0];
+  pfd[0].events  = POLLIN;
+  pfd[0].revents = 0;
+
+  pfd[1].fd      = fd;
+  pfd[1].events  = POLLIN;
+  pfd[1].revents = 0;
+
+  err = poll(pfd, (fd >= 0)? 2: 1, timeout);
+
+  if (err < 0) {
+    ret = (errno == EINTR)? 1: -1;
+
+  } else if (err == 0) {
+    ret = 2;
+
+  } else if (pfd[0].revents & POLLIN) {
+    drain_wakeup(cam);
+    ret = 1;
+
+  } else if (pfd[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    ret = -1;
+
+  } else {
+    ret = 0;
+  }
+
+  return ret;
+}
+
+#define wait_frame(cam,tmo)       wait_fd((cam), (cam)->fd, (tmo))
+#define sleep_interruptible(cam,tmo) \
+                                  wait_fd((cam), -1, (tmo))
+
+/*
+ * タイムアウト処理用の単調増加時刻 [ms]
+ */
+int64_t
+camera_monotonic_msec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * 期限までの残り時間をpoll()のタイムアウト値として求める
+ * (期限に負の値を指定した場合は無期限)
+ */
+static int
+remain_msec(int64_t deadline)
+{
+  int64_t rem;
+
+  if (deadline < 0) return -1;
+
+  rem = deadline - camera_monotonic_msec();
+
+  return (rem > 0)? (int)rem: 0;
+}
+
+static void
+capture_frame(camera_t* cam, int timeout)
+{
+  int err;
+  int plane;
+  int next;
+  uint32_t skipped;
+
+	// これはwarning対応
+	plane = 0;
+
+  switch (wait_frame(cam, timeout)) {
+  case 1:
+    cam->state = ST_BREAK;
+    break;
+
+  case 2:
+    cam->state = ST_TIMEOUT;
+    break;
+
+  case -1:
+    perror("poll()");
+    cam->state = ST_ERROR;
+    break;
+
+  default:
+    do {
+      err = query_captured_buffer(cam, &plane);
+      if (err) {
+        cam->state = ST_ERROR;
+        break;
+      }
+
+      if (cam->latest >= 0) {
+        err = enqueue_buffer(cam, cam->latest & ~COPIED);
+        if (err) {
+          cam->state = ST_ERROR;
+          break;
+        }
+      }
+
+      /*
+       * 低遅延モードの場合は、既に届いているフレームを全てデキューし、
+       * 最新のもの以外はすぐにドライバに戻す
+       */
+      skipped = 0;
+
+      while (cam->low_latency && wait_frame(cam, 0) == 0) {
+        err = query_captured_buffer(cam, &next);
+        if (err) break;
+
+        err = enqueue_buffer(cam, plane);
+        if (err) break;
+
+        plane = next;
+        skipped++;
+      }
+
+      if (err) {
+        cam->state = ST_ERROR;
+        break;
+      }
+
+      cam->mb[plane].info.skipped = skipped;
+      cam->latest = plane;
+
+    } while(0);
+    break;
+  }
+}
+
+/*
+ * バックグラウンドキャプチャ
+ *
+ * キャプチャスレッドはデキューしたバッファのインデックスをseqlock方式で公開
+ * する。直前に公開していたバッファは公開先を切り替えた後で再キューするので、
+ * 読み出し側はコピーの前後でseqが変化していなければ、コピー中にそのバッファ
+ * がドライバに戻されていないことを確認できる。
+ */
+
+static void*
+capture_thread(void* arg)
+{
+  camera_t* cam;
+  struct pollfd pfd[2];
+  int err;
+  int plane;
+  int prev;
+  int held;
+
+  cam  = (camera_t*)arg;
+  prev = -1;
+  held = -1;
+
+  while (cam->running) {
+    // 読み出し中で戻せなかったバッファは、読み出しが終わっていれば戻す
+    if (held >= 0 &&
+        __atomic_load_n(&cam->claimed, __ATOMIC_SEQ_CST) != held) {
+      err = enqueue_buffer(cam, held);
+      if (err) {
+        cam->failed = !0;
+        break;
+      }
+
+      held = -1;
+    }
+
+    pfd[0].fd      = cam->fd;
+    pfd[0].events  = POLLIN;
+    pfd[0].revents = 0;
+
+    /*
+     * 停止要求で直ちに抜けられるよう専用のパイプも監視する
+     * (wakeupは待っているRuby側のスレッドが読み出すので共用しない)
+     */
+    pfd[1].fd      = cam->halt[0];
+    pfd[1].events  = POLLIN;
+    pfd[1].revents = 0;
+
+    err = poll(pfd, 2, (held >= 0)? MAILBOX_WAIT_PERIOD: THREAD_POLL_PERIOD);
+    if (err == 0) continue;
+    if (err < 0 && errno == EINTR) continue;
+    if (pfd[1].revents & POLLIN) break;
+
+    if (err < 0 || (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+      cam->failed = !0;
+      break;
+    }
+
+    err = query_captured_buffer(cam, &plane);
+    if (err) {
+      cam->failed = !0;
+      break;
+    }
+
+    // 破損したフレームは公開せずにドライバに戻す
+    if (is_dropped(cam, cam->mb + plane)) {
+      err = enqueue_buffer(cam, plane);
+      if (err) {
+        cam->failed = !0;
+        break;
+      }
+
+      continue;
+    }
+
+    // 公開 (書き込み中はseqを奇数にする)
+    __atomic_add_fetch(&cam->seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&cam->published, plane, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cam->seq, 1, __ATOMIC_SEQ_CST);
+
+    /*
+     * 公開が外れたバッファをドライバに戻す (読み出し中の場合は終わるまで
+     * 保持する。read_mailbox()はclaimedを設定した後にseqを読み直すので、
+     * ここでclaimedが見えなければ読み出し側が公開の変化に気付く)
+     */
+    if (prev >= 0 &&
+        __atomic_load_n(&cam->claimed, __ATOMIC_SEQ_CST) == prev) {
+      held = prev;
+
+    } else if (prev >= 0) {
+      err = enqueue_buffer(cam, prev);
+      if (err) {
+        cam->failed = !0;
+        break;
+      }
+    }
+
+    prev = plane;
+  }
+
+  return NULL;
+}
+
+static int
+start_thread(camera_t* cam)
+{
+  int ret;
+  int err;
+
+  ret = 0;
+
+  cam->seq       = 0;
+  cam->last_seq  = 0;
+  cam->published = -1;
+  cam->claimed   = -1;
+  cam->failed    = 0;
+  cam->running   = !0;
+
+  do {
+    err = open_wakeup(cam->halt);
+    if (err) {
+      cam->running = 0;
+      ret = !0;
+      break;
+    }
+
+    err = pthread_create(&cam->thread, NULL, capture_thread, cam);
+    if (err) {
+      fprintf(stderr, "pthread_create():%s\n", strerror(err));
+      close(cam->halt[0]);
+      close(cam->halt[1]);
+      cam->running = 0;
+      ret = !0;
+    }
+  } while (0);
+
+  return ret;
+}
+
+static void
+stop_thread(camera_t* cam)
+{
+  char c;
+
+  if (cam->running) {
+    cam->running = 0;
+
+    // poll()で待っているスレッドを起こす
+    c = 0;
+    if (write(cam->halt[1], &c, 1) < 0) perror("write()");
+
+    pthread_join(cam->thread, NULL);
+
+    close(cam->halt[0]);
+    close(cam->halt[1]);
+  }
+}
+
+static void
+read_mailbox(camera_t* cam, void* ptr, size_t* used, int timeout)
+{
+  uint32_t s1;
+  uint32_t s2;
+  int plane;
+  int64_t deadline;
+  int tmo;
+  int err;
+
+  deadline = (timeout >= 0)? camera_monotonic_msec() + timeout: -1;
+
+  while (1) {
+    if (cam->failed) {
+      cam->state = ST_ERROR;
+      break;
+    }
+
+    s1 = __atomic_load_n(&cam->seq, __ATOMIC_ACQUIRE);
+
+    if (s1 == 0) {
+      // まだ最初のフレームが届いていない
+      tmo = remain_msec(deadline);
+      if (tmo == 0) {
+        cam->state = ST_TIMEOUT;
+        break;
+      }
+
+      if (tmo < 0 || tmo > MAILBOX_WAIT_PERIOD) tmo = MAILBOX_WAIT_PERIOD;
+
+      if (sleep_interruptible(cam, tmo) == 1) {
+        cam->state = ST_BREAK;
+        break;
+      }
+
+      continue;
+    }
+
+    if (s1 & 1) {
+      // 公開の途中なので、キャプチャスレッドに譲ってから読み直す
+      sched_yield();
+      continue;
+    }
+
+    /*
+     * 公開中のバッファを読み出し中として確保する。確保した後もseqが変わっ
+     * ていなければ、キャプチャスレッドはこのバッファを再キューしない。
+     */
+    plane = __atomic_load_n(&cam->published, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&cam->claimed, plane, __ATOMIC_SEQ_CST);
+
+    s2 = __atomic_load_n(&cam->seq, __ATOMIC_SEQ_CST);
+    if (s1 != s2) {
+      __atomic_store_n(&cam->claimed, -1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    err       = copy_image(cam, cam->mb + plane, ptr, used);
+    cam->info = cam->mb[plane].info;
+    if (err) cam->info.flags |= V4L2_BUF_FLAG_ERROR;
+
+    __atomic_store_n(&cam->claimed, -1, __ATOMIC_SEQ_CST);
+    break;
+  }
+
+  /*
+   * 前回の読み出しから公開されたフレーム数を元に読み飛ばした数を求める
+   * (同じフレームを再度読んだ場合は0)
+   */
+  if (cam->state == ST_REQUESTED) {
+    cam->info.skipped = (s1 - cam->last_seq > 2)?
+                          (s1 - cam->last_seq) / 2 - 1: 0;
+    cam->last_seq     = s1;
+  }
+}
+
+/*
+ * コピーした生の画像をJPEGに置き換える (出力がsizeimageに収まらない場合は
+ * エラーとする)
+ */
+static void
+encode_image(camera_t* cam, void* ptr, size_t* used)
+{
+  const void* out;
+  size_t n;
+  int err;
+
+  err = codec_encode_jpeg(cam->encoder, cam->format, ptr, *used,
+                          cam->bytes_per_line, cam->width, cam->height,
+                          cam->jpeg_quality, &out, &n);
+
+  if (err || n > cam->image_size) {
+    cam->state = ST_ERROR;
+    return;
+  }
+
+  memcpy(ptr, out, n);
+  *used = n;
+}
+
+/*
+ * フレーム取得処理の本体 (GVLを開放した状態で実行される)
+ */
+typedef struct {
+  camera_t* cam;
+  void* ptr;
+  size_t* used;
+  int timeout;
+} get_image_arg_t;
+
+static void*
+get_image_body(void* _arg)
+{
+  get_image_arg_t* arg;
+  camera_t* cam;
+  int64_t deadline;
+  uint32_t dropped;
+  int err;
+
+  arg = (get_image_arg_t*)_arg;
+  cam = arg->cam;
+
+  cam->state = ST_REQUESTED;
+
+  if (cam->background) {
+    read_mailbox(cam, arg->ptr, arg->used, arg->timeout);
+
+  } else {
+    deadline = (arg->timeout >= 0)? camera_monotonic_msec() + arg->timeout: -1;
+    capture_frame(cam, arg->timeout);
+
+    /*
+     * 破損したフレームを捨てる場合は、残り時間で次のフレームを待ち直す
+     * (捨てたフレームは読み飛ばした数に含める)
+     */
+    dropped = 0;
+
+    while (cam->state == ST_REQUESTED &&
+           is_dropped(cam, cam->mb + cam->latest)) {
+      dropped += cam->mb[cam->latest].info.skipped + 1;
+      capture_frame(cam, remain_msec(deadline));
+    }
+
+    if (cam->state == ST_REQUESTED) {
+      err = 0;
+
+      if (arg->ptr != NULL) {
+        err = copy_image(cam, cam->mb + cam->latest, arg->ptr, arg->used);
+      }
+
+      cam->info          = cam->mb[cam->latest].info;
+      cam->info.skipped += dropped;
+
+      // DHTを補えなかったフレームは破損扱いとする
+      if (err) cam->info.flags |= V4L2_BUF_FLAG_ERROR;
+    }
+  }
+
+  /*
+   * エンコードはコピーした後で行う (バックグラウンドキャプチャの場合も、
+   * キャプチャスレッドのバッファの入れ替えを待たせない)
+   */
+  if (cam->state == ST_REQUESTED && arg->ptr != NULL &&
+      (cam->flags & F_JPG_OUTPUT) && !IS_JPEG(cam->format)) {
+    encode_image(cam, arg->ptr, arg->used);
+  }
+
+  return NULL;
+}
+
+#ifdef RUBY_EXTLIB
+static void
+unblock_get_image(void* arg)
+{
+  camera_interrupt((camera_t*)arg);
+}
+#endif /* defined(RUBY_EXTLIB) */
+
+static void
+get_image(camera_t* cam, void* ptr, size_t* used, int timeout)
+{
+  get_image_arg_t arg;
+#ifdef RUBY_EXTLIB
+  int64_t deadline;
+#endif /* defined(RUBY_EXTLIB) */
+
+  arg.cam     = cam;
+  arg.ptr     = ptr;
+  arg.used    = used;
+  arg.timeout = timeout;
+
+#ifdef RUBY_EXTLIB
+  deadline = (timeout >= 0)? camera_monotonic_msec() + timeout: -1;
+
+  while (1) {
+    /*
+     * 保留中の割り込みがある場合get_image_body()は呼ばれずに戻ってくるので、
+     * 割り込まれた状態にしてから呼び出す。
+     */
+    cam->state = ST_BREAK;
+    rb_thread_call_without_gvl2(get_image_body, &arg, unblock_get_image, cam);
+
+    if (cam->state != ST_BREAK) break;
+
+    /*
+     * 割り込まれた場合は保留されている割り込み(例外やシグナルハンドラ等)を
+     * 処理する。例外が発生しなければ待ち直す。
+     */
+    cam->state = ST_READY;
+    rb_thread_check_ints();
+
+    // 待ち直す場合は残り時間だけ待つ
+    arg.timeout = remain_msec(deadline);
+  }
+#else /* defined(RUBY_EXTLIB) */
+  get_image_body(&arg);
+#endif /* defined(RUBY_EXTLIB) */
+}
+
+/*
+ * GVLの開放を伴わないget_image() (既にGVLを開放している場合に使用する)
+ */
+static void
+fetch_image(camera_t* cam, void* ptr, size_t* used, int timeout)
+{
+  get_image_arg_t arg;
+
+  arg.cam     = cam;
+  arg.ptr     = ptr;
+  arg.used    = used;
+  arg.timeout = timeout;
+
+  get_image_body(&arg);
+}
+
+static int
+try_get_image(camera_t* cam, void* ptr, size_t* used, int timeout,
+              int* ready, void (*getter)(camera_t*, void*, size_t*, int),
+              int claimed)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (cam == NULL) break;
+    if (ready == NULL) break;
+
+    /*
+     * check statement
+     * (claimedが真の場合はcamera_claim_image()で確保済みであること)
+     */
+    if (claimed) {
+      if (cam->state != ST_REQUESTED) break;
+
+    } else if (cam->state != ST_PREPARE && cam->state != ST_READY) {
+      break;
+    }
+
+    /*
+     * image copy
+     */
+    *ready = 0;
+
+		// 状態を変更
+    cam->state = ST_REQUESTED;
+
+		// フレームをキャプチャーしてコピー。フレームが届くまで待つ。
+		getter(cam, ptr, used, timeout);
+
+    if (cam->state == ST_ERROR) {
+			// エラーが発生した場合はエラー状態を保持したまま処理をスキップする
+      break;
+    }
+
+		if (cam->state == ST_BREAK) {
+			// 割り込まれていた場合は、状態を元に戻して処理をスキップする
+			cam->state = ST_READY;
+			break;
+		}
+
+    if (cam->state == ST_TIMEOUT) {
+      // タイムアウトした場合はフレーム無しで成功とする
+      cam->state = ST_READY;
+      ret        = 0;
+      break;
+    }
+
+    // コピー済みであることをマーク
+    if (!cam->background) cam->latest |= COPIED;
+
+    // 状態を元に戻す
+    cam->state   = ST_READY;
+    *ready       = !0;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+/*
+ * ここからパブリックな関数
+ */
+
+int
+camera_initialize(camera_t* cam, char* dev)
+{
+  int ret;
+  int err;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (cam == NULL) break;
+    if (strnlen(dev, N(cam->device)) >= N(cam->device)) break;
+
+    /*
+     * initailize context data
+     */
+    bzero(cam, sizeof(*cam));
+    cam->fd        = -1;
+    cam->wakeup[0] = -1;
+    cam->wakeup[1] = -1;
+
+    /*
+     * camera open
+     */
+    err = device_open(dev, &cam->fd, &cam->buf_type,
+                      cam->name, cam->driver, cam->bus);
+    if (err) break;
+
+    cam->fd_serial++;
+
+    /*
+     * create pipe for interrupt the waiting
+     */
+    err = open_wakeup(cam->wakeup);
+    if (err) break;
+
+    /*
+     * initialize camera context
+     */
+    strcpy(cam->device, dev);
+
+    cam->format          = DEFAULT_FORMAT;
+    cam->width           = DEFAULT_WIDTH;
+    cam->height          = DEFAULT_HEIGHT;
+    cam->framerate.num   = DEFAULT_FRAMERATE_NUM;
+    cam->framerate.denom = DEFAULT_FRAMERATE_DENOM;
+    cam->num_buffers     = DEFAULT_NUM_BUFFERS;
+    cam->memory          = V4L2_MEMORY_MMAP;
+    cam->jpeg_quality    = DEFAULT_JPEG_QUALITY;
+    cam->jpeg_check      = JPEG_CHECK_NONE;
+                        
+    cam->state           = ST_INITIALIZED;
+    cam->latest          = -1;
+
+    update_image_size(cam);
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  /*
+   * fallback for error occured
+   */
+  if (ret) {
+    if (cam->fd >= 0) close(cam->fd);
+    if (cam->wakeup[0] >= 0) close(cam->wakeup[0]);
+    if (cam->wakeup[1] >= 0) close(cam->wakeup[1]);
+  }
+
+  return ret;
+}
+
+int
+camera_interrupt(camera_t* cam)
+{
+  int ret;
+  char c;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (cam == NULL) break;
+    if (cam->wakeup[1] < 0) break;
+
+    /*
+     * wake up the waiting thread
+     * (パイプが一杯の場合は既に通知済みなので無視する)
+     */
+    c = 0;
+    if (write(cam->wakeup[1], &c, 1) < 0 && errno != EAGAIN) break;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_format_desc(camera_t* cam, int i, struct v4l2_fmtdesc* dst)
+{
+  int ret;
+  int err;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argument
+     */
+    if (cam == NULL) break;
+    if (dst == NULL) break;
+
+    /*
+     * do query
+     */
+    memset(dst, 0, sizeof(*dst));
+
+    dst->index = i;
+    dst->type  = cam->buf_type;
+
+    err = xioctl(cam->fd, VIDIOC_ENUM_FMT, dst);
+
+    if (err) break;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_get_control_info(camera_t* cam, int ctrl, struct v4l2_queryctrl* dst)
+{
+  int ret;
+  int err;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argument
+     */
+    if (cam == NULL) break;
+    if (dst == NULL) break;
+
+    /*
+     * do query
+     */
+    memset(dst, 0, sizeof(*dst));
+
+    dst->id = ctrl;
+
+    err = xioctl(cam->fd, VIDIOC_QUERYCTRL, dst);
+    if (err) break;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_get_frame_size(camera_t* cam, uint32_t fmt, uint32_t idx,
+                      struct v4l2_frmsizeenum* dst)
+{
+  int ret;
+  int err;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argument
+     */
+    if (cam == NULL) break;
+    if (dst == NULL) break;
+
+    /*
+     * do query
+     */
+    memset(dst, 0, sizeof(*dst));
+
+    dst->index        = idx;
+    dst->pixel_format = fmt;
+
+    err = xioctl(cam->fd, VIDIOC_ENUM_FRAMESIZES, dst);
+    if (err) break;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_get_frame_rate(camera_t* cam, uint32_t fmt,
+                      uint32_t wd, uint32_t ht, uint32_t idx,
+                      struct v4l2_frmivalenum* dst)
+{
+  int ret;
+  int err;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argument
+     */
+    if (cam == NULL) break;
+    if (dst == NULL) break;
+
+    /*
+     * do query
+     */
+    memset(dst, 0, sizeof(*dst));
+
+    dst->index        = idx;
+    dst->pixel_format = fmt;
+    dst->width        = wd;
+    dst->height       = ht;
+
+    err = xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, dst);
+    if (err) break;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_get_menu_item(camera_t* cam, int ctrl, int index,
+                     struct v4l2_querymenu* dst)
+{
+  int ret;
+  int err;
+
+  do {
+      /*
+       * entry process
+       */
+      ret = !0;
+
+      /*
+       * check argument
+       */
+      if (cam == NULL) break;
+      if (dst == NULL) break;
+
+      /*
+       * do query
+       */
+      memset(dst, 0, sizeof(*dst));
+
+      dst->id    = ctrl;
+      dst->index = index;
+
+      err = xioctl(cam->fd, VIDIOC_QUERYMENU, dst);
+      if (err) break;
+
+      /*
+       * mark succeed
+       */
+      ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_get_control(camera_t* cam, uint32_t id, int32_t* dst)
+{
+  int ret;
+  int err;
+  struct v4l2_control ctrl;
+
+  do {
+      /*
+       * entry process
+       */
+      ret = !0;
+
+      /*
+       * check argument
+       */
+      if (cam == NULL) break;
+      if (dst == NULL) break;
+
+      /*
+       * do ioctl
+       */
+      memset(&ctrl, 0, sizeof(ctrl));
+
+      ctrl.id = id;
+
+      err = xioctl(cam->fd, VIDIOC_G_CTRL, &ctrl);
+      if (err) {
+        perror("ioctl(VIDIOC_S_CTRL)");
+        break;
+      }
+
+      /*
+       * set return parameter
+       */
+      *dst = ctrl.value;
+
+      /*
+       * mark succeed
+       */
+      ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_set_control(camera_t* cam, uint32_t id, int32_t src)
+{
+  int ret;
+  int err;
+  struct v4l2_control ctrl;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argument
+     */
+    if (cam == NULL) break;
+
+    /*
+     * do ioctl
+     */
+    ctrl.id    = id;
+    ctrl.value = src;
+
+    err = xioctl(cam->fd, VIDIOC_S_CTRL, &ctrl);
+    if (err) {
+        perror("ioctl(VIDIOC_S_CTRL)");
+        break;
+    }
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while(0);
+
+  return ret;
+}
+
+int
+camera_set_format(camera_t* cam, uint32_t format)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argument
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+    
+    switch (format) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_YUV420M:
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_RGB565:
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_H264:
+      break;
+
+    default:
+      fprintf(stderr, "camera_set_format():unknown image format.\n");
+      goto out;
+    }
+
+    if (reconfigure(cam, cam->format != (int)format)) break;
+
+    /*
+     * update camera context
+     */
+    cam->format = format;
+    update_image_size(cam);
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while(0);
+
+  out:
+
+  return ret;
+}
+
+int
+camera_set_framerate(camera_t* cam, int num, int denom)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+
+    /*
+     * 前回のキャプチャで確保したバッファを保持している場合も、デバイスは
+     * リセットせずにそのまま適用する(S_PARMはストリームを止めていれば
+     * バッファを確保したままで変更できる)
+     */
+    if (cam->mb != NULL &&
+        (cam->framerate.num != num || cam->framerate.denom != denom)) {
+      if (set_param(cam->fd, cam->buf_type, num, denom)) break;
+
+      // 取得できない場合は要求値のままとする
+      get_param(cam->fd, cam->buf_type, &num, &denom);
+    }
+
+    /*
+     * update camera context
+     */
+    cam->framerate.num   = num;
+    cam->framerate.denom = denom;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_buffer_count(camera_t* cam, int* num)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (num == NULL) break;
+
+    /*
+     * set return paramater
+     */
+    *num = cam->num_buffers;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_set_buffer_count(camera_t* cam, int num)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+    if (num < MIN_NUM_BUFFERS || num > MAX_NUM_BUFFERS) break;
+
+    if (reconfigure(cam, cam->num_buffers != num)) break;
+
+    /*
+     * update camera context
+     */
+    cam->num_buffers = num;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_memory(camera_t* cam, int* memory)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (memory == NULL) break;
+
+    /*
+     * set return paramater
+     */
+    *memory = cam->memory;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_set_memory(camera_t* cam, int memory)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+    if (memory != V4L2_MEMORY_MMAP && memory != V4L2_MEMORY_USERPTR) break;
+    if (memory != V4L2_MEMORY_MMAP && cam->export_dmabuf) break;
+
+    if (reconfigure(cam, cam->memory != memory)) break;
+
+    /*
+     * update camera context
+     */
+    cam->memory = memory;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_hugepage(camera_t* cam, int* enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (enable == NULL) break;
+
+    /*
+     * set return paramater
+     */
+    *enable = cam->hugepage;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_set_hugepage(camera_t* cam, int enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+
+    enable = !!enable;
+
+    // MMAPの場合はバッファを確保し直す必要はない
+    if (cam->memory == V4L2_MEMORY_USERPTR) {
+      if (reconfigure(cam, cam->hugepage != enable)) break;
+    }
+
+    /*
+     * update camera context
+     */
+    cam->hugepage = enable;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_dmabuf_export(camera_t* cam, int* enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (enable == NULL) break;
+
+    /*
+     * set return paramater
+     */
+    *enable = cam->export_dmabuf;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_set_dmabuf_export(camera_t* cam, int enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+
+    enable = !!enable;
+
+    if (enable && cam->memory != V4L2_MEMORY_MMAP) break;
+    if (reconfigure(cam, cam->export_dmabuf != enable)) break;
+
+    /*
+     * update camera context
+     */
+    cam->export_dmabuf = enable;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_background(camera_t* cam, int* enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (enable == NULL) break;
+
+    /*
+     * set return paramater
+     */
+    *enable = cam->background;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_set_background(camera_t* cam, int enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+
+    /*
+     * update camera context
+     */
+    cam->background = !!enable;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_get_jpeg_output(camera_t* cam, int* enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (enable == NULL) break;
+
+    /*
+     * set return paramater
+     */
+    *enable = !!(cam->flags & F_JPG_OUTPUT);
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_set_jpeg_output(camera_t* cam, int enable)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+    if (enable && !codec_is_available()) break;
 
-  return ret;
-}
+    /*
+     * update camera context
+     */
+    if (enable) {
+      cam->flags |= F_JPG_OUTPUT;
+    } else {
+      cam->flags &= ~F_JPG_OUTPUT;
+    }
 
-static VALUE
-wait_fd(VALUE arg)
-{
-  camera_t* cam = (camera_t*)arg;
+    /*
+     * mark succeed
+     */
+    ret = 0;
 
-  rb_thread_wait_fd(cam->fd);
+  } while (0);
 
-  return Qundef;
+  return ret;
 }
 
-#ifdef RUBY_EXTLIB
-static void
-capture_frame(camera_t* cam)
+int
+camera_get_jpeg_quality(camera_t* cam, int* quality)
 {
-  int err;
-  int plane;
-  size_t used;
-  int state;
-
-  errno = 0;
-
-	// これはwarning対応
-	used  = 0;
-	plane = 0;
-
-  rb_protect(wait_fd, (VALUE)cam, &state);
-
-  if (state == 8) {
-    cam->state = ST_ERROR;
-    rb_jump_tag(state);
-
-  } else if (state != 0) {
-    cam->state = ST_READY;
-    rb_jump_tag(state);
+  int ret;
 
-  } else if (errno == EINTR) {
-    cam->state = ST_BREAK;
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
 
-  } else {
-    do {
-      err = query_captured_buffer(cam->fd, &plane, &used);
-      if (err) {
-        cam->state = ST_ERROR;
-        break;
-      }
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (quality == NULL) break;
 
-      cam->mb[plane].used = used;
+    /*
+     * set return paramater
+     */
+    *quality = cam->jpeg_quality;
 
-      if (cam->latest >= 0) {
-        err = enqueue_buffer(cam->fd, cam->latest & ~COPIED);
-        if (err) {
-          cam->state = ST_ERROR;
-          break;
-        }
-      }
+    /*
+     * mark succeed
+     */
+    ret = 0;
 
-      cam->latest = plane;
+  } while (0);
 
-    } while(0);
-  }
+  return ret;
 }
-#else /* defined(RUBY_EXTLIB_ */
-static void
-capture_frame(camera_t* cam)
+
+int
+camera_set_jpeg_quality(camera_t* cam, int quality)
 {
-  int err;
-  int plane;
-  size_t used;
-  int state;
-  fd_set fds;
-  size_t used;
+  int ret;
 
   do {
-		// これはwarning対応
-		used  = 0;
-		plane = 0;
-
-    FD_ZERO(&fds);
-    FD_SET(cam->fd, &fds);
-    select(cam->fd + 1, &fds, NULL, NULL, NULL);
+    /*
+     * entry process
+     */
+    ret = !0;
 
-    if (errno == EINTR) continue;
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (quality < 1 || quality > 100) break;
 
-		err = query_captured_buffer(cam->fd, &plane, &used);
-		if (err) {
-			cam->state = ST_ERROR;
-			break;
-		}
+    /*
+     * update camera context
+     * (キャプチャ中でも変更可能で、次のフレームから反映される)
+     */
+    cam->jpeg_quality = quality;
 
-		cam->mb[plane].used = used;
+    /*
+     * mark succeed
+     */
+    ret = 0;
 
-		if (cam->latest >= 0) {
-			err = enqueue_buffer(cam->fd, cam->latest & ~COPIED);
-			if (err) {
-				cam->state = ST_ERROR;
-				break;
-			}
-		}
+  } while (0);
 
-		cam->latest = plane;
-	} while(0);
+  return ret;
 }
-#endif /* defined(RUBY_EXTLIB_ */
-
-/*
- * ここからパブリックな関数
- */
 
 int
-camera_initialize(camera_t* cam, char* dev)
+camera_get_jpeg_check(camera_t* cam, int* mode)
 {
   int ret;
-  int err;
 
   do {
     /*
@@ -550,38 +2788,49 @@ camera_initialize(camera_t* cam, char* dev)
     ret = !0;
 
     /*
-     * check arguments
+     * check argunments
      */
     if (cam == NULL) break;
-    if (strnlen(dev, N(cam->device)) >= N(cam->device)) break;
+    if (mode == NULL) break;
 
     /*
-     * initailize context data
+     * set return paramater
      */
-    bzero(cam, sizeof(*cam));
-    cam->fd = -1;
+    *mode = cam->jpeg_check;
 
     /*
-     * camera open
+     * mark succeed
      */
-    err = device_open(dev, &cam->fd, cam->name, cam->driver, cam->bus);
-    if (err) break;
+    ret = 0;
+
+  } while (0);
 
+  return ret;
+}
+
+int
+camera_set_jpeg_check(camera_t* cam, int mode)
+{
+  int ret;
+
+  do {
     /*
-     * initialize camera context
+     * entry process
      */
-    strcpy(cam->device, dev);
+    ret = !0;
 
-    cam->format          = DEFAULT_FORMAT;
-    cam->width           = DEFAULT_WIDTH;
-    cam->height          = DEFAULT_HEIGHT;
-    cam->framerate.num   = DEFAULT_FRAMERATE_NUM;
-    cam->framerate.denom = DEFAULT_FRAMERATE_DENOM;
-                        
-    cam->state           = ST_INITIALIZED;
-    cam->latest          = -1;
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (mode != JPEG_CHECK_NONE && mode != JPEG_CHECK_FLAG &&
+        mode != JPEG_CHECK_DROP) break;
 
-    update_image_size(cam);
+    /*
+     * update camera context
+     * (キャプチャ中でも切り替え可能で、次にデキューしたフレームから反映)
+     */
+    cam->jpeg_check = mode;
 
     /*
      * mark succeed
@@ -590,21 +2839,13 @@ camera_initialize(camera_t* cam, char* dev)
 
   } while (0);
 
-  /*
-   * fallback for error occured
-   */
-  if (ret) {
-    if (cam->fd >= 0) close(cam->fd);
-  }
-
   return ret;
 }
 
 int
-camera_get_format_desc(camera_t* cam, int i, struct v4l2_fmtdesc* dst)
+camera_get_low_latency(camera_t* cam, int* enable)
 {
   int ret;
-  int err;
 
   do {
     /*
@@ -613,38 +2854,30 @@ camera_get_format_desc(camera_t* cam, int i, struct v4l2_fmtdesc* dst)
     ret = !0;
 
     /*
-     * check argument
+     * check argunments
      */
     if (cam == NULL) break;
-    if (dst == NULL) break;
+    if (enable == NULL) break;
 
     /*
-     * do query
+     * set return paramater
      */
-    memset(dst, 0, sizeof(*dst));
-
-    dst->index = i;
-    dst->type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    err = xioctl(cam->fd, VIDIOC_ENUM_FMT, dst);
-
-    if (err) break;
+    *enable = cam->low_latency;
 
     /*
      * mark succeed
      */
     ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
 int
-camera_get_control_info(camera_t* cam, int ctrl, struct v4l2_queryctrl* dst)
+camera_set_low_latency(camera_t* cam, int enable)
 {
   int ret;
-  int err;
 
   do {
     /*
@@ -653,37 +2886,30 @@ camera_get_control_info(camera_t* cam, int ctrl, struct v4l2_queryctrl* dst)
     ret = !0;
 
     /*
-     * check argument
+     * check argunments
      */
     if (cam == NULL) break;
-    if (dst == NULL) break;
 
     /*
-     * do query
+     * update camera context
+     * (キャプチャ中でも切り替え可能)
      */
-    memset(dst, 0, sizeof(*dst));
-
-    dst->id = ctrl;
-
-    err = xioctl(cam->fd, VIDIOC_QUERYCTRL, dst);
-    if (err) break;
+    cam->low_latency = !!enable;
 
     /*
      * mark succeed
      */
     ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
 int
-camera_get_frame_size(camera_t* cam, uint32_t fmt, uint32_t idx,
-                      struct v4l2_frmsizeenum* dst)
+camera_get_image_width(camera_t* cam, int* width)
 {
   int ret;
-  int err;
 
   do {
     /*
@@ -692,39 +2918,29 @@ camera_get_frame_size(camera_t* cam, uint32_t fmt, uint32_t idx,
     ret = !0;
 
     /*
-     * check argument
+     * check argunments
      */
     if (cam == NULL) break;
-    if (dst == NULL) break;
 
     /*
-     * do query
+     * set return paramater
      */
-    memset(dst, 0, sizeof(*dst));
-
-    dst->index        = idx;
-    dst->pixel_format = fmt;
-
-    err = xioctl(cam->fd, VIDIOC_ENUM_FRAMESIZES, dst);
-    if (err) break;
+    *width = cam->width;
 
     /*
      * mark succeed
      */
     ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
 int
-camera_get_frame_rate(camera_t* cam, uint32_t fmt,
-                      uint32_t wd, uint32_t ht, uint32_t idx,
-                      struct v4l2_frmivalenum* dst)
+camera_set_image_width(camera_t* cam, int width)
 {
   int ret;
-  int err;
 
   do {
     /*
@@ -733,127 +2949,100 @@ camera_get_frame_rate(camera_t* cam, uint32_t fmt,
     ret = !0;
 
     /*
-     * check argument
+     * check argunments
      */
     if (cam == NULL) break;
-    if (dst == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
+
+    if (reconfigure(cam, cam->width != width)) break;
 
     /*
-     * do query
+     * update camera context
      */
-    memset(dst, 0, sizeof(*dst));
-
-    dst->index        = idx;
-    dst->pixel_format = fmt;
-    dst->width        = wd;
-    dst->height       = ht;
-
-    err = xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, dst);
-    if (err) break;
+    cam->width = width;
+    update_image_size(cam);
 
     /*
      * mark succeed
      */
     ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
 int
-camera_get_menu_item(camera_t* cam, int ctrl, int index,
-                     struct v4l2_querymenu* dst)
+camera_get_image_height(camera_t* cam, int* height)
 {
   int ret;
-  int err;
 
   do {
-      /*
-       * entry process
-       */
-      ret = !0;
-
-      /*
-       * check argument
-       */
-      if (cam == NULL) break;
-      if (dst == NULL) break;
-
-      /*
-       * do query
-       */
-      memset(dst, 0, sizeof(*dst));
+    /*
+     * entry process
+     */
+    ret = !0;
 
-      dst->id    = ctrl;
-      dst->index = index;
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
 
-      err = xioctl(cam->fd, VIDIOC_QUERYMENU, dst);
-      if (err) break;
+    /*
+     * set return paramater
+     */
+    *height = cam->height;
 
-      /*
-       * mark succeed
-       */
-      ret = 0;
+    /*
+     * mark succeed
+     */
+    ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
+
 int
-camera_get_control(camera_t* cam, uint32_t id, int32_t* dst)
+camera_set_image_height(camera_t* cam, int height)
 {
   int ret;
-  int err;
-  struct v4l2_control ctrl;
 
   do {
-      /*
-       * entry process
-       */
-      ret = !0;
-
-      /*
-       * check argument
-       */
-      if (cam == NULL) break;
-      if (dst == NULL) break;
-
-      /*
-       * do ioctl
-       */
-      memset(&ctrl, 0, sizeof(ctrl));
+    /*
+     * entry process
+     */
+    ret = !0;
 
-      ctrl.id = id;
+    /*
+     * check argunments
+     */
+    if (cam == NULL) break;
+    if (cam->state != ST_INITIALIZED) break;
 
-      err = xioctl(cam->fd, VIDIOC_G_CTRL, &ctrl);
-      if (err) {
-        perror("ioctl(VIDIOC_S_CTRL)");
-        break;
-      }
+    if (reconfigure(cam, cam->height != height)) break;
 
-      /*
-       * set return parameter
-       */
-      *dst = ctrl.value;
+    /*
+     * update camera context
+     */
+    cam->height = height;
+    update_image_size(cam);
 
-      /*
-       * mark succeed
-       */
-      ret = 0;
+    /*
+     * mark succeed
+     */
+    ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
 int
-camera_set_control(camera_t* cam, uint32_t id, int32_t src)
+camera_get_image_size(camera_t* cam, size_t* sz)
 {
   int ret;
-  int err;
-  struct v4l2_control ctrl;
 
   do {
     /*
@@ -862,34 +3051,28 @@ camera_set_control(camera_t* cam, uint32_t id, int32_t src)
     ret = !0;
 
     /*
-     * check argument
+     * check argunments
      */
     if (cam == NULL) break;
+    if (sz == NULL) break;
 
     /*
-     * do ioctl
+     * set return paramater
      */
-    ctrl.id    = id;
-    ctrl.value = src;
-
-    err = xioctl(cam->fd, VIDIOC_S_CTRL, &ctrl);
-    if (err) {
-        perror("ioctl(VIDIOC_S_CTRL)");
-        break;
-    }
+    *sz = cam->image_size;
 
     /*
      * mark succeed
      */
     ret = 0;
 
-  } while(0);
+  } while (0);
 
   return ret;
 }
 
 int
-camera_set_format(camera_t* cam, uint32_t format)
+camera_get_output_format(camera_t* cam, uint32_t* format, int* bpl)
 {
   int ret;
 
@@ -900,44 +3083,36 @@ camera_set_format(camera_t* cam, uint32_t format)
     ret = !0;
 
     /*
-     * check argument
+     * check argunments
      */
     if (cam == NULL) break;
-    if (cam->state != ST_INITIALIZED) break;
-    
-    switch (format) {
-    case V4L2_PIX_FMT_NV21:
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_NV16:
-    case V4L2_PIX_FMT_RGB565:
-    case V4L2_PIX_FMT_MJPEG:
-    case V4L2_PIX_FMT_H264:
-      break;
-
-    default:
-      fprintf(stderr, "camera_set_format():unknown image format.\n");
-      goto out;
-    }
+    if (format == NULL) break;
+    if (bpl == NULL) break;
 
     /*
-     * update camera context
+     * set return paramater
      */
-    cam->format = format;
-    update_image_size(cam);
+    if ((cam->flags & F_JPG_OUTPUT) && !IS_JPEG(cam->format)) {
+      *format = V4L2_PIX_FMT_MJPEG;
+      *bpl    = 0;
+
+    } else {
+      *format = cam->format;
+      *bpl    = cam->bytes_per_line;
+    }
 
     /*
      * mark succeed
      */
     ret = 0;
-  } while(0);
 
-  out:
+  } while (0);
 
   return ret;
 }
 
 int
-camera_set_framerate(camera_t* cam, int num, int denom)
+camera_get_bytes_per_line(camera_t* cam, int* bpl)
 {
   int ret;
 
@@ -951,13 +3126,12 @@ camera_set_framerate(camera_t* cam, int num, int denom)
      * check argunments
      */
     if (cam == NULL) break;
-    if (cam->state != ST_INITIALIZED) break;
+    if (bpl == NULL) break;
 
     /*
-     * update camera context
+     * set return paramater
      */
-    cam->framerate.num   = num;
-    cam->framerate.denom = denom;
+    *bpl = cam->bytes_per_line;
 
     /*
      * mark succeed
@@ -970,7 +3144,7 @@ camera_set_framerate(camera_t* cam, int num, int denom)
 }
 
 int
-camera_get_image_width(camera_t* cam, int* width)
+camera_finalize(camera_t* cam)
 {
   int ret;
 
@@ -981,14 +3155,46 @@ camera_get_image_width(camera_t* cam, int* width)
     ret = !0;
 
     /*
-     * check argunments
+     * check argument
      */
     if (cam == NULL) break;
 
     /*
-     * set return paramater
+     * 開始したまま解放される場合(停止せずにGCで回収された場合など)は、
+     * キャプチャスレッドを止めてから閉じる
      */
-    *width = cam->width;
+    if (cam->state == ST_PREPARE || cam->state == ST_READY) {
+      camera_stop(cam);
+
+      // STREAMOFFに失敗してもデバイスは閉じる
+      if (cam->state == ST_STOPPING) cam->state = ST_INITIALIZED;
+    }
+
+    if (cam->state != ST_INITIALIZED && cam->state != ST_ERROR) break;
+
+    stop_thread(cam);
+
+    if (cam->state != ST_ERROR) {
+      /*
+       * closing camera device
+       */
+      close(cam->fd);
+      release_buffer(cam);
+    }
+
+    codec_encoder_destroy(cam->encoder);
+    codec_decoder_destroy(cam->decoder);
+
+    close(cam->wakeup[0]);
+    close(cam->wakeup[1]);
+
+    /*
+     * destroy camera context
+     */
+    bzero(cam, sizeof(*cam));
+
+    cam->fd    = -1;
+    cam->state = ST_FINALIZED;
 
     /*
      * mark succeed
@@ -1001,9 +3207,14 @@ camera_get_image_width(camera_t* cam, int* width)
 }
 
 int
-camera_set_image_width(camera_t* cam, int width)
+camera_start(camera_t* cam)
 {
   int ret;
+  int err;
+  int i;
+  int j;
+  size_t size;
+  struct v4l2_format fmt;
 
   do {
     /*
@@ -1018,10 +3229,78 @@ camera_set_image_width(camera_t* cam, int width)
     if (cam->state != ST_INITIALIZED) break;
 
     /*
-     * update camera context
+     * setup for JPEG encoder
+     * (エンコードできるのはconvert_to_planes()で扱えるフォーマットのみ)
      */
-    cam->width = width;
-    update_image_size(cam);
+    if ((cam->flags & F_JPG_OUTPUT) && !IS_JPEG(cam->format)) {
+      if (!convert_is_supported(cam->format)) break;
+
+      if (cam->encoder == NULL) {
+        cam->encoder = codec_encoder_new();
+        if (cam->encoder == NULL) break;
+      }
+    }
+
+    /*
+     * setup for camera device
+     * (前回のバッファを保持している場合は設定済みなので、再キューのみ行う)
+     */
+    if (cam->mb == NULL) {
+      err = set_format(cam->fd, cam->buf_type,
+                       cam->format, cam->width, cam->height, &fmt);
+      if (err) break;
+
+      apply_format(cam, &fmt);
+
+      err = set_param(cam->fd, cam->buf_type,
+                      cam->framerate.num, cam->framerate.denom);
+      if (err) break;
+
+      // 取得できない場合は要求値のままとする
+      get_param(cam->fd, cam->buf_type,
+                &cam->framerate.num, &cam->framerate.denom);
+
+      err = request_buffer(cam);
+      if (err) break;
+
+      // 実際のバッファがsizeimageより大きい場合はそれに合わせる
+      // (USERPTRの場合はページ境界への切り上げ分なので対象外)
+      for (i = 0; i < cam->num_buffers; i++) {
+        if (cam->memory != V4L2_MEMORY_MMAP) break;
+
+        for (j = 0, size = 0; j < cam->mb[i].nplane; j++) {
+          size += cam->mb[i].plane[j].size;
+        }
+
+        size += DHT_HEADROOM(cam->format);
+        if (cam->image_size < size) cam->image_size = size;
+      }
+    }
+
+    for (i = 0; i < cam->num_buffers; i++) {
+        err = enqueue_buffer(cam, i);
+        if (err) break;
+    }
+    if (err) break;
+
+
+    /*
+     * start image capture
+     */
+    cam->state = ST_PREPARE;
+
+    err = start(cam->fd, cam->buf_type);
+    if (err) break;
+
+    if (cam->background) {
+      err = start_thread(cam);
+      if (err) {
+        stop(cam->fd, cam->buf_type);
+        break;
+      }
+    }
+
+    cam->state = ST_READY;
 
     /*
      * mark succeed
@@ -1030,13 +3309,32 @@ camera_set_image_width(camera_t* cam, int width)
 
   } while (0);
 
+  if (ret) {
+    /*
+     * post process on error occured.
+     */
+    if (cam->state == ST_PREPARE) {
+      cam->state = ST_INITIALIZED;
+    }
+
+    /*
+     * 以下の資源を確保したままになっているかもしれないので、デバイスを開き
+     * 直して解放しておく
+     *   - ドライバ側のバッファ
+     *   - リクエストバッファ
+     */
+    if (cam->state == ST_INITIALIZED) reset_device(cam);
+  }
+
   return ret;
 }
 
 int
-camera_get_image_height(camera_t* cam, int* height)
+camera_stop(camera_t* cam)
 {
   int ret;
+  int err;
+  int i;
 
   do {
     /*
@@ -1045,14 +3343,55 @@ camera_get_image_height(camera_t* cam, int* height)
     ret = !0;
 
     /*
-     * check argunments
+     * check argument
      */
     if (cam == NULL) break;
 
     /*
-     * set return paramater
+     * stop image capture
      */
-    *height = cam->height;
+    if (cam->state != ST_PREPARE && cam->state != ST_READY &&
+        cam->state != ST_ERROR) {
+      break;
+    }
+
+    // キャプチャスレッドはデバイスを閉じる前に必ず止める
+    stop_thread(cam);
+
+    if (cam->state != ST_ERROR) {
+      cam->state = ST_STOPPING;
+
+      if (cam->state != ST_ERROR) {
+        err = stop(cam->fd, cam->buf_type);
+        if (err) break;
+      }
+
+      /*
+       * STREAMOFFで全てのバッファがデキューされた状態になるので、デバイス
+       * とマッピングはそのまま保持して次回のstartで再キューする
+       * (設定が変更された場合はその時点でデバイスをリセットする)
+       */
+      for (i = 0; i < cam->num_buffers; i++) {
+        cam->mb[i].lent = 0;
+      }
+
+      cam->state  = ST_INITIALIZED;
+      cam->latest = -1;
+      cam->lent   = 0;
+
+    } else {
+      /*
+       * エラーの場合はオブジェクトの再利用を許さない。
+       * 再オープンも初期化も行わず、デバイスのクロー
+       * ズとリソースの解放のみを行う。
+       */
+      close(cam->fd);
+      release_buffer(cam);
+
+      cam->fd_serial++;
+      cam->latest = -1;
+      cam->lent   = 0;
+    }
 
     /*
      * mark succeed
@@ -1064,9 +3403,27 @@ camera_get_image_height(camera_t* cam, int* height)
   return ret;
 }
 
-
 int
-camera_set_image_height(camera_t* cam, int height)
+camera_get_image(camera_t* cam, void* ptr, size_t* used)
+{
+  int ret;
+  int ready;
+
+  ret = camera_try_get_image(cam, ptr, used, -1, &ready);
+  if (!ret && !ready) ret = !0;
+
+  return ret;
+}
+
+int
+camera_try_get_image(camera_t* cam, void* ptr, size_t* used, int timeout,
+                     int* ready)
+{
+  return try_get_image(cam, ptr, used, timeout, ready, get_image, 0);
+}
+
+int
+camera_claim_image(camera_t* cam)
 {
   int ret;
 
@@ -1077,16 +3434,22 @@ camera_set_image_height(camera_t* cam, int height)
     ret = !0;
 
     /*
-     * check argunments
+     * check arguments
      */
     if (cam == NULL) break;
-    if (cam->state != ST_INITIALIZED) break;
 
     /*
-     * update camera context
+     * check statement
      */
-    cam->height = height;
-    update_image_size(cam);
+    if (cam->state != ST_PREPARE && cam->state != ST_READY) {
+      break;
+    }
+
+    /*
+     * claim the camera
+     * (以降はcamera_fetch_image()が終わるまで他からの取得を受け付けない)
+     */
+    cam->state = ST_REQUESTED;
 
     /*
      * mark succeed
@@ -1099,10 +3462,16 @@ camera_set_image_height(camera_t* cam, int height)
 }
 
 int
-camera_finalize(camera_t* cam)
+camera_fetch_image(camera_t* cam, void* ptr, size_t* used, int* ready)
+{
+  return try_get_image(cam, ptr, used, 0, ready, fetch_image, !0);
+}
+
+int
+camera_borrow_image(camera_t* cam, int* idx, void** ptr, size_t* used)
 {
   int ret;
-  int i;
+  mplane_t* pl;
 
   do {
     /*
@@ -1111,26 +3480,61 @@ camera_finalize(camera_t* cam)
     ret = !0;
 
     /*
-     * check argument
+     * check arguments
      */
     if (cam == NULL) break;
-    if (cam->state != ST_INITIALIZED && cam->state != ST_ERROR) break;
+    if (idx == NULL) break;
+    if (ptr == NULL) break;
+    if (used == NULL) break;
 
-    if (cam->state != ST_ERROR) {
-      /*
-       * closing camera device
-       */
-      close(cam->fd);
-      for (i = 0; i < NUM_PLANE; i++) mb_discard(cam->mb + i);
+    /*
+     * check statement
+     */
+    if (cam->state != ST_PREPARE && cam->state != ST_READY) {
+      break;
+    }
+
+    // バッファはキャプチャスレッドが管理している
+    if (cam->background) {
+      break;
+    }
+
+    // ドライバ側に最低1枚はバッファを残しておく
+    if (cam->lent >= cam->num_buffers - 2) {
+      break;
     }
 
     /*
-     * destroy camera context
+     * capture frame
      */
-    bzero(cam, sizeof(*cam));
+    cam->state = ST_REQUESTED;
 
-    cam->fd    = -1;
-    cam->state = ST_FINALIZED;
+    get_image(cam, NULL, NULL, -1);
+
+    if (cam->state == ST_ERROR) {
+      break;
+    }
+
+    if (cam->state == ST_BREAK || cam->state == ST_TIMEOUT) {
+      cam->state = ST_READY;
+      break;
+    }
+
+    /*
+     * lend the buffer
+     */
+    *idx  = cam->latest;
+    // マルチプレーンの場合は先頭のプレーンのみ
+    pl    = cam->mb[cam->latest].plane;
+    *ptr  = (uint8_t*)pl->ptr + pl->offset;
+    *used = pl->used - pl->offset;
+
+    // 貸出中のバッファは次回のキャプチャ時に再キューしない
+    cam->mb[cam->latest].lent = !0;
+    cam->lent++;
+    cam->latest = -1;
+
+    cam->state  = ST_READY;
 
     /*
      * mark succeed
@@ -1143,11 +3547,10 @@ camera_finalize(camera_t* cam)
 }
 
 int
-camera_start(camera_t* cam)
+camera_return_image(camera_t* cam, int idx)
 {
   int ret;
   int err;
-  int i;
 
   do {
     /*
@@ -1156,39 +3559,33 @@ camera_start(camera_t* cam)
     ret = !0;
 
     /*
-     * check argunments
+     * check arguments
      */
     if (cam == NULL) break;
-    if (cam->state != ST_INITIALIZED) break;
+    if (idx < 0 || idx >= cam->num_buffers) break;
 
     /*
-     * setup for camera device
+     * check statement
      */
-    err = set_format(cam->fd, cam->format, cam->width, cam->height);
-    if (err) break;
-
-    err = set_param(cam->fd, cam->framerate.num, cam->framerate.denom);
-    if (err) break;
-
-    err = request_buffer(cam->fd, NUM_PLANE, cam->mb);
-    if (err) break;
-
-    for (i = 0; i < NUM_PLANE; i++) {
-        err = enqueue_buffer(cam->fd, i);
-        if (err) break;
+    if (cam->state != ST_PREPARE && cam->state != ST_READY) {
+      break;
     }
-    if (err) break;
 
+    if (!cam->mb[idx].lent) {
+      break;
+    }
 
     /*
-     * start image capture
+     * give back to the driver
      */
-    cam->state = ST_PREPARE;
-
-    err = start(cam->fd);
-    if (err) break;
+    cam->mb[idx].lent = 0;
+    cam->lent--;
 
-    cam->state = ST_READY;
+    err = enqueue_buffer(cam, idx);
+    if (err) {
+      cam->state = ST_ERROR;
+      break;
+    }
 
     /*
      * mark succeed
@@ -1197,35 +3594,72 @@ camera_start(camera_t* cam)
 
   } while (0);
 
-  if (ret) {
-    /*
-     * post process on error occured.
-     */
-    if (cam->state == ST_PREPARE) {
-      cam->state = ST_INITIALIZED;
-    }
+  return ret;
+}
 
-    /*
-     * 以下の資源を確保したままになっているかもしれないので解放しておく
-     *   - ファイルハンドル
-     *   - リクエストバッファ
-     */
-    if (cam->fd >= 0) {
-        close(cam->fd);
-        cam->fd = -1;
-    }
+/*
+ * 連続した画像データをフォーマットに従って色プレーン毎に分割する
+ */
+static void
+split_planes(uint32_t format, int bpl0, int height,
+             uint8_t* base, size_t rest, plane_view_t* views, int* n)
+{
+  size_t size[MAX_PLANE];
+  int bpl[MAX_PLANE];
+  int i;
+
+  bpl[0]  = bpl0;
+  size[0] = (size_t)bpl[0] * height;
+  *n      = 1;
 
-    for (i = 0; i < NUM_PLANE; i++) mb_discard(cam->mb + i);
+  switch (format) {
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_NV21:
+  case V4L2_PIX_FMT_NV12M:
+    bpl[1]  = bpl[0];
+    size[1] = (size_t)bpl[1] * CHROMA(height);
+    *n      = 2;
+    break;
+
+  case V4L2_PIX_FMT_NV16:
+    bpl[1]  = bpl[0];
+    size[1] = size[0];
+    *n      = 2;
+    break;
+
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YVU420:
+  case V4L2_PIX_FMT_YUV420M:
+    bpl[1]  = CHROMA(bpl[0]);
+    size[1] = (size_t)bpl[1] * CHROMA(height);
+    bpl[2]  = bpl[1];
+    size[2] = size[1];
+    *n      = 3;
+    break;
   }
 
-  return ret;
+  // ストライドが不明な場合や圧縮フォーマットは分割しない
+  if (bpl[0] == 0) *n = 1;
+  if (*n == 1) size[0] = rest;
+
+  for (i = 0; i < *n; i++) {
+    if (size[i] > rest) size[i] = rest;
+
+    views[i].ptr            = base;
+    views[i].size           = size[i];
+    views[i].bytes_per_line = bpl[i];
+
+    base += size[i];
+    rest -= size[i];
+  }
 }
 
 int
-camera_stop(camera_t* cam)
+camera_get_plane_views(camera_t* cam, int idx, plane_view_t* views, int* n)
 {
   int ret;
-  int err;
+  mblock_t* mb;
+  mplane_t* pl;
   int i;
 
   do {
@@ -1235,55 +3669,53 @@ camera_stop(camera_t* cam)
     ret = !0;
 
     /*
-     * check argument
+     * check arguments
      */
     if (cam == NULL) break;
+    if (views == NULL) break;
+    if (n == NULL) break;
+    if (idx < 0 || idx >= cam->num_buffers) break;
 
     /*
-     * stop image capture
+     * check statement
      */
-    if (cam->state != ST_PREPARE && cam->state != ST_READY &&
-        cam->state != ST_ERROR) {
+    if (cam->state != ST_PREPARE && cam->state != ST_READY) {
       break;
     }
 
-    if (cam->state != ST_ERROR) {
-      cam->state = ST_STOPPING;
-
-      if (cam->state != ST_ERROR) {
-        err = stop(cam->fd);
-        if (err) break;
-      }
+    mb = cam->mb + idx;
 
-      /*
-       * device reset
-       */
-      close(cam->fd);
-      for (i = 0; i < NUM_PLANE; i++) mb_discard(cam->mb + i);
+    if (!mb->lent) {
+      break;
+    }
 
-      cam->fd = open(cam->device, O_RDWR);
-      if (cam->fd >= 0) {
-        cam->state  = ST_INITIALIZED;
-        cam->latest = -1;
+    /*
+     * プレーン毎にメモリが分かれている場合はそのまま返す
+     */
+    if (mb->nplane > 1) {
+      for (i = 0; i < mb->nplane; i++) {
+        pl = mb->plane + i;
 
-      } else {
-        cam->state  = ST_ERROR;
-        cam->latest = -1;
-        break;
+        views[i].ptr            = (uint8_t*)pl->ptr + pl->offset;
+        views[i].size           = pl->used - pl->offset;
+        views[i].bytes_per_line = cam->plane_bpl[i];
       }
 
-    } else {
-      /*
-       * エラーの場合はオブジェクトの再利用を許さない。
-       * 再オープンも初期化も行わず、デバイスのクロー
-       * ズとリソースの解放のみを行う。
-       */
-      close(cam->fd);
-      for (i = 0; i < NUM_PLANE; i++) mb_discard(cam->mb + i);
-
-      cam->latest = -1;
+      *n  = mb->nplane;
+      ret = 0;
+      break;
     }
 
+    /*
+     * 1つのメモリに連続して格納されている場合はフォーマットから各色プレー
+     * ンの位置を求める
+     */
+    pl = mb->plane;
+
+    split_planes(cam->format, cam->bytes_per_line, cam->height,
+                 (uint8_t*)pl->ptr + pl->offset, pl->used - pl->offset,
+                 views, n);
+
     /*
      * mark succeed
      */
@@ -1295,7 +3727,7 @@ camera_stop(camera_t* cam)
 }
 
 int
-camera_get_image(camera_t* cam, void* ptr, size_t* used)
+camera_get_frame_info(camera_t* cam, frame_info_t* info)
 {
   int ret;
 
@@ -1309,43 +3741,12 @@ camera_get_image(camera_t* cam, void* ptr, size_t* used)
      * check arguments
      */
     if (cam == NULL) break;
+    if (info == NULL) break;
 
     /*
-     * check statement
-     */
-    if (cam->state != ST_PREPARE && cam->state != ST_READY) {
-      break;
-    }
-
-    /*
-     * image copy
+     * set return parameter
      */
-
-		// 状態を変更
-    cam->state = ST_REQUESTED;
-
-		// フレームをキャプチャー。フレームが届くまで待つ。
-		capture_frame(cam);
-
-    if (cam->state == ST_ERROR) {
-			// エラーが発生した場合はエラー状態を保持したまま処理をスキップする
-      break;
-    }
-
-		if (cam->state == ST_BREAK) {
-			// 割り込まれていた場合は、状態を元に戻して処理をスキップする
-			cam->state = ST_READY;
-			break;
-		}
-
-    // フレームをコピー
-    mb_copyto(cam->mb + cam->latest, ptr, used);
-
-    // コピー済みであることをマーク
-    cam->latest |= COPIED;
-
-    // 状態を元に戻す
-    cam->state   = ST_READY;
+    *info = cam->info;
 
     /*
      * mark succeed
@@ -1379,13 +3780,7 @@ camera_check_busy(camera_t* cam, int* busy)
     /*
      * do check (try set format)
      */
-    BZERO(fmt);
-
-    fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width       = cam->width;
-    fmt.fmt.pix.height      = cam->height;
-    fmt.fmt.pix.pixelformat = cam->format;
-    fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+    init_format(&fmt, cam->buf_type, cam->format, cam->width, cam->height);
 
     err = xioctl(cam->fd, VIDIOC_S_FMT, &fmt);
     if (err >= 0) {
@@ -1463,3 +3858,94 @@ camera_check_error(camera_t* cam, int* error)
 
   return ret;
 }
+
+int
+camera_get_dmabuf(camera_t* cam, int idx, dmabuf_desc_t* descs, int* n)
+{
+  int ret;
+  mblock_t* mb;
+  int i;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (cam == NULL) break;
+    if (descs == NULL) break;
+    if (n == NULL) break;
+    if (idx < 0 || idx >= cam->num_buffers) break;
+
+    /*
+     * check statement
+     */
+    if (cam->state != ST_PREPARE && cam->state != ST_READY) {
+      break;
+    }
+
+    mb = cam->mb + idx;
+
+    if (!mb->lent || mb->plane[0].dmabuf < 0) {
+      break;
+    }
+
+    /*
+     * set return parameters
+     */
+    for (i = 0; i < mb->nplane; i++) {
+      descs[i].fd     = mb->plane[i].dmabuf;
+      descs[i].size   = mb->plane[i].size;
+      descs[i].offset = mb->plane[i].offset;
+      descs[i].used   = mb->plane[i].used - mb->plane[i].offset;
+    }
+
+    *n = mb->nplane;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
+
+int
+camera_split_image(uint32_t format, int bpl, int height, void* ptr,
+                   size_t size, plane_view_t* views, int* n)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ptr == NULL) break;
+    if (views == NULL) break;
+    if (n == NULL) break;
+    if (bpl < 0 || height < 0) break;
+
+    /*
+     * do split
+     */
+    split_planes(format, bpl, height, (uint8_t*)ptr, size, views, n);
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+
+  } while (0);
+
+  return ret;
+}
@@ -16,12 +16,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #ifdef RUBY_EXTLIB
 #include <ruby.h>
-#else /* defined(RUBY_EXTLIB) */
-#include <pthread.h>
-#endif /* !defined(RUBY_EXTLIB) */
+#endif /* defined(RUBY_EXTLIB) */
 
 #ifdef __OpenBSD__
 #include <sys/videoio.h>
@@ -31,14 +31,62 @@
 
 #define MAX_PLANE           3
 
-#define F_JPG_OUTPUT        1
+#define F_JPG_OUTPUT        1       /* 生の画像をJPEGにエンコードして返す */
 
-typedef struct __mblock__ {
+/*
+ * 破損したMJPEGのフレームの扱い
+ */
+#define JPEG_CHECK_NONE     0       /* そのまま返す */
+#define JPEG_CHECK_FLAG     1       /* 破損したフレームにERRORフラグを立てる */
+#define JPEG_CHECK_DROP     2       /* 破損したフレームを返さない */
+
+typedef struct __frame_info__ {
+  struct timeval timestamp;
+  uint32_t sequence;
+  uint32_t flags;
+  uint32_t field;
+  uint32_t skipped;
+} frame_info_t;
+
+typedef struct __mplane__ {
   void* ptr;
   size_t size;
   size_t used;
+  size_t offset;          /* プレーン先頭から画像データまでのオフセット */
+  int dmabuf;             /* VIDIOC_EXPBUFで取得したfd (未取得の場合は-1) */
+} mplane_t;
+
+typedef struct __mblock__ {
+  int nplane;
+  mplane_t plane[MAX_PLANE];
+  size_t used;            /* 全プレーンの画像データの合計 */
+  int lent;
+  frame_info_t info;
+  size_t dht_pos;         /* DHTを補う位置 (MJPEGでDHTが無い場合のSOS) */
 } mblock_t;
 
+/*
+ * 貸し出し中のバッファを色プレーン毎に参照するためのビュー
+ */
+typedef struct __plane_view__ {
+  void* ptr;
+  size_t size;
+  int bytes_per_line;
+} plane_view_t;
+
+/*
+ * 貸し出し中のバッファをdmabufとして他プロセスに渡すための記述子
+ */
+typedef struct __dmabuf_desc__ {
+  int fd;
+  size_t size;            /* バッファ全体の大きさ */
+  size_t offset;
+  size_t used;
+} dmabuf_desc_t;
+
+struct __codec_encoder__;
+struct __codec_decoder__;
+
 typedef struct __camera__ {
   char device[64];
 
@@ -47,6 +95,9 @@ typedef struct __camera__ {
   char bus[sizeof(((struct v4l2_capability*)NULL)->bus_info) + 1];
 
   int fd;
+  uint32_t buf_type;      /* CAPTUREかCAPTURE_MPLANE */
+  uint32_t fd_serial;     /* デバイスを閉じる/開き直す度に更新 */
+  int wakeup[2];
   int format;
   int width;
   int height;
@@ -58,10 +109,43 @@ typedef struct __camera__ {
 
   int state;
   size_t image_size;
+  int bytes_per_line;
+  int num_planes;
+  int plane_bpl[MAX_PLANE];
+  size_t plane_size[MAX_PLANE];
 
   int latest;
+  int lent;
+  int low_latency;
+  frame_info_t info;
+
+  int flags;              /* F_JPG_OUTPUT等 */
+  int jpeg_check;         /* JPEG_CHECK_NONE等 */
+  int jpeg_quality;
+  struct __codec_encoder__* encoder;
+  struct __codec_decoder__* decoder;  /* Frame#decodeで使い回す */
+
+  int num_buffers;
+  int memory;             /* V4L2_MEMORY_MMAPかV4L2_MEMORY_USERPTR */
+  int hugepage;
+  int export_dmabuf;
+  mblock_t* mb;
+  size_t buffer_memory;   /* mbで確保(またはマップ)しているバイト数の合計 */
 
-  mblock_t mb[MAX_PLANE];
+  /*
+   * バックグラウンドキャプチャ用
+   * (seqが奇数の間はpublishedの更新中、claimedは読み出し中のバッファで
+   * キャプチャスレッドはこれを再キューしない)
+   */
+  int background;
+  pthread_t thread;
+  volatile int running;
+  volatile int failed;
+  int halt[2];            /* stop_thread()からスレッドを起こすパイプ */
+  uint32_t seq;
+  uint32_t last_seq;
+  int published;
+  int claimed;
 } camera_t;
 
 #ifndef V4L2_CTRL_CLASS_JPEG
@@ -110,8 +194,158 @@ extern int camera_get_image_height(camera_t* cam, int* height);
 extern int camera_set_image_height(camera_t* cam, int height);
 extern int camera_set_framerate(camera_t* cam, int num, int denom);
 
+/*
+ * ストリーミング開始後はVIDIOC_REQBUFSで実際に確保された数を返します。
+ */
+extern int camera_get_buffer_count(camera_t* cam, int* num);
+extern int camera_set_buffer_count(camera_t* cam, int num);
+
+/*
+ * V4L2_MEMORY_USERPTRを指定すると、キャプチャバッファをドライバのメモリ
+ * ではなくページ境界に揃えた匿名メモリからstart()時に確保して使用します。
+ * hugepageを有効にした場合はHugeTLBページでの確保を試み、確保できなけれ
+ * ば通常のページにフォールバックします。
+ */
+extern int camera_get_memory(camera_t* cam, int* memory);
+extern int camera_set_memory(camera_t* cam, int memory);
+extern int camera_get_hugepage(camera_t* cam, int* enable);
+extern int camera_set_hugepage(camera_t* cam, int enable);
+
+/*
+ * dmabufのエクスポートを有効にすると、start()時に各バッファをVIDIOC_EXPBUF
+ * でエクスポートしておき、get_dmabuf()で借用中のバッファのfdを取得でき
+ * るようになります。エクスポートできるのはV4L2_MEMORY_MMAPの場合のみで、
+ * USERPTRとは同時に指定できません。
+ */
+extern int camera_get_dmabuf_export(camera_t* cam, int* enable);
+extern int camera_set_dmabuf_export(camera_t* cam, int enable);
+
+/*
+ * バックグラウンドキャプチャを有効にすると、start()でキャプチャスレッドを
+ * 起動し、以降get_image()は最新のフレームを待たずに返します(最初のフレー
+ * ムが届くまでは待ちます)。同じフレームを複数回返す場合があります。この
+ * モードではborrow_image()は使用できません。
+ */
+extern int camera_get_background(camera_t* cam, int* enable);
+extern int camera_set_background(camera_t* cam, int enable);
+
+/*
+ * 低遅延モードでは、フレーム取得時に既に届いているフレームを全てデキュー
+ * して最新のものだけを返します。読み飛ばしたフレームの数はフレーム情報の
+ * skippedに設定されます。
+ */
+extern int camera_get_low_latency(camera_t* cam, int* enable);
+extern int camera_set_low_latency(camera_t* cam, int enable);
+
+/*
+ * JPEG出力を有効にすると、YUYVやNV12等の生の画像をget_image()の中でJPEG
+ * にエンコードして返します(エンコーダはカメラ毎に1つ作り、フレーム間で
+ * 使い回します)。MJPEGの場合はそのまま返します。start()前にのみ設定でき、
+ * libjpegを使用せずにビルドした場合は有効にできません。品質(1〜100)は
+ * キャプチャ中でも変更できます。借用したバッファは生の画像のままです。
+ */
+extern int camera_get_jpeg_output(camera_t* cam, int* enable);
+extern int camera_set_jpeg_output(camera_t* cam, int enable);
+extern int camera_get_jpeg_quality(camera_t* cam, int* quality);
+extern int camera_set_jpeg_quality(camera_t* cam, int quality);
+
+/*
+ * MJPEGのフレームはデキュー時に常にSOI/EOIとSOSまでのマーカーの並びを
+ * 確認し、EOIの後ろの詰め物を取り除きます。ハフマンテーブル(DHT)を省略
+ * しているフレームには、get_image()でのコピー時に標準のDHTを補います。
+ * 検査方法は破損していた場合の扱いのみを指定し、JPEG_CHECK_FLAGではフ
+ * レーム情報のflagsにV4L2_BUF_FLAG_ERRORを立て、JPEG_CHECK_DROPでは次
+ * のフレームを待ち直します。検査するのはヘッダと末尾のみで、圧縮データ
+ * は走査しません。キャプチャ中でも変更できます。借用したバッファには
+ * DHTを補いません。
+ */
+extern int camera_get_jpeg_check(camera_t* cam, int* mode);
+extern int camera_set_jpeg_check(camera_t* cam, int mode);
+
+/*
+ * 画像サイズとストライドはstart前は見積もり値で、start後はドライバが通知
+ * した値になります(圧縮フォーマットの場合、ストライドは0)。幅・高さ・フレー
+ * ムレートもstart後はドライバが実際に選択した値に更新されます。
+ */
 extern int camera_get_image_size(camera_t* cam, size_t* sz);
+extern int camera_get_bytes_per_line(camera_t* cam, int* bpl);
+
+/*
+ * get_image()で取得する画像のフォーマットとストライドを返します(JPEG出力
+ * を有効にしている場合はMJPEGで、ストライドは0になります)。
+ */
+extern int camera_get_output_format(camera_t* cam, uint32_t* format,
+                                    int* bpl);
 extern int camera_get_image(camera_t* cam, void* ptr, size_t* used);
+
+/*
+ * timeoutで指定した時間[ms]だけフレームの到着を待ちます(0の場合は待たず、
+ * 負の値の場合は無期限に待ちます)。タイムアウトした場合も成功として扱い、
+ * *readyに0を設定します(バッファの内容は変更されません)。
+ */
+extern int camera_try_get_image(camera_t* cam, void* ptr, size_t* used,
+                                int timeout, int* ready);
+
+/*
+ * try_get_image()をタイムアウト0で呼び出すのと同じですが、内部でGVLの開放
+ * を行いません。epoll等で読み出し可能になったデバイスからGVLを開放したま
+ * まフレームを取り出す場合に使用します。
+ * GVLを開放する前にcamera_claim_image()でカメラを確保しておく必要があり
+ * ます(確保に成功したカメラは、必ずcamera_fetch_image()を呼び出して状態
+ * を戻してください)。確保している間は他からのフレームの取得は失敗します。
+ */
+extern int camera_claim_image(camera_t* cam);
+extern int camera_fetch_image(camera_t* cam, void* ptr, size_t* used,
+                              int* ready);
+
+/*
+ * get_image()等でフレームの到着を待っているスレッドを起こします(別スレッ
+ * ドやシグナルハンドラから呼び出すことを想定しています)。Ruby拡張として
+ * ビルドした場合は、GVL開放中の待ちを中断するためのアンブロック関数とし
+ * て使用します。
+ */
+extern int camera_interrupt(camera_t* cam);
+
+/*
+ * borrow_image()で取得したバッファはドライバに返却されないため、使用後は
+ * 必ずreturn_image()で返却すること。ドライバ側に最低1枚のバッファを残す
+ * 必要があるため、同時に借用できるのは(バッファ数 - 2)枚までとなる。
+ */
+extern int camera_borrow_image(camera_t* cam, int* idx, void** ptr,
+                               size_t* used);
+extern int camera_return_image(camera_t* cam, int idx);
+
+/*
+ * borrow_image()が返すのは先頭のプレーンのみです。借用中のバッファの各色
+ * プレーン(NV12のY/UV等)を参照する場合はget_plane_views()を使用してくださ
+ * い。マルチプレーンAPIでプレーン毎にバッファが分かれている場合も、1つの
+ * バッファに連続して格納されている場合も、コピーせずに参照を返します。
+ * viewsにはMAX_PLANE個分の領域が必要です。
+ */
+extern int camera_get_plane_views(camera_t* cam, int idx,
+                                  plane_view_t* views, int* n);
+
+/*
+ * get_image()で取得した画像(各プレーンを連結したもの)を、取得時のフォー
+ * マット・ストライド・高さに従って色プレーン毎に分割します。
+ */
+extern int camera_split_image(uint32_t format, int bpl, int height,
+                              void* ptr, size_t size,
+                              plane_view_t* views, int* n);
+
+/*
+ * 借用中のバッファのdmabufをメモリプレーン毎に返します。返すfdはバッファ
+ * 解放時まで有効なので、他プロセスに渡す場合は送信後も閉じないでくださ
+ * い。descsにはMAX_PLANE個分の領域が必要です。
+ */
+extern int camera_get_dmabuf(camera_t* cam, int idx,
+                             dmabuf_desc_t* descs, int* n);
+
+/*
+ * 直前にget_image()またはborrow_image()で取得したフレームの情報(ドライバが
+ * 設定したタイムスタンプ、シーケンス番号、フラグ等)を返します。
+ */
+extern int camera_get_frame_info(camera_t* cam, frame_info_t* info);
 extern int camera_check_busy(camera_t* cam, int *busy);
 extern int camera_check_ready(camera_t* cam, int *ready);
 extern int camera_check_error(camera_t* cam, int *error);
@@ -133,4 +367,9 @@ extern int camera_get_menu_item(camera_t* cam, int ctrl, int index,
 extern int camera_set_control(camera_t* cam, uint32_t id, int32_t value);
 extern int camera_get_control(camera_t* cam, uint32_t id, int32_t* value);
 
+/*
+ * タイムアウト処理用の単調増加時刻 [ms] を返します。
+ */
+extern int64_t camera_monotonic_msec(void);
+
 #endif /* !defined(__CAMERA_H__) */
@@ -0,0 +1,608 @@
+﻿/*
+ *
+ * Video 4 Linux V2 driver library (JPEG codec).
+ *
+ *  Copyright (C) 2015 Hiroshi Kuwagata. All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <jerror.h>
+#endif /* defined(HAVE_LIBJPEG) */
+
+#include "codec.h"
+#include "convert.h"
+
+#define CHROMA(x)                 (((x) + 1) / 2)
+#define ROUND_UP(x,n)             ((((x) + (n) - 1) / (n)) * (n))
+
+#define MCU_SIZE                  16      /* 4:2:0の場合のMCUの幅と高さ */
+#define MIN_OUTPUT_SIZE           (64 * 1024)
+#define MAX_READ_ROWS             16      /* read_scanlines()で一度に読む行数 */
+
+struct __codec_encoder__ {
+#ifdef HAVE_LIBJPEG
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  struct jpeg_destination_mgr dest;
+  jmp_buf env;
+#endif /* defined(HAVE_LIBJPEG) */
+
+  int width;              /* cinfoに設定済みの画像サイズと品質 */
+  int height;
+  int quality;
+
+  /*
+   * 作業領域 (MCUの幅に揃えた4:2:0のプレーン)
+   */
+  uint8_t* work;
+  size_t work_size;
+
+  /*
+   * 出力先
+   */
+  uint8_t* out;
+  size_t out_size;
+};
+
+struct __codec_decoder__ {
+#ifdef HAVE_LIBJPEG
+  struct jpeg_decompress_struct dinfo;
+  struct jpeg_error_mgr jerr;
+  struct jpeg_source_mgr src;
+  jmp_buf env;
+#endif /* defined(HAVE_LIBJPEG) */
+
+  uint8_t* out;
+  size_t out_size;
+};
+
+#ifdef HAVE_LIBJPEG
+/*
+ * libjpegのエラーは既定ではexit()するので、エンコード・デコード処理の先
+ * 頭に戻す
+ */
+static void
+encode_error(j_common_ptr cinfo)
+{
+  longjmp(((codec_encoder_t*)cinfo->client_data)->env, 1);
+}
+
+static void
+decode_error(j_common_ptr dinfo)
+{
+  longjmp(((codec_decoder_t*)dinfo->client_data)->env, 1);
+}
+
+static void
+init_destination(j_compress_ptr cinfo)
+{
+  codec_encoder_t* enc;
+
+  enc = (codec_encoder_t*)cinfo->client_data;
+
+  enc->dest.next_output_byte = enc->out;
+  enc->dest.free_in_buffer   = enc->out_size;
+}
+
+/*
+ * 出力先が一杯になったら倍に広げる (広げた領域は次回以降も使い回す)
+ */
+static boolean
+empty_output_buffer(j_compress_ptr cinfo)
+{
+  codec_encoder_t* enc;
+  uint8_t* out;
+
+  enc = (codec_encoder_t*)cinfo->client_data;
+  out = (uint8_t*)realloc(enc->out, enc->out_size * 2);
+  if (out == NULL) ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+  enc->dest.next_output_byte = out + enc->out_size;
+  enc->dest.free_in_buffer   = enc->out_size;
+
+  enc->out       = out;
+  enc->out_size *= 2;
+
+  return TRUE;
+}
+
+static void
+term_destination(j_compress_ptr cinfo)
+{
+  // nothing
+}
+
+/*
+ * 破損したフレームの警告は呼び出し側で扱うので表示しない
+ */
+static void
+output_message(j_common_ptr cinfo)
+{
+  // nothing
+}
+
+static void
+init_source(j_decompress_ptr dinfo)
+{
+  // nothing
+}
+
+/*
+ * 入力はメモリ上に全て揃っているので、ここに来るのはデータが途切れてい
+ * る場合のみ。EOIを補って残りを打ち切る。
+ */
+static boolean
+fill_input_buffer(j_decompress_ptr dinfo)
+{
+  static const JOCTET eoi[] = {0xff, JPEG_EOI};
+
+  WARNMS(dinfo, JWRN_JPEG_EOF);
+
+  dinfo->src->next_input_byte = eoi;
+  dinfo->src->bytes_in_buffer = sizeof(eoi);
+
+  return TRUE;
+}
+
+static void
+skip_input_data(j_decompress_ptr dinfo, long n)
+{
+  struct jpeg_source_mgr* src;
+
+  src = dinfo->src;
+
+  if (n <= 0) return;
+
+  while (n > (long)src->bytes_in_buffer) {
+    n -= (long)src->bytes_in_buffer;
+    fill_input_buffer(dinfo);
+  }
+
+  src->next_input_byte += n;
+  src->bytes_in_buffer -= n;
+}
+
+static void
+term_source(j_decompress_ptr dinfo)
+{
+  // nothing
+}
+
+/*
+ * 画像サイズか品質が変わった場合だけ圧縮パラメータを設定し直す
+ */
+static void
+setup_compress(codec_encoder_t* enc, int width, int height, int quality)
+{
+  struct jpeg_compress_struct* cinfo;
+
+  if (enc->width == width && enc->height == height &&
+      enc->quality == quality) {
+    return;
+  }
+
+  cinfo = &enc->cinfo;
+
+  cinfo->image_width      = width;
+  cinfo->image_height     = height;
+  cinfo->input_components = 3;
+  cinfo->in_color_space   = JCS_YCbCr;
+
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, quality, TRUE);
+
+  // 4:2:0のプレーンをそのまま渡す
+  cinfo->raw_data_in                = TRUE;
+  cinfo->comp_info[0].h_samp_factor = 2;
+  cinfo->comp_info[0].v_samp_factor = 2;
+  cinfo->comp_info[1].h_samp_factor = 1;
+  cinfo->comp_info[1].v_samp_factor = 1;
+  cinfo->comp_info[2].h_samp_factor = 1;
+  cinfo->comp_info[2].v_samp_factor = 1;
+
+  enc->width   = width;
+  enc->height  = height;
+  enc->quality = quality;
+}
+
+/*
+ * 入力画像を作業領域の4:2:0のプレーンに並べ替える。libjpegはMCUの幅単位で
+ * 読むので、右端は最後の画素で埋めておく(下端は最後の行を繰り返し渡す)。
+ */
+static int
+load_planes(codec_encoder_t* enc, uint32_t format, const void* src,
+            size_t size, int stride, int width, int height)
+{
+  uint8_t* y;
+  uint8_t* u;
+  uint8_t* v;
+  uint8_t* p;
+  size_t need;
+  int ys;
+  int cs;
+  int cw;
+  int i;
+
+  ys   = ROUND_UP(width, MCU_SIZE);
+  cs   = ys / 2;
+  cw   = CHROMA(width);
+  need = ((size_t)ys * height) + ((size_t)cs * CHROMA(height) * 2);
+
+  if (enc->work_size < need) {
+    p = (uint8_t*)realloc(enc->work, need);
+    if (p == NULL) return !0;
+
+    enc->work      = p;
+    enc->work_size = need;
+  }
+
+  y = enc->work;
+  u = y + ((size_t)ys * height);
+  v = u + ((size_t)cs * CHROMA(height));
+
+  if (convert_to_planes(format, src, size, stride, width, height,
+                        y, ys, u, v, cs)) {
+    return !0;
+  }
+
+  if (ys > width) {
+    for (i = 0, p = y; i < height; i++, p += ys) {
+      memset(p + width, p[width - 1], ys - width);
+    }
+  }
+
+  if (cs > cw) {
+    for (i = 0; i < CHROMA(height); i++) {
+      p = u + ((size_t)cs * i);
+      memset(p + cw, p[cw - 1], cs - cw);
+
+      p = v + ((size_t)cs * i);
+      memset(p + cw, p[cw - 1], cs - cw);
+    }
+  }
+
+  return 0;
+}
+
+static void
+write_planes(codec_encoder_t* enc, int width, int height)
+{
+  JSAMPROW y[MCU_SIZE];
+  JSAMPROW u[MCU_SIZE / 2];
+  JSAMPROW v[MCU_SIZE / 2];
+  JSAMPARRAY planes[3];
+  uint8_t* pu;
+  uint8_t* pv;
+  int ys;
+  int cs;
+  int row;
+  int r;
+  int i;
+
+  ys = ROUND_UP(width, MCU_SIZE);
+  cs = ys / 2;
+  pu = enc->work + ((size_t)ys * height);
+  pv = pu + ((size_t)cs * CHROMA(height));
+
+  planes[0] = y;
+  planes[1] = u;
+  planes[2] = v;
+
+  for (row = 0; row < height; row += MCU_SIZE) {
+    for (i = 0; i < MCU_SIZE; i++) {
+      r    = (row + i < height)? row + i: height - 1;
+      y[i] = enc->work + ((size_t)ys * r);
+    }
+
+    for (i = 0; i < MCU_SIZE / 2; i++) {
+      r    = (row / 2 + i < CHROMA(height))? row / 2 + i: CHROMA(height) - 1;
+      u[i] = pu + ((size_t)cs * r);
+      v[i] = pv + ((size_t)cs * r);
+    }
+
+    jpeg_write_raw_data(&enc->cinfo, planes, MCU_SIZE);
+  }
+}
+#endif /* defined(HAVE_LIBJPEG) */
+
+int
+codec_is_available(void)
+{
+#ifdef HAVE_LIBJPEG
+  return !0;
+#else /* defined(HAVE_LIBJPEG) */
+  return 0;
+#endif /* defined(HAVE_LIBJPEG) */
+}
+
+codec_encoder_t*
+codec_encoder_new(void)
+{
+#ifdef HAVE_LIBJPEG
+  codec_encoder_t* volatile enc;
+
+  enc = (codec_encoder_t*)calloc(1, sizeof(codec_encoder_t));
+  if (enc == NULL) return NULL;
+
+  enc->cinfo.err         = jpeg_std_error(&enc->jerr);
+  enc->jerr.error_exit   = encode_error;
+  enc->cinfo.client_data = enc;
+
+  if (setjmp(enc->env)) {
+    free(enc);
+    return NULL;
+  }
+
+  jpeg_create_compress(&enc->cinfo);
+
+  enc->dest.init_destination    = init_destination;
+  enc->dest.empty_output_buffer = empty_output_buffer;
+  enc->dest.term_destination    = term_destination;
+  enc->cinfo.dest               = &enc->dest;
+
+  return enc;
+#else /* defined(HAVE_LIBJPEG) */
+  return NULL;
+#endif /* defined(HAVE_LIBJPEG) */
+}
+
+void
+codec_encoder_destroy(codec_encoder_t* enc)
+{
+  if (enc == NULL) return;
+
+#ifdef HAVE_LIBJPEG
+  jpeg_destroy_compress(&enc->cinfo);
+#endif /* defined(HAVE_LIBJPEG) */
+
+  if (enc->work != NULL) free(enc->work);
+  if (enc->out != NULL) free(enc->out);
+
+  free(enc);
+}
+
+size_t
+codec_encoder_memsize(codec_encoder_t* enc)
+{
+  return (enc != NULL)?
+            sizeof(codec_encoder_t) + enc->work_size + enc->out_size: 0;
+}
+
+codec_decoder_t*
+codec_decoder_new(void)
+{
+#ifdef HAVE_LIBJPEG
+  codec_decoder_t* volatile dec;
+
+  dec = (codec_decoder_t*)calloc(1, sizeof(codec_decoder_t));
+  if (dec == NULL) return NULL;
+
+  dec->dinfo.err           = jpeg_std_error(&dec->jerr);
+  dec->jerr.error_exit     = decode_error;
+  dec->jerr.output_message = output_message;
+  dec->dinfo.client_data   = dec;
+
+  if (setjmp(dec->env)) {
+    free(dec);
+    return NULL;
+  }
+
+  jpeg_create_decompress(&dec->dinfo);
+
+  dec->src.init_source       = init_source;
+  dec->src.fill_input_buffer = fill_input_buffer;
+  dec->src.skip_input_data   = skip_input_data;
+  dec->src.resync_to_restart = jpeg_resync_to_restart;
+  dec->src.term_source       = term_source;
+  dec->dinfo.src             = &dec->src;
+
+  return dec;
+#else /* defined(HAVE_LIBJPEG) */
+  return NULL;
+#endif /* defined(HAVE_LIBJPEG) */
+}
+
+void
+codec_decoder_destroy(codec_decoder_t* dec)
+{
+  if (dec == NULL) return;
+
+#ifdef HAVE_LIBJPEG
+  jpeg_destroy_decompress(&dec->dinfo);
+#endif /* defined(HAVE_LIBJPEG) */
+
+  if (dec->out != NULL) free(dec->out);
+
+  free(dec);
+}
+
+size_t
+codec_decoder_memsize(codec_decoder_t* dec)
+{
+  return (dec != NULL)? sizeof(codec_decoder_t) + dec->out_size: 0;
+}
+
+int
+codec_encode_jpeg(codec_encoder_t* enc, uint32_t format,
+                  const void* src, size_t size, int stride,
+                  int width, int height, int quality,
+                  const void** out, size_t* used)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (enc == NULL || src == NULL) break;
+    if (out == NULL || used == NULL) break;
+    if (width <= 0 || height <= 0) break;
+    if (quality < 1 || quality > 100) break;
+    if (!convert_is_supported(format)) break;
+
+#ifdef HAVE_LIBJPEG
+    /*
+     * prepare buffers
+     */
+    if (load_planes(enc, format, src, size, stride, width, height)) break;
+
+    if (enc->out == NULL) {
+      enc->out_size = (size_t)width * height;
+      if (enc->out_size < MIN_OUTPUT_SIZE) enc->out_size = MIN_OUTPUT_SIZE;
+
+      enc->out = (uint8_t*)malloc(enc->out_size);
+      if (enc->out == NULL) {
+        enc->out_size = 0;
+        break;
+      }
+    }
+
+    /*
+     * do encode
+     */
+    if (setjmp(enc->env)) {
+      jpeg_abort_compress(&enc->cinfo);
+      break;
+    }
+
+    setup_compress(enc, width, height, quality);
+
+    jpeg_start_compress(&enc->cinfo, TRUE);
+    write_planes(enc, width, height);
+    jpeg_finish_compress(&enc->cinfo);
+
+    /*
+     * set return parameter
+     */
+    *out  = enc->out;
+    *used = enc->out_size - enc->dest.free_in_buffer;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+#endif /* defined(HAVE_LIBJPEG) */
+  } while (0);
+
+  return ret;
+}
+
+int
+codec_decode_jpeg(codec_decoder_t* dec, const void* src, size_t size,
+                  int denom, int color, const void** out, size_t* used,
+                  int* width, int* height)
+{
+  int ret;
+#ifdef HAVE_LIBJPEG
+  struct jpeg_decompress_struct* dinfo;
+  JSAMPROW rows[MAX_READ_ROWS];
+  uint8_t* p;
+  size_t stride;
+  size_t need;
+  int n;
+  int i;
+#endif /* defined(HAVE_LIBJPEG) */
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (dec == NULL || src == NULL || size == 0) break;
+    if (out == NULL || used == NULL) break;
+    if (width == NULL || height == NULL) break;
+    if (denom != 1 && denom != 2 && denom != 4 && denom != 8) break;
+    if (color != CODEC_GRAY && color != CODEC_RGB) break;
+
+#ifdef HAVE_LIBJPEG
+    dinfo = &dec->dinfo;
+
+    if (setjmp(dec->env)) {
+      jpeg_abort_decompress(dinfo);
+      break;
+    }
+
+    /*
+     * read header
+     */
+    dec->src.next_input_byte = (const JOCTET*)src;
+    dec->src.bytes_in_buffer = size;
+
+    if (jpeg_read_header(dinfo, TRUE) != JPEG_HEADER_OK) {
+      jpeg_abort_decompress(dinfo);
+      break;
+    }
+
+    dinfo->scale_num       = 1;
+    dinfo->scale_denom     = denom;
+    dinfo->out_color_space = (color == CODEC_GRAY)? JCS_GRAYSCALE: JCS_RGB;
+
+    /*
+     * prepare output buffer
+     */
+    jpeg_start_decompress(dinfo);
+
+    stride = (size_t)dinfo->output_width * dinfo->output_components;
+    need   = stride * dinfo->output_height;
+
+    if (dec->out_size < need) {
+      p = (uint8_t*)realloc(dec->out, need);
+      if (p == NULL) {
+        jpeg_abort_decompress(dinfo);
+        break;
+      }
+
+      dec->out      = p;
+      dec->out_size = need;
+    }
+
+    /*
+     * do decode
+     */
+    while (dinfo->output_scanline < dinfo->output_height) {
+      n = dinfo->output_height - dinfo->output_scanline;
+      if (n > MAX_READ_ROWS) n = MAX_READ_ROWS;
+
+      for (i = 0; i < n; i++) {
+        rows[i] = dec->out + (stride * (dinfo->output_scanline + i));
+      }
+
+      jpeg_read_scanlines(dinfo, rows, n);
+    }
+
+    jpeg_finish_decompress(dinfo);
+
+    /*
+     * set return parameter
+     */
+    *out    = dec->out;
+    *used   = need;
+    *width  = dinfo->output_width;
+    *height = dinfo->output_height;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+#endif /* defined(HAVE_LIBJPEG) */
+  } while (0);
+
+  return ret;
+}
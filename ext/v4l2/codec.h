@@ -0,0 +1,75 @@
+﻿/*
+ *
+ * Video 4 Linux V2 driver library (JPEG codec).
+ *
+ *  Copyright (C) 2015 Hiroshi Kuwagata. All rights reserved.
+ *
+ */
+
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "camera.h"
+
+#define DEFAULT_JPEG_QUALITY    85
+
+/*
+ * デコード結果の画素配置
+ */
+#define CODEC_GRAY              0
+#define CODEC_RGB               1
+
+/*
+ * エンコーダ・デコーダの状態 (中身はcodec.cでのみ参照する)
+ */
+typedef struct __codec_encoder__ codec_encoder_t;
+typedef struct __codec_decoder__ codec_decoder_t;
+
+/*
+ * libjpegを使用してビルドした場合は!0を返します(使用していない場合、
+ * エンコーダは生成できません)。
+ */
+extern int codec_is_available(void);
+
+/*
+ * エンコーダはフレーム毎に作り直さずに使い回します。出力先と作業領域は
+ * 最初のエンコード時に確保し、以降は足りなくなった場合だけ広げます。
+ */
+extern codec_encoder_t* codec_encoder_new(void);
+extern void codec_encoder_destroy(codec_encoder_t* enc);
+extern size_t codec_encoder_memsize(codec_encoder_t* enc);
+
+/*
+ * formatの画像(convert_is_supported()が真のもの)をJPEGにエンコードしま
+ * す。qualityは1〜100で、色差は4:2:0に間引きます。*outにはエンコーダが
+ * 持つ出力領域を返すので、次のエンコードまでに複製してください。
+ */
+extern int codec_encode_jpeg(codec_encoder_t* enc, uint32_t format,
+                             const void* src, size_t size, int stride,
+                             int width, int height, int quality,
+                             const void** out, size_t* used);
+
+/*
+ * デコーダもフレーム毎に作り直さずに使い回します(出力領域はエンコーダと
+ * 同様に必要な場合だけ広げます)。
+ */
+extern codec_decoder_t* codec_decoder_new(void);
+extern void codec_decoder_destroy(codec_decoder_t* dec);
+extern size_t codec_decoder_memsize(codec_decoder_t* dec);
+
+/*
+ * JPEGを1/denom(1, 2, 4, 8のいずれか)に縮小しながらデコードします。縮小
+ * は逆DCTの段階で行うので、デコードしてから縮小するより大幅に軽くなりま
+ * す。CODEC_GRAYの場合は輝度のみを復号します。出力は行間を詰めた画素の
+ * 並び(1画素1バイトか3バイト)で、*outにはデコーダが持つ出力領域を返し
+ * ます。途中で途切れたデータも、読めた所までで成功として扱います。
+ */
+extern int codec_decode_jpeg(codec_decoder_t* dec, const void* src,
+                             size_t size, int denom, int color,
+                             const void** out, size_t* used,
+                             int* width, int* height);
+
+#endif /* !defined(__CODEC_H__) */
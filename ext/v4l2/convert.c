@@ -0,0 +1,1464 @@
+﻿/*
+ *
+ * Video 4 Linux V2 driver library (pixel format conversion).
+ *
+ *  Copyright (C) 2015 Hiroshi Kuwagata. All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif /* defined(__x86_64__) || defined(__i386__) */
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif /* defined(__ARM_NEON) || defined(__ARM_NEON__) */
+
+#include "convert.h"
+
+/*
+ * 変換は16bit整数の固定小数点で行う。
+ *
+ *   - 輝度と色差は(x - offset) << 7で16bitに広げる
+ *   - 係数はQ12で持ち、積の上位16bitを取る(結果はQ3になる)
+ *   - 最後に丸めて3bit右シフトし、0〜255に飽和させる
+ *
+ * SIMD版もスカラ版も同じ演算をするので、どのカーネルでも結果は一致する。
+ */
+#define COEFF_SHIFT               12
+#define MULHI(a,b)                (((int32_t)(a) * (int32_t)(b)) >> 16)
+
+typedef struct {
+  int16_t y_off;
+  int16_t cy;
+  int16_t cvr;
+  int16_t cug;
+  int16_t cvg;
+  int16_t cub;
+} coeff_t;
+
+#define CHROMA(x)                 (((x) + 1) / 2)
+
+/*
+ * 行単位の処理の一覧 (実行時にCPUに合わせて選択する)
+ *
+ * 4:2:0の画像は、色差の行を共有する2行ずつ処理する。RGBへの変換は行毎に
+ * 一旦YUYVに並べ替え、YUYVの変換カーネルを通す。
+ */
+typedef struct {
+  const char* name;
+
+  // YUYV → RGB系
+  void (*yuyv_row)(const uint8_t* src, uint8_t* dst, int width,
+                   const coeff_t* k, int layout);
+
+  // 輝度と色差(別々のプレーン)からYUYVの1行を作る
+  void (*pack_planar)(const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                      uint8_t* dst, int width);
+
+  // 輝度と色差(UVを交互に並べたプレーン)からYUYVの1行を作る
+  void (*pack_interleaved)(const uint8_t* y, const uint8_t* uv, int swap,
+                           uint8_t* dst, int width);
+
+  // 交互に並んだ色差をU, Vに分ける (swapが!0の場合はVUの順)
+  void (*split_uv)(const uint8_t* uv, int swap, uint8_t* u, uint8_t* v,
+                   int n);
+
+  // U, Vを交互に並べる
+  void (*merge_uv)(const uint8_t* u, const uint8_t* v, int swap, uint8_t* uv,
+                   int n);
+
+  // YUYVの2行を輝度2行と色差(2行の平均)に分ける
+  void (*unpack_yuyv)(const uint8_t* src0, const uint8_t* src1,
+                      uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v,
+                      int width);
+} kernel_t;
+
+/*
+ * 色差の並びを含めた入力画像の記述
+ */
+typedef struct {
+  int packed;             /* YUYVの場合は!0 */
+  int interleaved;        /* NV12/NV21の場合は!0 */
+  int swap;               /* 色差がVUの順の場合は!0 */
+
+  const uint8_t* y;       /* YUYVの場合は画像の先頭 */
+  int y_stride;
+
+  const uint8_t* u;       /* NV12/NV21の場合は色差プレーンの先頭 */
+  const uint8_t* v;
+  int c_stride;
+} yuv_image_t;
+
+/*
+ * {Y, Vの赤への寄与, Uの緑への寄与, Vの緑への寄与, Uの青への寄与}
+ */
+static const double coeff_table[2][2][5] = {
+  {
+    {1.164383, 1.596027, 0.391762, 0.812968, 2.017232},   // BT.601 limited
+    {1.000000, 1.402000, 0.344136, 0.714136, 1.772000},   // BT.601 full
+  },
+  {
+    {1.164383, 1.792741, 0.213249, 0.532909, 2.112402},   // BT.709 limited
+    {1.000000, 1.574800, 0.187324, 0.468124, 1.855600},   // BT.709 full
+  },
+};
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static kernel_t kernel;
+
+static void
+setup_coeff(coeff_t* k, conv_param_t* param)
+{
+  const double* t;
+
+  t = coeff_table[param->matrix][(param->full_range)? 1: 0];
+
+  k->y_off = (param->full_range)? 0: 16;
+  k->cy    = (int16_t)(t[0] * (1 << COEFF_SHIFT) + 0.5);
+  k->cvr   = (int16_t)(t[1] * (1 << COEFF_SHIFT) + 0.5);
+  k->cug   = (int16_t)(t[2] * (1 << COEFF_SHIFT) + 0.5);
+  k->cvg   = (int16_t)(t[3] * (1 << COEFF_SHIFT) + 0.5);
+  k->cub   = (int16_t)(t[4] * (1 << COEFF_SHIFT) + 0.5);
+}
+
+static inline uint8_t
+saturate(int v)
+{
+  v = (v + 4) >> 3;
+
+  return (v < 0)? 0: (v > 255)? 255: v;
+}
+
+static inline void
+put_pixel(uint8_t* dst, int r, int g, int b, int layout)
+{
+  switch (layout) {
+  case CONV_BGR24:
+    dst[0] = saturate(b);
+    dst[1] = saturate(g);
+    dst[2] = saturate(r);
+    break;
+
+  case CONV_RGBA32:
+    dst[0] = saturate(r);
+    dst[1] = saturate(g);
+    dst[2] = saturate(b);
+    dst[3] = 255;
+    break;
+
+  default:
+    dst[0] = saturate(r);
+    dst[1] = saturate(g);
+    dst[2] = saturate(b);
+    break;
+  }
+}
+
+/*
+ * scalar kernel (SIMDが使えない場合と、SIMD版の端数の処理に使う)
+ */
+static void
+yuyv_row_c(const uint8_t* src, uint8_t* dst, int width, const coeff_t* k,
+           int layout)
+{
+  int bpp;
+  int x;
+  int y0;
+  int y1;
+  int u;
+  int v;
+  int cr;
+  int cg;
+  int cb;
+
+  bpp = convert_bytes_per_pixel(layout);
+
+  for (x = 0; x < width; x += 2) {
+    y0 = MULHI((src[0] - k->y_off) << 7, k->cy);
+    y1 = MULHI((src[2] - k->y_off) << 7, k->cy);
+    u  = (src[1] - 128) << 7;
+    v  = (src[3] - 128) << 7;
+
+    cr = MULHI(v, k->cvr);
+    cg = -MULHI(u, k->cug) - MULHI(v, k->cvg);
+    cb = MULHI(u, k->cub);
+
+    put_pixel(dst, y0 + cr, y0 + cg, y0 + cb, layout);
+    dst += bpp;
+
+    // 幅が奇数の場合は最後の組の2画素目を捨てる
+    if (x + 1 < width) {
+      put_pixel(dst, y1 + cr, y1 + cg, y1 + cb, layout);
+      dst += bpp;
+    }
+
+    src += 4;
+  }
+}
+
+static void
+pack_planar_c(const uint8_t* y, const uint8_t* u, const uint8_t* v,
+              uint8_t* dst, int width)
+{
+  int x;
+
+  for (x = 0; x < width; x += 2) {
+    dst[0] = y[x];
+    dst[1] = *u++;
+    dst[2] = (x + 1 < width)? y[x + 1]: y[x];
+    dst[3] = *v++;
+
+    dst += 4;
+  }
+}
+
+static void
+pack_interleaved_c(const uint8_t* y, const uint8_t* uv, int swap,
+                   uint8_t* dst, int width)
+{
+  int x;
+
+  for (x = 0; x < width; x += 2) {
+    dst[0] = y[x];
+    dst[1] = uv[(swap)? 1: 0];
+    dst[2] = (x + 1 < width)? y[x + 1]: y[x];
+    dst[3] = uv[(swap)? 0: 1];
+
+    uv  += 2;
+    dst += 4;
+  }
+}
+
+static void
+split_uv_c(const uint8_t* uv, int swap, uint8_t* u, uint8_t* v, int n)
+{
+  int i;
+
+  if (swap) {
+    split_uv_c(uv, 0, v, u, n);
+
+  } else {
+    for (i = 0; i < n; i++) {
+      u[i] = uv[0];
+      v[i] = uv[1];
+      uv  += 2;
+    }
+  }
+}
+
+static void
+merge_uv_c(const uint8_t* u, const uint8_t* v, int swap, uint8_t* uv, int n)
+{
+  int i;
+
+  if (swap) {
+    merge_uv_c(v, u, 0, uv, n);
+
+  } else {
+    for (i = 0; i < n; i++) {
+      uv[0] = u[i];
+      uv[1] = v[i];
+      uv   += 2;
+    }
+  }
+}
+
+static void
+unpack_yuyv_c(const uint8_t* src0, const uint8_t* src1,
+              uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+{
+  int x;
+
+  for (x = 0; x < width; x += 2) {
+    y0[x] = src0[0];
+    y1[x] = src1[0];
+
+    if (x + 1 < width) {
+      y0[x + 1] = src0[2];
+      y1[x + 1] = src1[2];
+    }
+
+    *u++ = (src0[1] + src1[1] + 1) >> 1;
+    *v++ = (src0[3] + src1[3] + 1) >> 1;
+
+    src0 += 4;
+    src1 += 4;
+  }
+}
+
+/*
+ * SIMD版は1回の反復で書き込む領域の後ろに最大4バイトはみ出して書き込む
+ * (24bitの画素をまとめて書くため)。はみ出しが行内に収まる間だけSIMD版で
+ * 処理し、残りはスカラ版で処理する。
+ */
+static inline int
+simd_limit(int width, int layout)
+{
+  return (convert_bytes_per_pixel(layout) == 4)? width: width - 2;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static inline void
+store_rgb_sse2(uint8_t* dst, __m128i r, __m128i g, __m128i b, int layout)
+{
+  __m128i r8;
+  __m128i g8;
+  __m128i b8;
+  __m128i rg;
+  __m128i ba;
+  __m128i p[2];
+  uint32_t w;
+  int i;
+  int j;
+
+  r8 = _mm_packus_epi16(r, r);
+  g8 = _mm_packus_epi16(g, g);
+  b8 = _mm_packus_epi16(b, b);
+
+  if (layout == CONV_BGR24) {
+    rg = _mm_unpacklo_epi8(b8, g8);
+    ba = _mm_unpacklo_epi8(r8, _mm_set1_epi8(-1));
+  } else {
+    rg = _mm_unpacklo_epi8(r8, g8);
+    ba = _mm_unpacklo_epi8(b8, _mm_set1_epi8(-1));
+  }
+
+  p[0] = _mm_unpacklo_epi16(rg, ba);
+  p[1] = _mm_unpackhi_epi16(rg, ba);
+
+  if (layout == CONV_RGBA32) {
+    _mm_storeu_si128((__m128i*)dst, p[0]);
+    _mm_storeu_si128((__m128i*)(dst + 16), p[1]);
+
+  } else {
+    // 4バイトずつ重ねて書き、余分な1バイトは次の画素で上書きする
+    for (i = 0; i < 2; i++) {
+      for (j = 0; j < 4; j++) {
+        w = _mm_cvtsi128_si32(p[i]);
+        memcpy(dst, &w, 4);
+
+        p[i] = _mm_srli_si128(p[i], 4);
+        dst += 3;
+      }
+    }
+  }
+}
+
+__attribute__((target("sse2")))
+static void
+yuyv_row_sse2(const uint8_t* src, uint8_t* dst, int width, const coeff_t* k,
+              int layout)
+{
+  __m128i mask;
+  __m128i yoff;
+  __m128i c128;
+  __m128i cy;
+  __m128i cvr;
+  __m128i cug;
+  __m128i cvg;
+  __m128i cub;
+  __m128i in;
+  __m128i y;
+  __m128i uv;
+  __m128i u;
+  __m128i v;
+  __m128i r;
+  __m128i g;
+  __m128i b;
+  int bpp;
+  int lim;
+  int x;
+
+  mask = _mm_set1_epi16(0x00ff);
+  yoff = _mm_set1_epi16(k->y_off);
+  c128 = _mm_set1_epi16(128);
+  cy   = _mm_set1_epi16(k->cy);
+  cvr  = _mm_set1_epi16(k->cvr);
+  cug  = _mm_set1_epi16(k->cug);
+  cvg  = _mm_set1_epi16(k->cvg);
+  cub  = _mm_set1_epi16(k->cub);
+
+  bpp  = convert_bytes_per_pixel(layout);
+  lim  = simd_limit(width, layout);
+
+  for (x = 0; x + 8 <= lim; x += 8) {
+    in = _mm_loadu_si128((const __m128i*)(src + (x * 2)));
+
+    // Y0 U0 Y1 V0 ... を輝度と色差に分け、色差は2画素分に複製する
+    y  = _mm_and_si128(in, mask);
+    uv = _mm_srli_epi16(in, 8);
+    u  = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)),
+                             _MM_SHUFFLE(2, 2, 0, 0));
+    v  = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)),
+                             _MM_SHUFFLE(3, 3, 1, 1));
+
+    y  = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(y, yoff), 7), cy);
+    u  = _mm_slli_epi16(_mm_sub_epi16(u, c128), 7);
+    v  = _mm_slli_epi16(_mm_sub_epi16(v, c128), 7);
+
+    r  = _mm_add_epi16(y, _mm_mulhi_epi16(v, cvr));
+    g  = _mm_sub_epi16(_mm_sub_epi16(y, _mm_mulhi_epi16(u, cug)),
+                       _mm_mulhi_epi16(v, cvg));
+    b  = _mm_add_epi16(y, _mm_mulhi_epi16(u, cub));
+
+    r  = _mm_srai_epi16(_mm_add_epi16(r, _mm_set1_epi16(4)), 3);
+    g  = _mm_srai_epi16(_mm_add_epi16(g, _mm_set1_epi16(4)), 3);
+    b  = _mm_srai_epi16(_mm_add_epi16(b, _mm_set1_epi16(4)), 3);
+
+    store_rgb_sse2(dst + (x * bpp), r, g, b, layout);
+  }
+
+  yuyv_row_c(src + (x * 2), dst + (x * bpp), width - x, k, layout);
+}
+
+__attribute__((target("avx2")))
+static inline void
+store_rgb_avx2(uint8_t* dst, __m256i r, __m256i g, __m256i b, int layout)
+{
+  __m256i r8;
+  __m256i g8;
+  __m256i b8;
+  __m256i rg;
+  __m256i ba;
+  __m256i lo;
+  __m256i hi;
+  __m256i p[2];
+  __m256i shuf;
+  int i;
+
+  r8 = _mm256_packus_epi16(r, r);
+  g8 = _mm256_packus_epi16(g, g);
+  b8 = _mm256_packus_epi16(b, b);
+
+  if (layout == CONV_BGR24) {
+    rg = _mm256_unpacklo_epi8(b8, g8);
+    ba = _mm256_unpacklo_epi8(r8, _mm256_set1_epi8(-1));
+  } else {
+    rg = _mm256_unpacklo_epi8(r8, g8);
+    ba = _mm256_unpacklo_epi8(b8, _mm256_set1_epi8(-1));
+  }
+
+  // レーン毎に処理されるので、画素の順に並べ直す
+  lo   = _mm256_unpacklo_epi16(rg, ba);
+  hi   = _mm256_unpackhi_epi16(rg, ba);
+  p[0] = _mm256_permute2x128_si256(lo, hi, 0x20);
+  p[1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+  if (layout == CONV_RGBA32) {
+    _mm256_storeu_si256((__m256i*)dst, p[0]);
+    _mm256_storeu_si256((__m256i*)(dst + 32), p[1]);
+
+  } else {
+    // レーン毎に12バイトに詰め、16バイトずつ重ねて書く
+    shuf = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                            -1, -1, -1, -1,
+                            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+                            -1, -1, -1, -1);
+
+    for (i = 0; i < 2; i++) {
+      p[i] = _mm256_shuffle_epi8(p[i], shuf);
+
+      _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(p[i]));
+      _mm_storeu_si128((__m128i*)(dst + 12), _mm256_extracti128_si256(p[i], 1));
+      dst += 24;
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void
+yuyv_row_avx2(const uint8_t* src, uint8_t* dst, int width, const coeff_t* k,
+              int layout)
+{
+  __m256i mask;
+  __m256i yoff;
+  __m256i c128;
+  __m256i cy;
+  __m256i cvr;
+  __m256i cug;
+  __m256i cvg;
+  __m256i cub;
+  __m256i in;
+  __m256i y;
+  __m256i uv;
+  __m256i u;
+  __m256i v;
+  __m256i r;
+  __m256i g;
+  __m256i b;
+  int bpp;
+  int lim;
+  int x;
+
+  mask = _mm256_set1_epi16(0x00ff);
+  yoff = _mm256_set1_epi16(k->y_off);
+  c128 = _mm256_set1_epi16(128);
+  cy   = _mm256_set1_epi16(k->cy);
+  cvr  = _mm256_set1_epi16(k->cvr);
+  cug  = _mm256_set1_epi16(k->cug);
+  cvg  = _mm256_set1_epi16(k->cvg);
+  cub  = _mm256_set1_epi16(k->cub);
+
+  bpp  = convert_bytes_per_pixel(layout);
+  lim  = simd_limit(width, layout);
+
+  for (x = 0; x + 16 <= lim; x += 16) {
+    in = _mm256_loadu_si256((const __m256i*)(src + (x * 2)));
+
+    y  = _mm256_and_si256(in, mask);
+    uv = _mm256_srli_epi16(in, 8);
+    u  = _mm256_shufflehi_epi16(
+             _mm256_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)),
+             _MM_SHUFFLE(2, 2, 0, 0));
+    v  = _mm256_shufflehi_epi16(
+             _mm256_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)),
+             _MM_SHUFFLE(3, 3, 1, 1));
+
+    y  = _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(y, yoff), 7),
+                            cy);
+    u  = _mm256_slli_epi16(_mm256_sub_epi16(u, c128), 7);
+    v  = _mm256_slli_epi16(_mm256_sub_epi16(v, c128), 7);
+
+    r  = _mm256_add_epi16(y, _mm256_mulhi_epi16(v, cvr));
+    g  = _mm256_sub_epi16(_mm256_sub_epi16(y, _mm256_mulhi_epi16(u, cug)),
+                          _mm256_mulhi_epi16(v, cvg));
+    b  = _mm256_add_epi16(y, _mm256_mulhi_epi16(u, cub));
+
+    r  = _mm256_srai_epi16(_mm256_add_epi16(r, _mm256_set1_epi16(4)), 3);
+    g  = _mm256_srai_epi16(_mm256_add_epi16(g, _mm256_set1_epi16(4)), 3);
+    b  = _mm256_srai_epi16(_mm256_add_epi16(b, _mm256_set1_epi16(4)), 3);
+
+    store_rgb_avx2(dst + (x * bpp), r, g, b, layout);
+  }
+
+  yuyv_row_c(src + (x * 2), dst + (x * bpp), width - x, k, layout);
+}
+
+__attribute__((target("sse2")))
+static inline void
+store_yuyv_sse2(uint8_t* dst, __m128i y, __m128i uv)
+{
+  _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi8(y, uv));
+  _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi8(y, uv));
+}
+
+__attribute__((target("sse2")))
+static void
+pack_planar_sse2(const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                 uint8_t* dst, int width)
+{
+  __m128i uv;
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + (x / 2))),
+                           _mm_loadl_epi64((const __m128i*)(v + (x / 2))));
+
+    store_yuyv_sse2(dst + (x * 2),
+                    _mm_loadu_si128((const __m128i*)(y + x)), uv);
+  }
+
+  pack_planar_c(y + x, u + (x / 2), v + (x / 2), dst + (x * 2), width - x);
+}
+
+__attribute__((target("sse2")))
+static void
+pack_interleaved_sse2(const uint8_t* y, const uint8_t* uv, int swap,
+                      uint8_t* dst, int width)
+{
+  __m128i c;
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    c = _mm_loadu_si128((const __m128i*)(uv + x));
+    if (swap) c = _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8));
+
+    store_yuyv_sse2(dst + (x * 2),
+                    _mm_loadu_si128((const __m128i*)(y + x)), c);
+  }
+
+  pack_interleaved_c(y + x, uv + x, swap, dst + (x * 2), width - x);
+}
+
+__attribute__((target("sse2")))
+static void
+split_uv_sse2(const uint8_t* uv, int swap, uint8_t* u, uint8_t* v, int n)
+{
+  __m128i mask;
+  __m128i a;
+  __m128i b;
+  uint8_t* t;
+  int i;
+
+  if (swap) {
+    t = u;
+    u = v;
+    v = t;
+  }
+
+  mask = _mm_set1_epi16(0x00ff);
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    a = _mm_loadu_si128((const __m128i*)(uv + (i * 2)));
+    b = _mm_loadu_si128((const __m128i*)(uv + (i * 2) + 16));
+
+    _mm_storeu_si128((__m128i*)(u + i),
+                     _mm_packus_epi16(_mm_and_si128(a, mask),
+                                      _mm_and_si128(b, mask)));
+    _mm_storeu_si128((__m128i*)(v + i),
+                     _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                                      _mm_srli_epi16(b, 8)));
+  }
+
+  split_uv_c(uv + (i * 2), 0, u + i, v + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+merge_uv_sse2(const uint8_t* u, const uint8_t* v, int swap, uint8_t* uv, int n)
+{
+  const uint8_t* t;
+  __m128i a;
+  __m128i b;
+  int i;
+
+  if (swap) {
+    t = u;
+    u = v;
+    v = t;
+  }
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    a = _mm_loadu_si128((const __m128i*)(u + i));
+    b = _mm_loadu_si128((const __m128i*)(v + i));
+
+    _mm_storeu_si128((__m128i*)(uv + (i * 2)), _mm_unpacklo_epi8(a, b));
+    _mm_storeu_si128((__m128i*)(uv + (i * 2) + 16), _mm_unpackhi_epi8(a, b));
+  }
+
+  merge_uv_c(u + i, v + i, 0, uv + (i * 2), n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+unpack_yuyv_sse2(const uint8_t* src0, const uint8_t* src1,
+                 uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+{
+  __m128i mask;
+  __m128i zero;
+  __m128i a0;
+  __m128i b0;
+  __m128i a1;
+  __m128i b1;
+  __m128i c;
+  int x;
+
+  mask = _mm_set1_epi16(0x00ff);
+  zero = _mm_setzero_si128();
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    a0 = _mm_loadu_si128((const __m128i*)(src0 + (x * 2)));
+    b0 = _mm_loadu_si128((const __m128i*)(src0 + (x * 2) + 16));
+    a1 = _mm_loadu_si128((const __m128i*)(src1 + (x * 2)));
+    b1 = _mm_loadu_si128((const __m128i*)(src1 + (x * 2) + 16));
+
+    _mm_storeu_si128((__m128i*)(y0 + x),
+                     _mm_packus_epi16(_mm_and_si128(a0, mask),
+                                      _mm_and_si128(b0, mask)));
+    _mm_storeu_si128((__m128i*)(y1 + x),
+                     _mm_packus_epi16(_mm_and_si128(a1, mask),
+                                      _mm_and_si128(b1, mask)));
+
+    // 2行の色差を平均してからU, Vに分ける
+    c = _mm_avg_epu8(_mm_packus_epi16(_mm_srli_epi16(a0, 8),
+                                      _mm_srli_epi16(b0, 8)),
+                     _mm_packus_epi16(_mm_srli_epi16(a1, 8),
+                                      _mm_srli_epi16(b1, 8)));
+
+    _mm_storel_epi64((__m128i*)(u + (x / 2)),
+                     _mm_packus_epi16(_mm_and_si128(c, mask), zero));
+    _mm_storel_epi64((__m128i*)(v + (x / 2)),
+                     _mm_packus_epi16(_mm_srli_epi16(c, 8), zero));
+  }
+
+  unpack_yuyv_c(src0 + (x * 2), src1 + (x * 2), y0 + x, y1 + x,
+                u + (x / 2), v + (x / 2), width - x);
+}
+#endif /* defined(HAVE_X86_SIMD) */
+
+#ifdef HAVE_NEON
+static inline int16x8_t
+mulhi_neon(int16x8_t a, int16_t c)
+{
+  return vcombine_s16(vshrn_n_s32(vmull_n_s16(vget_low_s16(a), c), 16),
+                      vshrn_n_s32(vmull_n_s16(vget_high_s16(a), c), 16));
+}
+
+static inline int16x8_t
+widen_neon(uint8x8_t x, int16_t off)
+{
+  return vshlq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(x)),
+                               vdupq_n_s16(off)), 7);
+}
+
+static void
+yuyv_row_neon(const uint8_t* src, uint8_t* dst, int width, const coeff_t* k,
+              int layout)
+{
+  uint8x8x4_t in;
+  uint8x8x2_t r;
+  uint8x8x2_t g;
+  uint8x8x2_t b;
+  uint8x8x3_t o3;
+  uint8x8x4_t o4;
+  int16x8_t y0;
+  int16x8_t y1;
+  int16x8_t u;
+  int16x8_t v;
+  int16x8_t cr;
+  int16x8_t cg;
+  int16x8_t cb;
+  int bpp;
+  int x;
+  int i;
+
+  bpp = convert_bytes_per_pixel(layout);
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    // 偶数番目の画素の輝度, U, 奇数番目の画素の輝度, V に分けて読む
+    in = vld4_u8(src + (x * 2));
+
+    y0 = mulhi_neon(widen_neon(in.val[0], k->y_off), k->cy);
+    y1 = mulhi_neon(widen_neon(in.val[2], k->y_off), k->cy);
+    u  = widen_neon(in.val[1], 128);
+    v  = widen_neon(in.val[3], 128);
+
+    cr = mulhi_neon(v, k->cvr);
+    cg = vnegq_s16(vaddq_s16(mulhi_neon(u, k->cug), mulhi_neon(v, k->cvg)));
+    cb = mulhi_neon(u, k->cub);
+
+    r = vzip_u8(vqrshrun_n_s16(vaddq_s16(y0, cr), 3),
+                vqrshrun_n_s16(vaddq_s16(y1, cr), 3));
+    g = vzip_u8(vqrshrun_n_s16(vaddq_s16(y0, cg), 3),
+                vqrshrun_n_s16(vaddq_s16(y1, cg), 3));
+    b = vzip_u8(vqrshrun_n_s16(vaddq_s16(y0, cb), 3),
+                vqrshrun_n_s16(vaddq_s16(y1, cb), 3));
+
+    for (i = 0; i < 2; i++) {
+      if (layout == CONV_RGBA32) {
+        o4.val[0] = r.val[i];
+        o4.val[1] = g.val[i];
+        o4.val[2] = b.val[i];
+        o4.val[3] = vdup_n_u8(255);
+        vst4_u8(dst + ((x + (i * 8)) * bpp), o4);
+
+      } else {
+        o3.val[0] = (layout == CONV_BGR24)? b.val[i]: r.val[i];
+        o3.val[1] = g.val[i];
+        o3.val[2] = (layout == CONV_BGR24)? r.val[i]: b.val[i];
+        vst3_u8(dst + ((x + (i * 8)) * bpp), o3);
+      }
+    }
+  }
+
+  yuyv_row_c(src + (x * 2), dst + (x * bpp), width - x, k, layout);
+}
+
+static void
+pack_planar_neon(const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                 uint8_t* dst, int width)
+{
+  uint8x8x2_t yy;
+  uint8x8x4_t o;
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    yy = vld2_u8(y + x);
+
+    o.val[0] = yy.val[0];
+    o.val[1] = vld1_u8(u + (x / 2));
+    o.val[2] = yy.val[1];
+    o.val[3] = vld1_u8(v + (x / 2));
+    vst4_u8(dst + (x * 2), o);
+  }
+
+  pack_planar_c(y + x, u + (x / 2), v + (x / 2), dst + (x * 2), width - x);
+}
+
+static void
+pack_interleaved_neon(const uint8_t* y, const uint8_t* uv, int swap,
+                      uint8_t* dst, int width)
+{
+  uint8x8x2_t yy;
+  uint8x8x2_t c;
+  uint8x8x4_t o;
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    yy = vld2_u8(y + x);
+    c  = vld2_u8(uv + x);
+
+    o.val[0] = yy.val[0];
+    o.val[1] = c.val[(swap)? 1: 0];
+    o.val[2] = yy.val[1];
+    o.val[3] = c.val[(swap)? 0: 1];
+    vst4_u8(dst + (x * 2), o);
+  }
+
+  pack_interleaved_c(y + x, uv + x, swap, dst + (x * 2), width - x);
+}
+
+static void
+split_uv_neon(const uint8_t* uv, int swap, uint8_t* u, uint8_t* v, int n)
+{
+  uint8x16x2_t c;
+  int i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    c = vld2q_u8(uv + (i * 2));
+
+    vst1q_u8(u + i, c.val[(swap)? 1: 0]);
+    vst1q_u8(v + i, c.val[(swap)? 0: 1]);
+  }
+
+  split_uv_c(uv + (i * 2), swap, u + i, v + i, n - i);
+}
+
+static void
+merge_uv_neon(const uint8_t* u, const uint8_t* v, int swap, uint8_t* uv, int n)
+{
+  uint8x16x2_t c;
+  int i;
+
+  for (i = 0; i + 16 <= n; i += 16) {
+    c.val[(swap)? 1: 0] = vld1q_u8(u + i);
+    c.val[(swap)? 0: 1] = vld1q_u8(v + i);
+
+    vst2q_u8(uv + (i * 2), c);
+  }
+
+  merge_uv_c(u + i, v + i, swap, uv + (i * 2), n - i);
+}
+
+static void
+unpack_yuyv_neon(const uint8_t* src0, const uint8_t* src1,
+                 uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width)
+{
+  uint8x8x4_t a;
+  uint8x8x4_t b;
+  uint8x8x2_t o;
+  int x;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    a = vld4_u8(src0 + (x * 2));
+    b = vld4_u8(src1 + (x * 2));
+
+    o.val[0] = a.val[0];
+    o.val[1] = a.val[2];
+    vst2_u8(y0 + x, o);
+
+    o.val[0] = b.val[0];
+    o.val[1] = b.val[2];
+    vst2_u8(y1 + x, o);
+
+    vst1_u8(u + (x / 2), vrhadd_u8(a.val[1], b.val[1]));
+    vst1_u8(v + (x / 2), vrhadd_u8(a.val[3], b.val[3]));
+  }
+
+  unpack_yuyv_c(src0 + (x * 2), src1 + (x * 2), y0 + x, y1 + x,
+                u + (x / 2), v + (x / 2), width - x);
+}
+#endif /* defined(HAVE_NEON) */
+
+static void
+select_kernel(void)
+{
+  kernel.name             = "scalar";
+  kernel.yuyv_row         = yuyv_row_c;
+  kernel.pack_planar      = pack_planar_c;
+  kernel.pack_interleaved = pack_interleaved_c;
+  kernel.split_uv         = split_uv_c;
+  kernel.merge_uv         = merge_uv_c;
+  kernel.unpack_yuyv      = unpack_yuyv_c;
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  /*
+   * 並べ替えだけの処理はメモリ帯域で律速されるので、AVX2でもSSE2版を使う
+   */
+  if (__builtin_cpu_supports("sse2")) {
+    kernel.name             = "sse2";
+    kernel.yuyv_row         = yuyv_row_sse2;
+    kernel.pack_planar      = pack_planar_sse2;
+    kernel.pack_interleaved = pack_interleaved_sse2;
+    kernel.split_uv         = split_uv_sse2;
+    kernel.merge_uv         = merge_uv_sse2;
+    kernel.unpack_yuyv      = unpack_yuyv_sse2;
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.name             = "avx2";
+    kernel.yuyv_row         = yuyv_row_avx2;
+  }
+#endif /* defined(HAVE_X86_SIMD) */
+
+#ifdef HAVE_NEON
+  kernel.name             = "neon";
+  kernel.yuyv_row         = yuyv_row_neon;
+  kernel.pack_planar      = pack_planar_neon;
+  kernel.pack_interleaved = pack_interleaved_neon;
+  kernel.split_uv         = split_uv_neon;
+  kernel.merge_uv         = merge_uv_neon;
+  kernel.unpack_yuyv      = unpack_yuyv_neon;
+#endif /* defined(HAVE_NEON) */
+}
+
+const char*
+convert_kernel_name(void)
+{
+  pthread_once(&kernel_once, select_kernel);
+
+  return kernel.name;
+}
+
+int
+convert_bytes_per_pixel(int layout)
+{
+  return (layout == CONV_RGBA32)? 4: 3;
+}
+
+int
+convert_is_supported(uint32_t format)
+{
+  int ret;
+
+  switch (format) {
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_NV21:
+  case V4L2_PIX_FMT_NV12M:
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YVU420:
+  case V4L2_PIX_FMT_YUV420M:
+    ret = !0;
+    break;
+
+  default:
+    ret = 0;
+    break;
+  }
+
+  return ret;
+}
+
+/*
+ * 出力の輝度の1ラインのバイト数 (V4L2と同様に、色差のラインのバイト数は
+ * NV12/NV21では同じ、YU12/YV12では半分になるようにする)
+ */
+int
+convert_yuv_stride(uint32_t format, int width)
+{
+  int ret;
+
+  switch (format) {
+  case V4L2_PIX_FMT_YUYV:
+    ret = CHROMA(width) * 4;
+    break;
+
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_NV21:
+    ret = CHROMA(width) * 2;
+    break;
+
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YVU420:
+    ret = width;
+    break;
+
+  default:
+    ret = 0;
+    break;
+  }
+
+  return ret;
+}
+
+size_t
+convert_yuv_size(uint32_t format, int width, int height)
+{
+  size_t ret;
+  size_t stride;
+
+  if (width <= 0 || height <= 0) return 0;
+
+  stride = convert_yuv_stride(format, width);
+
+  switch (format) {
+  case V4L2_PIX_FMT_YUYV:
+    ret = stride * height;
+    break;
+
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_NV21:
+    ret = stride * (height + CHROMA(height));
+    break;
+
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YVU420:
+    ret = (stride * height) + ((size_t)CHROMA(width) * CHROMA(height) * 2);
+    break;
+
+  default:
+    ret = 0;
+    break;
+  }
+
+  return ret;
+}
+
+/*
+ * 入力画像の各プレーンの位置を求める(サイズが足りない場合はエラー)
+ */
+static int
+setup_source(uint32_t format, const void* src, size_t size, int stride,
+             int width, int height, yuv_image_t* img)
+{
+  plane_view_t views[MAX_PLANE];
+  size_t need;
+  int n;
+  int err;
+
+  memset(img, 0, sizeof(*img));
+
+  if (format == V4L2_PIX_FMT_YUYV) {
+    if (stride < CHROMA(width) * 4) return !0;
+    if (size < ((size_t)stride * (height - 1)) + (CHROMA(width) * 4)) return !0;
+
+    img->packed   = !0;
+    img->y        = (const uint8_t*)src;
+    img->y_stride = stride;
+
+    return 0;
+  }
+
+  err = camera_split_image(format, stride, height, (void*)src, size,
+                           views, &n);
+  if (err) return !0;
+
+  switch (format) {
+  case V4L2_PIX_FMT_NV12:
+  case V4L2_PIX_FMT_NV12M:
+  case V4L2_PIX_FMT_NV21:
+    if (n != 2) return !0;
+
+    img->interleaved = !0;
+    img->swap        = (format == V4L2_PIX_FMT_NV21);
+    img->u           = views[1].ptr;
+    need             = CHROMA(width) * 2;
+    break;
+
+  case V4L2_PIX_FMT_YUV420:
+  case V4L2_PIX_FMT_YUV420M:
+  case V4L2_PIX_FMT_YVU420:
+    if (n != 3) return !0;
+
+    img->u = views[(format == V4L2_PIX_FMT_YVU420)? 2: 1].ptr;
+    img->v = views[(format == V4L2_PIX_FMT_YVU420)? 1: 2].ptr;
+    need   = CHROMA(width);
+
+    if (views[2].size < ((size_t)views[2].bytes_per_line *
+                         (CHROMA(height) - 1)) + need) return !0;
+    break;
+
+  default:
+    return !0;
+  }
+
+  if (stride < width) return !0;
+  if (views[1].bytes_per_line < (int)need) return !0;
+  if (views[0].size < ((size_t)stride * (height - 1)) + width) return !0;
+  if (views[1].size < ((size_t)views[1].bytes_per_line *
+                       (CHROMA(height) - 1)) + need) return !0;
+
+  img->y        = views[0].ptr;
+  img->y_stride = stride;
+  img->c_stride = views[1].bytes_per_line;
+
+  return 0;
+}
+
+/*
+ * row行目の輝度と、その行に対応する色差(U, Vのプレーン形式)を返す。
+ * NV12/NV21の色差はworkに分けて返す(YUYVはこの関数では扱わない)。
+ */
+static void
+get_rows(yuv_image_t* img, int row, int width, uint8_t* work,
+         const uint8_t** y, const uint8_t** u, const uint8_t** v)
+{
+  const uint8_t* c;
+
+  *y = img->y + ((size_t)img->y_stride * row);
+  c  = img->u + ((size_t)img->c_stride * (row / 2));
+
+  if (img->interleaved) {
+    kernel.split_uv(c, img->swap, work, work + CHROMA(width), CHROMA(width));
+
+    *u = work;
+    *v = work + CHROMA(width);
+
+  } else {
+    *u = c;
+    *v = img->v + ((size_t)img->c_stride * (row / 2));
+  }
+}
+
+int
+convert_to_rgb(uint32_t format, const void* src, size_t size,
+               int stride, int width, int height,
+               void* dst, int dst_stride, conv_param_t* param)
+{
+  int ret;
+  coeff_t k;
+  yuv_image_t img;
+  uint8_t* work;
+  const uint8_t* s;
+  const uint8_t* c;
+  uint8_t* d;
+  int i;
+
+  /*
+   * initialize
+   */
+  ret  = 0;
+  work = NULL;
+
+  do {
+    /*
+     * check arguments
+     */
+    if (src == NULL || dst == NULL || param == NULL) {
+      ret = !0;
+      break;
+    }
+
+    if (width <= 0 || height <= 0) {
+      ret = !0;
+      break;
+    }
+
+    if (param->layout < CONV_RGB24 || param->layout > CONV_RGBA32) {
+      ret = !0;
+      break;
+    }
+
+    if (param->matrix != CONV_BT601 && param->matrix != CONV_BT709) {
+      ret = !0;
+      break;
+    }
+
+    if (dst_stride < width * convert_bytes_per_pixel(param->layout)) {
+      ret = !0;
+      break;
+    }
+
+    if (setup_source(format, src, size, stride, width, height, &img)) {
+      ret = !0;
+      break;
+    }
+
+    /*
+     * do convert
+     * (4:2:0の画像は1行ずつYUYVに並べ替えてから変換する)
+     */
+    pthread_once(&kernel_once, select_kernel);
+    setup_coeff(&k, param);
+
+    if (!img.packed) {
+      work = (uint8_t*)malloc(CHROMA(width) * 4);
+      if (work == NULL) {
+        ret = !0;
+        break;
+      }
+    }
+
+    d = (uint8_t*)dst;
+
+    for (i = 0; i < height; i++) {
+      s = img.y + ((size_t)img.y_stride * i);
+
+      if (!img.packed) {
+        c = img.u + ((size_t)img.c_stride * (i / 2));
+
+        if (img.interleaved) {
+          kernel.pack_interleaved(s, c, img.swap, work, width);
+        } else {
+          kernel.pack_planar(s, c, img.v + ((size_t)img.c_stride * (i / 2)),
+                             work, width);
+        }
+
+        s = work;
+      }
+
+      kernel.yuyv_row(s, d, width, &k, param->layout);
+      d += dst_stride;
+    }
+  } while (0);
+
+  /*
+   * post process
+   */
+  if (work != NULL) free(work);
+
+  return ret;
+}
+
+/*
+ * 出力画像の記述 (YVU420はU, Vを入れ替えたYUV420として扱う)
+ */
+typedef struct {
+  uint32_t format;        /* YUYV, NV12, NV21, YUV420のいずれか */
+
+  uint8_t* y;             /* YUYVの場合は画像の先頭 */
+  int y_stride;
+
+  uint8_t* u;             /* NV12/NV21の場合は色差プレーンの先頭 */
+  uint8_t* v;
+  int c_stride;
+} yuv_dest_t;
+
+/*
+ * convert_yuv()の出力先 (各プレーンを詰めて配置する)
+ */
+static void
+setup_dest(uint32_t format, void* dst, int width, int height,
+           yuv_dest_t* dest)
+{
+  int cw;
+
+  cw = CHROMA(width);
+
+  dest->format   = format;
+  dest->y        = (uint8_t*)dst;
+  dest->y_stride = convert_yuv_stride(format, width);
+  dest->u        = dest->y + ((size_t)dest->y_stride * height);
+  dest->v        = NULL;
+  dest->c_stride = cw * 2;
+
+  if (format == V4L2_PIX_FMT_YUV420 || format == V4L2_PIX_FMT_YVU420) {
+    dest->format   = V4L2_PIX_FMT_YUV420;
+    dest->v        = dest->u + ((size_t)cw * CHROMA(height));
+    dest->c_stride = cw;
+
+    if (format == V4L2_PIX_FMT_YVU420) {
+      dest->v = dest->u;
+      dest->u = dest->v + ((size_t)cw * CHROMA(height));
+    }
+  }
+}
+
+/*
+ * 出力側の書き込み (輝度2行と、その2行で共有する色差を書き込む)
+ */
+static void
+put_rows(yuv_dest_t* dest, int width, int height, int row,
+         const uint8_t* y0, const uint8_t* y1,
+         const uint8_t* u, const uint8_t* v)
+{
+  uint8_t* py;
+  int stride;
+  int cw;
+  size_t off;
+
+  stride = dest->y_stride;
+  cw     = CHROMA(width);
+  py     = dest->y + ((size_t)stride * row);
+  off    = (size_t)dest->c_stride * (row / 2);
+
+  if (dest->format == V4L2_PIX_FMT_YUYV) {
+    kernel.pack_planar(y0, u, v, py, width);
+    if (row + 1 < height) kernel.pack_planar(y1, u, v, py + stride, width);
+
+    return;
+  }
+
+  memcpy(py, y0, width);
+  if (row + 1 < height) memcpy(py + stride, y1, width);
+
+  if (dest->format == V4L2_PIX_FMT_YUV420) {
+    memcpy(dest->u + off, u, cw);
+    memcpy(dest->v + off, v, cw);
+
+    return;
+  }
+
+  // NV12/NV21で幅が奇数の場合、輝度の行末の1バイトは0で埋める
+  if (stride > width) {
+    py[width] = 0;
+    if (row + 1 < height) py[stride + width] = 0;
+  }
+
+  kernel.merge_uv(u, v, (dest->format == V4L2_PIX_FMT_NV21), dest->u + off,
+                  cw);
+}
+
+/*
+ * 色差を共有する2行ずつ並べ替える
+ */
+static int
+repack(yuv_image_t* img, yuv_dest_t* dest, int width, int height)
+{
+  uint8_t* work;
+  const uint8_t* y0;
+  const uint8_t* y1;
+  const uint8_t* u;
+  const uint8_t* v;
+  const uint8_t* s0;
+  const uint8_t* s1;
+  int cw;
+  int i;
+
+  cw = CHROMA(width);
+
+  /*
+   * 作業領域 (輝度2行分と色差2プレーン分)
+   */
+  pthread_once(&kernel_once, select_kernel);
+
+  work = (uint8_t*)malloc((cw * 4) + (cw * 2));
+  if (work == NULL) return !0;
+
+  for (i = 0; i < height; i += 2) {
+    if (img->packed) {
+      s0 = img->y + ((size_t)img->y_stride * i);
+      s1 = (i + 1 < height)? s0 + img->y_stride: s0;
+      y0 = work;
+      y1 = work + (cw * 2);
+      u  = work + (cw * 4);
+      v  = u + cw;
+
+      kernel.unpack_yuyv(s0, s1, (uint8_t*)y0, (uint8_t*)y1,
+                         (uint8_t*)u, (uint8_t*)v, width);
+
+    } else {
+      get_rows(img, i, width, work, &y0, &u, &v);
+      y1 = (i + 1 < height)? y0 + img->y_stride: y0;
+    }
+
+    put_rows(dest, width, height, i, y0, y1, u, v);
+  }
+
+  free(work);
+
+  return 0;
+}
+
+int
+convert_yuv(uint32_t format, const void* src, size_t size,
+            int stride, int width, int height,
+            uint32_t dst_format, void* dst)
+{
+  int ret;
+  yuv_image_t img;
+  yuv_dest_t dest;
+  int cw;
+  int i;
+
+  /*
+   * initialize
+   */
+  ret = 0;
+  cw  = CHROMA(width);
+
+  do {
+    /*
+     * check arguments
+     */
+    if (src == NULL || dst == NULL) {
+      ret = !0;
+      break;
+    }
+
+    if (convert_yuv_size(dst_format, width, height) == 0) {
+      ret = !0;
+      break;
+    }
+
+    if (setup_source(format, src, size, stride, width, height, &img)) {
+      ret = !0;
+      break;
+    }
+
+    /*
+     * YUYV同士の場合は色差を平均せずにそのまま複製する
+     */
+    if (img.packed && dst_format == V4L2_PIX_FMT_YUYV) {
+      for (i = 0; i < height; i++) {
+        memcpy((uint8_t*)dst + ((size_t)cw * 4 * i),
+               img.y + ((size_t)img.y_stride * i), cw * 4);
+      }
+
+      break;
+    }
+
+    /*
+     * do convert
+     */
+    setup_dest(dst_format, dst, width, height, &dest);
+    ret = repack(&img, &dest, width, height);
+  } while (0);
+
+  return ret;
+}
+
+int
+convert_to_planes(uint32_t format, const void* src, size_t size,
+                  int stride, int width, int height,
+                  void* y, int y_stride, void* u, void* v, int c_stride)
+{
+  int ret;
+  yuv_image_t img;
+  yuv_dest_t dest;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (src == NULL || y == NULL || u == NULL || v == NULL) break;
+    if (width <= 0 || height <= 0) break;
+    if (y_stride < width || c_stride < CHROMA(width)) break;
+
+    if (setup_source(format, src, size, stride, width, height, &img)) {
+      break;
+    }
+
+    /*
+     * do convert
+     */
+    dest.format   = V4L2_PIX_FMT_YUV420;
+    dest.y        = (uint8_t*)y;
+    dest.y_stride = y_stride;
+    dest.u        = (uint8_t*)u;
+    dest.v        = (uint8_t*)v;
+    dest.c_stride = c_stride;
+
+    ret = repack(&img, &dest, width, height);
+  } while (0);
+
+  return ret;
+}
@@ -0,0 +1,80 @@
+﻿/*
+ *
+ * Video 4 Linux V2 driver library (pixel format conversion).
+ *
+ *  Copyright (C) 2015 Hiroshi Kuwagata. All rights reserved.
+ *
+ */
+
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "camera.h"
+
+/*
+ * 出力の画素配置
+ */
+#define CONV_RGB24          0
+#define CONV_BGR24          1
+#define CONV_RGBA32         2
+
+/*
+ * 色変換の係数
+ */
+#define CONV_BT601          0
+#define CONV_BT709          1
+
+typedef struct __conv_param__ {
+  int layout;             /* CONV_RGB24, CONV_BGR24, CONV_RGBA32のいずれか */
+  int matrix;             /* CONV_BT601かCONV_BT709 */
+  int full_range;         /* 入力がフルレンジ(0〜255)の場合は!0 */
+} conv_param_t;
+
+/*
+ * 実行時に選択した変換カーネルの名前を返します("avx2", "sse2", "neon",
+ * "scalar"のいずれか)。
+ */
+extern const char* convert_kernel_name(void);
+
+extern int convert_bytes_per_pixel(int layout);
+
+/*
+ * 入力として扱えるフォーマットか否かを返します(YUYV, NV12, NV21, YU12,
+ * YV12と、それぞれのマルチプレーン版)。
+ */
+extern int convert_is_supported(uint32_t format);
+
+/*
+ * formatの画像をRGB系の画素配置に変換します。strideは入力の(輝度の)1ライ
+ * ンのバイト数、dst_strideは出力の1ラインのバイト数です。
+ */
+extern int convert_to_rgb(uint32_t format, const void* src, size_t size,
+                          int stride, int width, int height,
+                          void* dst, int dst_stride, conv_param_t* param);
+
+/*
+ * YUV系のフォーマット間で並べ替えます。出力はYUYV, NV12, NV21, YU12, YV12
+ * のいずれかで、1ラインのバイト数はconvert_yuv_stride()の値に詰めて書き
+ * 込みます。dstにはconvert_yuv_size()が返すサイズの領域が必要です(出力
+ * できないフォーマットの場合はどちらも0を返します)。
+ */
+extern int convert_yuv_stride(uint32_t format, int width);
+extern size_t convert_yuv_size(uint32_t format, int width, int height);
+extern int convert_yuv(uint32_t format, const void* src, size_t size,
+                       int stride, int width, int height,
+                       uint32_t dst_format, void* dst);
+
+/*
+ * formatの画像を輝度と色差(U, V)のプレーンに分けて、4:2:0で書き出します。
+ * 出力先の各プレーンの位置と1ラインのバイト数は呼び出し側が指定します
+ * (JPEGエンコーダ等にパディング付きの領域を渡すために使用します)。
+ */
+extern int convert_to_planes(uint32_t format, const void* src, size_t size,
+                             int stride, int width, int height,
+                             void* y, int y_stride,
+                             void* u, void* v, int c_stride);
+
+#endif /* !defined(__CONVERT_H__) */
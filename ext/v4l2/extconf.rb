@@ -1,5 +1,17 @@
 require 'mkmf'
 
-$CFLAGS="-DRUBY_EXTLIB"
+# 既定のフラグ(最適化の指定など)を残したまま追加する
+$CFLAGS << " -DRUBY_EXTLIB"
+
+have_header("ruby/io/buffer.h")
+have_header("ruby/fiber/scheduler.h")
+
+# 古いglibcではshm_open()がlibrtにある
+have_library("rt", "shm_open")
+
+# JPEG出力(生の画像のエンコード)はlibjpegがある場合のみ有効にする
+if have_library("jpeg", "jpeg_CreateCompress", ["stdio.h", "jpeglib.h"])
+  $defs << "-DHAVE_LIBJPEG"
+end
 
 create_makefile( "v4l2/v4l2")
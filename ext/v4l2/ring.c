@@ -0,0 +1,571 @@
+﻿/*
+ *
+ * Video 4 Linux V2 driver library (shared frame ring).
+ *
+ *  Copyright (C) 2015 Hiroshi Kuwagata. All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+#define WAIT_PERIOD               100     /* [ms] */
+#define SLOT_ALIGN                4096
+#define ROUND_UP(x,n)             ((((x) + (n) - 1) / (n)) * (n))
+
+#define LOAD(x)                   __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x,v)                __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+static void
+futex_wait(volatile uint32_t* addr, uint32_t val, int msec)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = msec / 1000;
+  ts.tv_nsec = (msec % 1000) * 1000000;
+
+  // プロセス間で共有するのでFUTEX_PRIVATE_FLAGは付けない
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void
+futex_wake(volatile uint32_t* addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static ring_slot_t*
+slot_of(ring_t* ring, uint32_t frame)
+{
+  return ring->hdr->slot + ((frame - 1) % ring->hdr->nslot);
+}
+
+static uint8_t*
+data_of(ring_t* ring, uint32_t frame)
+{
+  return (uint8_t*)ring->base +
+         ring->hdr->data_offset +
+         (((frame - 1) % ring->hdr->nslot) * ring->hdr->stride);
+}
+
+int
+ring_create(ring_t* ring, char* name, int nslot, size_t slot_size)
+{
+  int ret;
+  int fd;
+  size_t head;
+  size_t stride;
+  size_t size;
+  void* base;
+  ring_header_t* hdr;
+
+  do {
+    /*
+     * entry process
+     */
+    ret  = !0;
+    fd   = -1;
+    base = MAP_FAILED;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (name == NULL || strlen(name) > NAME_MAX) break;
+    if (nslot < MIN_RING_SLOTS || nslot > MAX_RING_SLOTS) break;
+    if (slot_size == 0) break;
+
+    /*
+     * create shared memory
+     * (残っている古いものは読み出し側ごと切り離す)
+     */
+    head   = ROUND_UP(sizeof(ring_header_t) +
+                      (sizeof(ring_slot_t) * nslot), SLOT_ALIGN);
+    stride = ROUND_UP(slot_size, SLOT_ALIGN);
+    size   = head + (stride * nslot);
+
+    shm_unlink(name);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      perror("shm_open()");
+      break;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+      perror("ftruncate()");
+      shm_unlink(name);
+      break;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      perror("mmap()");
+      shm_unlink(name);
+      break;
+    }
+
+    /*
+     * initialize header
+     * (magicは最後に書き込み、初期化途中のものには接続させない)
+     */
+    hdr              = (ring_header_t*)base;
+    hdr->version     = RING_VERSION;
+    hdr->nslot       = nslot;
+    hdr->slot_size   = slot_size;
+    hdr->data_offset = head;
+    hdr->stride      = stride;
+    hdr->latest      = 0;
+
+    STORE(hdr->magic, RING_MAGIC);
+
+    /*
+     * set context
+     */
+    strcpy(ring->name, name);
+
+    ring->owner       = getpid();
+    ring->base        = base;
+    ring->size        = size;
+    ring->hdr         = hdr;
+    ring->last        = 0;
+    ring->writing     = 0;
+    ring->interrupted = 0;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  if (fd >= 0) close(fd);
+
+  return ret;
+}
+
+int
+ring_attach(ring_t* ring, char* name)
+{
+  int ret;
+  int fd;
+  struct stat st;
+  void* base;
+  ring_header_t* hdr;
+
+  do {
+    /*
+     * entry process
+     */
+    ret  = !0;
+    fd   = -1;
+    base = MAP_FAILED;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (name == NULL || strlen(name) > NAME_MAX) break;
+
+    /*
+     * map shared memory (読み出し側は読み込みのみ)
+     */
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) break;
+
+    if (fstat(fd, &st) < 0) break;
+    if ((size_t)st.st_size < sizeof(ring_header_t)) break;
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) break;
+
+    /*
+     * validate header
+     */
+    hdr = (ring_header_t*)base;
+
+    if (LOAD(hdr->magic) != RING_MAGIC || hdr->version != RING_VERSION ||
+        hdr->nslot < MIN_RING_SLOTS || hdr->nslot > MAX_RING_SLOTS ||
+        hdr->data_offset + (hdr->stride * hdr->nslot) > (size_t)st.st_size ||
+        hdr->slot_size > hdr->stride) {
+      munmap(base, st.st_size);
+      break;
+    }
+
+    /*
+     * set context
+     */
+    strcpy(ring->name, name);
+
+    ring->owner       = 0;
+    ring->base        = base;
+    ring->size        = st.st_size;
+    ring->hdr         = hdr;
+    ring->last        = 0;
+    ring->writing     = 0;
+    ring->interrupted = 0;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  if (fd >= 0) close(fd);
+
+  return ret;
+}
+
+int
+ring_detach(ring_t* ring)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->base == NULL) break;
+
+    /*
+     * release resources
+     */
+    if (ring->writing != 0) ring_cancel_write(ring);
+
+    munmap(ring->base, ring->size);
+    // fork先で解放された場合は削除しない
+    if (ring->owner == getpid()) shm_unlink(ring->name);
+
+    ring->base = NULL;
+    ring->hdr  = NULL;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
+
+int
+ring_begin_write(ring_t* ring, void** ptr, size_t* size)
+{
+  int ret;
+  uint32_t frame;
+  ring_slot_t* slot;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->hdr == NULL || ring->owner == 0) break;
+    if (ring->writing != 0) break;
+    if (ptr == NULL || size == NULL) break;
+
+    /*
+     * mark the next slot as writing
+     * (最新のスロットの次に書くので、読み出し側が追い越されるのはリング
+     *  を一周された場合のみ)
+     */
+    frame = ring->hdr->latest + 1;
+    if (frame == 0) frame = 1;
+
+    slot  = slot_of(ring, frame);
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->frame = 0;
+
+    /*
+     * set return parameters
+     */
+    *ptr          = data_of(ring, frame);
+    *size         = ring->hdr->slot_size;
+    ring->writing = frame;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
+
+int
+ring_commit_write(ring_t* ring, size_t used, uint32_t format,
+                  int width, int height, int bpl, frame_info_t* info)
+{
+  int ret;
+  ring_slot_t* slot;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->writing == 0) break;
+    if (used > ring->hdr->slot_size) break;
+
+    /*
+     * update metadata and publish
+     */
+    slot = slot_of(ring, ring->writing);
+
+    slot->frame          = ring->writing;
+    slot->format         = format;
+    slot->width          = width;
+    slot->height         = height;
+    slot->bytes_per_line = bpl;
+    slot->used           = used;
+
+    if (info != NULL) {
+      slot->info = *info;
+    } else {
+      memset(&slot->info, 0, sizeof(slot->info));
+    }
+
+    STORE(slot->seq, slot->seq + 1);
+    STORE(ring->hdr->latest, ring->writing);
+
+    ring->writing = 0;
+
+    futex_wake(&ring->hdr->latest);
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
+
+int
+ring_cancel_write(ring_t* ring)
+{
+  int ret;
+  ring_slot_t* slot;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->writing == 0) break;
+
+    /*
+     * close the slot without publish (frameが0のままなので読まれない)
+     */
+    slot = slot_of(ring, ring->writing);
+    STORE(slot->seq, slot->seq + 1);
+
+    ring->writing = 0;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
+
+int
+ring_read(ring_t* ring, void* ptr, size_t size, ring_slot_t* slot,
+          int* ready)
+{
+  int ret;
+  int err;
+  int i;
+  uint32_t frame;
+  uint32_t seq;
+  ring_slot_t* src;
+  ring_slot_t tmp;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->hdr == NULL) break;
+    if (ptr == NULL) break;
+    if (ready == NULL) break;
+
+    /*
+     * read the newest frame
+     * (書き込みと衝突した場合は最新のフレームを読み直す。回数に上限を設け
+     *  ているので書き込み側を待つことはない)
+     */
+    *ready = 0;
+    err    = 0;
+
+    for (i = 0; i < (int)ring->hdr->nslot; i++) {
+      frame = LOAD(ring->hdr->latest);
+      if (frame == 0 || frame == ring->last) break;
+
+      src = slot_of(ring, frame);
+      seq = LOAD(src->seq);
+      if (seq & 1) continue;
+
+      tmp = *src;
+      if (tmp.frame != frame || tmp.used > ring->hdr->slot_size) continue;
+      if (tmp.used > size) {
+        err = !0;
+        break;
+      }
+
+      memcpy(ptr, data_of(ring, frame), tmp.used);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq) continue;
+
+      ring->last = frame;
+      if (slot != NULL) *slot = tmp;
+      *ready = !0;
+      break;
+    }
+
+    if (err) break;
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
+
+int
+ring_wait(ring_t* ring, int timeout, int* ready)
+{
+  int ret;
+  int64_t deadline;
+  int64_t rest;
+  uint32_t frame;
+  int period;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->hdr == NULL) break;
+    if (ready == NULL) break;
+
+    /*
+     * wait for the next frame
+     * (中断の通知を取りこぼしても戻れるよう、一定周期で起き直す)
+     */
+    deadline = (timeout >= 0)? camera_monotonic_msec() + timeout: -1;
+    *ready   = 0;
+
+    while (1) {
+      frame = LOAD(ring->hdr->latest);
+      if (frame != 0 && frame != ring->last) {
+        *ready = !0;
+        break;
+      }
+
+      if (ring->interrupted) {
+        ring->interrupted = 0;
+        break;
+      }
+
+      period = WAIT_PERIOD;
+
+      if (deadline >= 0) {
+        rest = deadline - camera_monotonic_msec();
+        if (rest <= 0) break;
+        if (rest < period) period = rest;
+      }
+
+      futex_wait(&ring->hdr->latest, frame, period);
+    }
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
+
+int
+ring_interrupt(ring_t* ring)
+{
+  int ret;
+
+  do {
+    /*
+     * entry process
+     */
+    ret = !0;
+
+    /*
+     * check arguments
+     */
+    if (ring == NULL) break;
+    if (ring->hdr == NULL) break;
+
+    /*
+     * wake up the waiter
+     */
+    ring->interrupted = !0;
+    futex_wake(&ring->hdr->latest);
+
+    /*
+     * mark succeed
+     */
+    ret = 0;
+  } while (0);
+
+  return ret;
+}
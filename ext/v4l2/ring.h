@@ -0,0 +1,101 @@
+﻿/*
+ *
+ * Video 4 Linux V2 driver library (shared frame ring).
+ *
+ *  Copyright (C) 2015 Hiroshi Kuwagata. All rights reserved.
+ *
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "camera.h"
+
+#define RING_MAGIC          0x47523456      /* "V4RG" */
+#define RING_VERSION        1
+#define MIN_RING_SLOTS      3       /* 番号が一周した時に最新のスロットと重ならない数 */
+#define MAX_RING_SLOTS      64
+
+/*
+ * スロット毎のメタデータ (seqが奇数の間は書き込み中)
+ */
+typedef struct __ring_slot__ {
+  volatile uint32_t seq;
+  uint32_t frame;
+  uint32_t format;
+  int32_t width;
+  int32_t height;
+  int32_t bytes_per_line;
+  uint64_t used;
+  frame_info_t info;
+} ring_slot_t;
+
+/*
+ * 共有メモリの先頭に置くヘッダ
+ * (latestは最後に書き込みを終えたフレームの番号で、0はフレーム無し)
+ */
+typedef struct __ring_header__ {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nslot;
+  uint32_t reserved;
+  uint64_t slot_size;
+  uint64_t data_offset;
+  uint64_t stride;
+  volatile uint32_t latest;
+  uint32_t padding;
+  ring_slot_t slot[];
+} ring_header_t;
+
+typedef struct __ring__ {
+  char name[NAME_MAX + 1];
+  pid_t owner;            /* 作成したプロセス (接続しただけの場合は0) */
+  void* base;
+  size_t size;
+  ring_header_t* hdr;
+
+  uint32_t last;          /* 読み出し側が最後に読んだフレームの番号 */
+  uint32_t writing;       /* 書き込み中のフレームの番号 (無い場合は0) */
+  volatile int interrupted;
+} ring_t;
+
+/*
+ * create()は同名の共有メモリが残っている場合は削除してから作り直します。
+ * 既に接続している読み出し側は古い共有メモリを参照し続けるので、接続し
+ * 直す必要があります。
+ */
+extern int ring_create(ring_t* ring, char* name, int nslot, size_t slot_size);
+extern int ring_attach(ring_t* ring, char* name);
+extern int ring_detach(ring_t* ring);
+
+/*
+ * 書き込みはbegin_write()で取得した領域に画像を書き込み、commit_write()で
+ * 公開します。書き込みを中止する場合はcancel_write()を呼んでください。
+ */
+extern int ring_begin_write(ring_t* ring, void** ptr, size_t* size);
+extern int ring_commit_write(ring_t* ring, size_t used, uint32_t format,
+                             int width, int height, int bpl,
+                             frame_info_t* info);
+extern int ring_cancel_write(ring_t* ring);
+
+/*
+ * 最新のフレームを待たずに読み出します。前回読んだフレームから更新されて
+ * いない場合や、書き込みに追い越され続けて読めなかった場合は*readyに0を
+ * 設定します。slotにはメタデータを返します(NULLの場合は返さない)。
+ */
+extern int ring_read(ring_t* ring, void* ptr, size_t size, ring_slot_t* slot,
+                     int* ready);
+
+/*
+ * 前回読んだフレームより新しいフレームが公開されるまで待ちます。timeout
+ * の意味はcamera_try_get_image()と同じです。interrupt()で待ちを中断でき
+ * ます(*readyには0を設定)。
+ */
+extern int ring_wait(ring_t* ring, int timeout, int* ready);
+extern int ring_interrupt(ring_t* ring);
+
+#endif /* !defined(__RING_H__) */
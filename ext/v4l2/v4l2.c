@@ -8,15 +8,69 @@
  * $Id: v4l2.c 121 2016-11-18 04:32:27Z pi $
  */
 
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include "ruby.h"
 #include "ruby/encoding.h"
+#include "ruby/thread.h"
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include "ruby/io.h"
+#include "ruby/fiber/scheduler.h"
+#endif /* defined(HAVE_RUBY_FIBER_SCHEDULER_H) */
 
 #include "camera.h"
+#include "ring.h"
+#include "convert.h"
+#include "codec.h"
 
 #define N(x)                            (sizeof((x))/sizeof(*(x)))
 
 #define EQ_STR(val,str)                 (rb_to_id(val) == rb_intern(str))
 
+#define SHARED_FRAME_MAGIC              0x46344c56      /* "V4LF" */
+#define SHARED_RELEASE_MAGIC            0x52344c56      /* "V4LR" */
+
+/*
+ * send_frame()で送るメッセージ (dmabufのfdはSCM_RIGHTSで添付する)
+ * 同一ホスト内でのやり取りに限るのでバイトオーダの変換は行わない
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t format;
+  uint64_t token;
+  int32_t width;
+  int32_t height;
+  int32_t bytes_per_line;
+  uint32_t nplane;
+  frame_info_t info;
+
+  struct {
+    uint64_t size;
+    uint64_t offset;
+    uint64_t used;
+  } plane[MAX_PLANE];
+} shared_frame_msg_t;
+
+/*
+ * 受信側から送られる返却通知
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t token;
+} shared_release_msg_t;
+
 extern rb_encoding* rb_utf8_encoding(void);
 extern rb_encoding* rb_default_internal_encoding(void);
 
@@ -30,6 +84,12 @@ static VALUE menu_klass;
 static VALUE menu_item_klass;
 static VALUE frame_cap_klass;
 static VALUE fmt_desc_klass;
+static VALUE frame_info_klass;
+static VALUE poller_klass;
+static VALUE shared_frame_klass;
+static VALUE frame_klass;
+static VALUE publisher_klass;
+static VALUE reader_klass;
 
 static ID id_iv_name;
 static ID id_iv_driver;
@@ -46,36 +106,66 @@ static ID id_iv_height;
 static ID id_iv_rate;
 static ID id_iv_fcc;
 static ID id_iv_desc;
+static ID id_iv_sequence;
+static ID id_iv_timestamp;
+static ID id_iv_time;
+static ID id_iv_flags;
+static ID id_iv_field;
+static ID id_iv_error;
+static ID id_iv_skipped;
+static ID id_lent;
+static ID id_into;
+static ID id_scale;
+static ID id_color;
+static ID id_timeout;
+static ID id_owner;
+static ID id_io;
+static ID id_io_serial;
+static ID id_sent;
+static ID id_shareable;
+static ID id_token;
+static ID id_iv_token;
+static ID id_iv_format;
+static ID id_iv_bytes_per_line;
+static ID id_iv_info;
+static ID id_iv_planes;
+static ID id_iv_offsets;
+static ID id_pool;
+static ID id_pool_size;
+static ID id_matrix;
+static ID id_range;
 
 static void rb_camera_free(void* ptr);
 static size_t rb_camera_size(const void* ptr);
 
 static const rb_data_type_t camera_data_type = {
-  "V4L2 for ruby",                      // wrap_struct_name
-  NULL,                                 // function.dmark
-  rb_camera_free,                       // function.dfree
-  rb_camera_size,                       // function.dsize
-  NULL,                                 // function.dcompact
-  NULL,                                 // reserved[0]
-  NULL,                                 // parent
-  NULL,                                 // data
-  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY    // flags
+  .wrap_struct_name = "V4L2 for ruby",
+  .function = {
+    .dfree = rb_camera_free,
+    .dsize = rb_camera_size,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
 
 static void
 rb_camera_free(void* ptr)
 {
-  if (((camera_t*)ptr)->state != 6) {
-    camera_finalize( ptr);
-  }
+  // 開始中の場合の停止や解放済みの判定はcamera_finalize()側で行う
+  camera_finalize( ptr);
 
-  free( ptr);
+  xfree( ptr);
 }
 
 static size_t
 rb_camera_size(const void* ptr)
 {
-  return sizeof(camera_t);
+  const camera_t* cam;
+
+  cam = (const camera_t*)ptr;
+
+  return sizeof(camera_t) + cam->buffer_memory +
+         codec_encoder_memsize(cam->encoder) +
+         codec_decoder_memsize(cam->decoder);
 }
 
 static VALUE
@@ -136,6 +226,57 @@ rb_camera_initialize(VALUE self, VALUE dev)
   return Qtrue;
 }
 
+#ifdef HAVE_RUBY_IO_BUFFER_H
+/*
+ * 貸し出したオブジェクト(IO::BufferかIO::Bufferの配列)を無効化する
+ */
+static void
+invalidate_lent_object(VALUE obj)
+{
+  long i;
+
+  if (RB_TYPE_P(obj, T_ARRAY)) {
+    for (i = 0; i < RARRAY_LEN(obj); i++) {
+      rb_io_buffer_free(RARRAY_AREF(obj, i));
+    }
+
+  } else {
+    rb_io_buffer_free(obj);
+  }
+}
+
+static int
+free_lent_buffer(VALUE buf, VALUE idx, VALUE arg)
+{
+  invalidate_lent_object(buf);
+
+  return ST_CONTINUE;
+}
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+static void
+revoke_lent_buffers(VALUE self)
+{
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  VALUE lent;
+
+  /*
+   * 貸し出し中のIO::Buffer は、ストップ後にアンマップされた領域を指すこと
+   * になるので、ここで全て無効化しておく。
+   */
+  lent = rb_attr_get(self, id_lent);
+
+  if (lent != Qnil) {
+    rb_hash_foreach(lent, free_lent_buffer, Qnil);
+    rb_hash_clear(lent);
+  }
+
+  // 他プロセスに送ったバッファもストップでドライバから回収されるので破棄
+  lent = rb_attr_get(self, id_sent);
+  if (lent != Qnil) rb_hash_clear(lent);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+}
+
 static VALUE
 rb_camera_close( VALUE self)
 {
@@ -158,6 +299,8 @@ rb_camera_close( VALUE self)
     }
 
     if (ready) {
+      revoke_lent_buffers(self);
+
       err = camera_stop(ptr);
       if (err) {
         rb_raise(rb_eRuntimeError, "camera_stop() failed.");
@@ -397,12 +540,19 @@ to_pixfmt(VALUE fmt)
   } else if (EQ_STR(fmt, "NV16")) {
     ret = V4L2_PIX_FMT_NV16;
 
-  } else if (EQ_STR(fmt, "YUV420") || EQ_STR(fmt, "YU12")) {
+  } else if (EQ_STR(fmt, "YUV420") || EQ_STR(fmt, "YU12") ||
+             EQ_STR(fmt, "I420")) {
     ret = V4L2_PIX_FMT_YUV420;
 
   } else if (EQ_STR(fmt, "YVU420") || EQ_STR(fmt, "YV12")) {
     ret = V4L2_PIX_FMT_YVU420;
 
+  } else if (EQ_STR(fmt, "NV12M")) {
+    ret = V4L2_PIX_FMT_NV12M;
+
+  } else if (EQ_STR(fmt, "YUV420M") || EQ_STR(fmt, "YM12")) {
+    ret = V4L2_PIX_FMT_YUV420M;
+
   } else if (EQ_STR(fmt, "NV16")) {
     ret = V4L2_PIX_FMT_NV16;
 
@@ -422,6 +572,17 @@ to_pixfmt(VALUE fmt)
   return ret;
 }
 
+static VALUE
+to_fourcc(uint32_t fmt)
+{
+  return rb_enc_sprintf(rb_utf8_encoding(),
+                        "%c%c%c%c",
+                        fmt >>  0 & 0xff,
+                        fmt >>  8 & 0xff,
+                        fmt >> 16 & 0xff,
+                        fmt >> 24 & 0xff);
+}
+
 static VALUE
 rb_camera_get_support_formats(VALUE self)
 {
@@ -445,12 +606,7 @@ rb_camera_get_support_formats(VALUE self)
     if (err) break;
 
     fmt = rb_obj_alloc(fmt_desc_klass);
-    fcc = rb_enc_sprintf(rb_utf8_encoding(),
-                         "%c%c%c%c",
-                         desc.pixelformat >>  0 & 0xff,
-                         desc.pixelformat >>  8 & 0xff,
-                         desc.pixelformat >> 16 & 0xff,
-                         desc.pixelformat >> 24 & 0xff);
+    fcc = to_fourcc(desc.pixelformat);
 
     str = rb_enc_str_new_cstr((const char*)desc.description,
                                rb_utf8_encoding());
@@ -736,6 +892,52 @@ rb_camera_set_image_height(VALUE self, VALUE val)
   return Qnil;
 }
 
+static VALUE
+rb_camera_get_image_size(VALUE self)
+{
+  size_t ret;
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_image_size(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get image size failed.");
+  }
+
+  return SIZET2NUM(ret);
+}
+
+static VALUE
+rb_camera_get_bytes_per_line(VALUE self)
+{
+  int ret;
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_bytes_per_line(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get bytes per line failed.");
+  }
+
+  return INT2FIX(ret);
+}
+
 static VALUE
 rb_camera_get_framerate(VALUE self)
 {
@@ -804,10 +1006,11 @@ rb_camera_set_framerate(VALUE self, VALUE val)
 }
 
 static VALUE
-rb_camera_state( VALUE self)
+rb_camera_get_buffer_count(VALUE self)
 {
+  int ret;
   camera_t* ptr;
-  const char* str;
+  int err;
 
   /*
    * strip object
@@ -815,47 +1018,66 @@ rb_camera_state( VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * convert state code
+   * get parameter
    */
-  switch (ptr->state) {
-  case -1:
-    str = "ERROR";
-    break;
+  err = camera_get_buffer_count(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get buffer count failed.");
+  }
 
-  case 0:
-    str = "FINALIZED";
-    break;
+  return INT2FIX(ret);
+}
 
-  case 1:
-    str = "INITIALIZED";
-    break;
+static VALUE
+rb_camera_set_buffer_count(VALUE self, VALUE val)
+{
+  camera_t* ptr;
+  int err;
 
-  case 2:
-    str = "PREAPARE";
-    break;
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
-  case 3:
-    str = "READY";
-    break;
+  /*
+   * set parameter
+   */
+  err = camera_set_buffer_count(ptr, NUM2INT(val));
+  if (err) {
+    rb_raise(rb_eRuntimeError, "set buffer count failed.");
+  }
 
-  case 4:
-    str = "ST_REQUESTED";
-    break;
+  return Qnil;
+}
 
-  default:
-    str = "unknown";
-    break;
+static VALUE
+rb_camera_get_background(VALUE self)
+{
+  int ret;
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_background(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get background capture mode failed.");
   }
 
-  return ID2SYM(rb_intern(str));
+  return (ret)? Qtrue: Qfalse;
 }
 
 static VALUE
-rb_camera_start(VALUE self)
+rb_camera_set_background(VALUE self, VALUE val)
 {
-  int err;
   camera_t* ptr;
-  int state;
+  int err;
 
   /*
    * strip object
@@ -863,30 +1085,44 @@ rb_camera_start(VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * do start
+   * set parameter
    */
-  err = camera_start(ptr);
+  err = camera_set_background(ptr, RTEST(val));
   if (err) {
-    rb_raise(rb_eRuntimeError, "start capture failed.");
+    rb_raise(rb_eRuntimeError, "set background capture mode failed.");
   }
 
+  return Qnil;
+}
+
+static VALUE
+rb_camera_get_low_latency(VALUE self)
+{
+  int ret;
+  camera_t* ptr;
+  int err;
+
   /*
-   *
+   * strip object
    */
-  if (rb_block_given_p()) {
-    rb_protect(rb_yield, self, &state);
-    camera_stop(ptr);
-    if (state) rb_jump_tag(state);
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_low_latency(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get low latency mode failed.");
   }
 
-  return self;
+  return (ret)? Qtrue: Qfalse;
 }
 
 static VALUE
-rb_camera_stop(VALUE self)
+rb_camera_set_low_latency(VALUE self, VALUE val)
 {
-  int err;
   camera_t* ptr;
+  int err;
 
   /*
    * strip object
@@ -894,23 +1130,21 @@ rb_camera_stop(VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * convert
+   * set parameter
    */
-  err = camera_stop(ptr);
+  err = camera_set_low_latency(ptr, RTEST(val));
   if (err) {
-    rb_raise(rb_eRuntimeError, "stop capture failed.");
+    rb_raise(rb_eRuntimeError, "set low latency mode failed.");
   }
 
-  return self;
+  return Qnil;
 }
 
-
 static VALUE
-rb_camera_capture(VALUE self)
+rb_camera_get_jpeg_output(VALUE self)
 {
-  VALUE ret;
+  int ret;
   camera_t* ptr;
-  size_t used;
   int err;
 
   /*
@@ -919,32 +1153,48 @@ rb_camera_capture(VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * allocate return value.
+   * get parameter
+   */
+  err = camera_get_jpeg_output(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get jpeg output mode failed.");
+  }
+
+  return (ret)? Qtrue: Qfalse;
+}
+
+static VALUE
+rb_camera_set_jpeg_output(VALUE self, VALUE val)
+{
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
    */
-  ret = rb_str_buf_new(ptr->image_size);
-  rb_str_set_len(ret, ptr->image_size);
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * do capture
+   * set parameter
    */
-  err = camera_get_image(ptr, RSTRING_PTR(ret), &used);
-  if (err) {
-    rb_raise(rb_eRuntimeError, "capture failed.");
+  if (RTEST(val) && !codec_is_available()) {
+    rb_raise(rb_eNotImpError, "built without libjpeg.");
   }
 
-  if (ptr->image_size != used) {
-    rb_str_set_len(ret, used);
+  err = camera_set_jpeg_output(ptr, RTEST(val));
+  if (err) {
+    rb_raise(rb_eRuntimeError, "set jpeg output mode failed.");
   }
 
-  return ret;
+  return Qnil;
 }
 
 static VALUE
-rb_camera_is_busy(VALUE self)
+rb_camera_get_jpeg_quality(VALUE self)
 {
+  int ret;
   camera_t* ptr;
   int err;
-  int busy;
 
   /*
    * strip object
@@ -952,22 +1202,21 @@ rb_camera_is_busy(VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * do check
+   * get parameter
    */
-  err = camera_check_busy(ptr, &busy);
+  err = camera_get_jpeg_quality(ptr, &ret);
   if (err) {
-    rb_raise(rb_eRuntimeError, "check failed.");
+    rb_raise(rb_eRuntimeError, "get jpeg quality failed.");
   }
 
-  return (busy)? Qtrue: Qfalse;
+  return INT2NUM(ret);
 }
 
 static VALUE
-rb_camera_is_ready(VALUE self)
+rb_camera_set_jpeg_quality(VALUE self, VALUE val)
 {
   camera_t* ptr;
   int err;
-  int ready;
 
   /*
    * strip object
@@ -975,22 +1224,23 @@ rb_camera_is_ready(VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * do check
+   * set parameter
    */
-  err = camera_check_ready(ptr, &ready);
+  err = camera_set_jpeg_quality(ptr, NUM2INT(val));
   if (err) {
-    rb_raise(rb_eRuntimeError, "check failed.");
+    rb_raise(rb_eArgError, "jpeg quality must be 1..100.");
   }
 
-  return (ready)? Qtrue: Qfalse;
+  return Qnil;
 }
 
 static VALUE
-rb_camera_is_error(VALUE self)
+rb_camera_get_jpeg_check(VALUE self)
 {
+  int ret;
   camera_t* ptr;
   int err;
-  int error;
+  const char* name;
 
   /*
    * strip object
@@ -998,26 +1248,3535 @@ rb_camera_is_error(VALUE self)
   TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
 
   /*
-   * do check
+   * get parameter
    */
-  err = camera_check_error(ptr, &error);
+  err = camera_get_jpeg_check(ptr, &ret);
   if (err) {
-    rb_raise(rb_eRuntimeError, "check failed.");
+    rb_raise(rb_eRuntimeError, "get jpeg check mode failed.");
   }
 
-  return (error)? Qtrue: Qfalse;
+  switch (ret) {
+  case JPEG_CHECK_FLAG:
+    name = "flag";
+    break;
+
+  case JPEG_CHECK_DROP:
+    name = "drop";
+    break;
+
+  default:
+    name = "none";
+    break;
+  }
+
+  return ID2SYM(rb_intern(name));
 }
 
-void
-Init_v4l2()
+static VALUE
+rb_camera_set_jpeg_check(VALUE self, VALUE val)
 {
-#ifdef HAVE_RB_EXT_RACTOR_SAFE
-  rb_ext_ractor_safe(true);
-#endif /* defined(HAVE_RB_EXT_RACTOR_SAFE) */
+  camera_t* ptr;
+  int mode;
+  int err;
 
-  rb_require("monitor");
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * eval argument
+   */
+  if (!RTEST(val) || EQ_STR(val, "none")) {
+    mode = JPEG_CHECK_NONE;
+
+  } else if (EQ_STR(val, "flag")) {
+    mode = JPEG_CHECK_FLAG;
+
+  } else if (EQ_STR(val, "drop")) {
+    mode = JPEG_CHECK_DROP;
+
+  } else {
+    rb_raise(rb_eArgError, "jpeg check mode must be :none, :flag or :drop.");
+  }
+
+  /*
+   * set parameter
+   */
+  err = camera_set_jpeg_check(ptr, mode);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "set jpeg check mode failed.");
+  }
+
+  return Qnil;
+}
+
+static VALUE
+rb_camera_get_memory(VALUE self)
+{
+  int ret;
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_memory(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get memory type failed.");
+  }
+
+  return ID2SYM(rb_intern((ret == V4L2_MEMORY_USERPTR)? "userptr": "mmap"));
+}
+
+static VALUE
+rb_camera_set_memory(VALUE self, VALUE val)
+{
+  camera_t* ptr;
+  int memory;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * eval argument
+   */
+  if (EQ_STR(val, "mmap")) {
+    memory = V4L2_MEMORY_MMAP;
+
+  } else if (EQ_STR(val, "userptr")) {
+    memory = V4L2_MEMORY_USERPTR;
+
+  } else {
+    rb_raise(rb_eArgError, "memory type must be :mmap or :userptr.");
+  }
+
+  /*
+   * set parameter
+   */
+  err = camera_set_memory(ptr, memory);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "set memory type failed.");
+  }
+
+  return Qnil;
+}
+
+static VALUE
+rb_camera_get_hugepage(VALUE self)
+{
+  int ret;
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_hugepage(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get hugepage mode failed.");
+  }
+
+  return (ret)? Qtrue: Qfalse;
+}
+
+static VALUE
+rb_camera_set_hugepage(VALUE self, VALUE val)
+{
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * set parameter
+   */
+  err = camera_set_hugepage(ptr, RTEST(val));
+  if (err) {
+    rb_raise(rb_eRuntimeError, "set hugepage mode failed.");
+  }
+
+  return Qnil;
+}
+
+static VALUE
+rb_camera_state( VALUE self)
+{
+  camera_t* ptr;
+  const char* str;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * convert state code
+   */
+  switch (ptr->state) {
+  case -1:
+    str = "ERROR";
+    break;
+
+  case 0:
+    str = "FINALIZED";
+    break;
+
+  case 1:
+    str = "INITIALIZED";
+    break;
+
+  case 2:
+    str = "PREAPARE";
+    break;
+
+  case 3:
+    str = "READY";
+    break;
+
+  case 4:
+    str = "ST_REQUESTED";
+    break;
+
+  default:
+    str = "unknown";
+    break;
+  }
+
+  return ID2SYM(rb_intern(str));
+}
+
+static VALUE
+rb_camera_start(VALUE self)
+{
+  int err;
+  camera_t* ptr;
+  int state;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * do start
+   */
+  err = camera_start(ptr);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "start capture failed.");
+  }
+
+  /*
+   *
+   */
+  if (rb_block_given_p()) {
+    rb_protect(rb_yield, self, &state);
+    revoke_lent_buffers(self);
+    camera_stop(ptr);
+    if (state) rb_jump_tag(state);
+  }
+
+  return self;
+}
+
+static VALUE
+rb_camera_stop(VALUE self)
+{
+  int err;
+  camera_t* ptr;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * convert
+   */
+  revoke_lent_buffers(self);
+
+  err = camera_stop(ptr);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "stop capture failed.");
+  }
+
+  return self;
+}
+
+
+typedef struct {
+  camera_t* cam;
+  void* ptr;
+  size_t used;
+  int timeout;
+  int ready;
+  int err;
+} capture_arg_t;
+
+static VALUE
+capture_body(VALUE _arg)
+{
+  capture_arg_t* arg;
+
+  arg      = (capture_arg_t*)_arg;
+  arg->err = camera_try_get_image(arg->cam, arg->ptr, &arg->used,
+                                  arg->timeout, &arg->ready);
+
+  return Qnil;
+}
+
+static int
+capture_to_string(camera_t* ptr, VALUE str, int timeout)
+{
+  capture_arg_t arg;
+
+  /*
+   * ensure capacity
+   */
+  if (rb_str_capacity(str) < ptr->image_size) {
+    rb_str_modify_expand(str, ptr->image_size - RSTRING_LEN(str));
+  } else {
+    rb_str_modify(str);
+  }
+
+  rb_enc_associate(str, rb_ascii8bit_encoding());
+
+  /*
+   * do capture
+   * (GVLを開放してコピーするので、その間は文字列を変更させない)
+   */
+  arg.cam     = ptr;
+  arg.ptr     = RSTRING_PTR(str);
+  arg.used    = 0;
+  arg.timeout = timeout;
+
+  rb_str_locktmp(str);
+  rb_ensure(capture_body, (VALUE)&arg, rb_str_unlocktmp, str);
+
+  if (arg.err) {
+    rb_raise(rb_eRuntimeError, "capture failed.");
+  }
+
+  if (arg.ready) rb_str_set_len(str, arg.used);
+
+  return arg.ready;
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+static int
+capture_to_io_buffer(camera_t* ptr, VALUE buf, int timeout, size_t* used)
+{
+  capture_arg_t arg;
+  void* base;
+  size_t size;
+
+  /*
+   * ensure capacity
+   */
+  rb_io_buffer_get_bytes_for_writing(buf, &base, &size);
+
+  if (size < ptr->image_size) {
+    rb_io_buffer_resize(buf, ptr->image_size);
+    rb_io_buffer_get_bytes_for_writing(buf, &base, &size);
+  }
+
+  /*
+   * do capture
+   */
+  arg.cam     = ptr;
+  arg.ptr     = base;
+  arg.used    = 0;
+  arg.timeout = timeout;
+
+  rb_io_buffer_lock(buf);
+  rb_ensure(capture_body, (VALUE)&arg, rb_io_buffer_unlock, buf);
+
+  if (arg.err) {
+    rb_raise(rb_eRuntimeError, "capture failed.");
+  }
+
+  *used = arg.used;
+
+  return arg.ready;
+}
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+/*
+ * フレームを取得してintoに書き込む(intoがnilの場合は新しい文字列を返す)。
+ * タイムアウトした場合はnilを返す。
+ */
+static VALUE
+capture(camera_t* ptr, VALUE into, int timeout)
+{
+  VALUE ret;
+  int ready;
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  size_t used;
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  if (into == Qundef || into == Qnil) {
+    ret   = rb_str_buf_new(ptr->image_size);
+    ready = capture_to_string(ptr, ret, timeout);
+
+  } else if (RB_TYPE_P(into, T_STRING)) {
+    ret   = into;
+    ready = capture_to_string(ptr, into, timeout);
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  } else if (rb_obj_is_kind_of(into, rb_cIOBuffer)) {
+    // IO::Buffer#readと同様に書き込んだバイト数を返す
+    ready = capture_to_io_buffer(ptr, into, timeout, &used);
+    ret   = SIZET2NUM(used);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  } else {
+    rb_raise(rb_eTypeError, "into: must be String or IO::Buffer.");
+  }
+
+  return (ready)? ret: Qnil;
+}
+
+static int
+to_timeout_msec(VALUE timeout)
+{
+  double sec;
+
+  if (timeout == Qundef || timeout == Qnil) return -1;
+
+  sec = NUM2DBL(timeout);
+  if (sec < 0.0) {
+    rb_raise(rb_eArgError, "timeout must not be negative.");
+  }
+
+  if (sec > (INT_MAX / 1000)) return -1;
+
+  return (int)(sec * 1000.0 + 0.5);
+}
+
+/*
+ * デバイスのfdをIOオブジェクトとして返す(IO.selectやイベントループでの監視
+ * 用)。デバイスはstop/start時にオープンし直されるので、その場合は新しいIO
+ * オブジェクトを作り直す。
+ */
+static VALUE
+rb_camera_to_io(VALUE self)
+{
+  VALUE ret;
+  camera_t* ptr;
+  VALUE serial;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * check statement
+   */
+  if (ptr->fd < 0) {
+    rb_raise(rb_eRuntimeError, "camera is not opened.");
+  }
+
+  /*
+   * lookup cache
+   */
+  ret    = rb_attr_get(self, id_io);
+  serial = rb_attr_get(self, id_io_serial);
+
+  if (ret == Qnil || serial != UINT2NUM(ptr->fd_serial)) {
+    // fdはカメラ側で閉じるので、IOオブジェクトのGC時には閉じさせない
+    ret = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2FIX(ptr->fd));
+    rb_funcall(ret, rb_intern("autoclose="), 1, Qfalse);
+
+    rb_ivar_set(self, id_io, ret);
+    rb_ivar_set(self, id_io_serial, UINT2NUM(ptr->fd_serial));
+  }
+
+  return ret;
+}
+
+/*
+ * Fiberスケジューラが有効な場合は、フレームの到着待ちをスケジューラの
+ * io_waitフックで行う(待っている間、他のFiberを実行させるため)。
+ */
+static VALUE
+capture_cooperatively(VALUE self, camera_t* ptr, VALUE into, int timeout)
+{
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+  VALUE ret;
+  VALUE scheduler;
+  int64_t deadline;
+  int64_t rem;
+
+  scheduler = rb_fiber_scheduler_current();
+
+  // バックグラウンドキャプチャ時はデバイスを直接待てない
+  if (scheduler == Qnil || ptr->background) {
+    return capture(ptr, into, timeout);
+  }
+
+  // 待ち直しの度に文字列を生成しないよう、先に確保しておく
+  if (into == Qundef || into == Qnil) {
+    into = rb_str_buf_new(ptr->image_size);
+  }
+
+  deadline = (timeout >= 0)? camera_monotonic_msec() + timeout: -1;
+
+  while (1) {
+    ret = capture(ptr, into, 0);
+    if (ret != Qnil) break;
+
+    if (deadline >= 0) {
+      rem = deadline - camera_monotonic_msec();
+      if (rem <= 0) break;
+    }
+
+    rb_fiber_scheduler_io_wait(scheduler,
+                               rb_camera_to_io(self),
+                               RB_INT2NUM(RUBY_IO_READABLE),
+                               (deadline >= 0)? DBL2NUM(rem / 1000.0): Qnil);
+  }
+
+  return ret;
+
+#else /* defined(HAVE_RUBY_FIBER_SCHEDULER_H) */
+  return capture(ptr, into, timeout);
+#endif /* defined(HAVE_RUBY_FIBER_SCHEDULER_H) */
+}
+
+/*
+ * Ractor間で共有できるフレームにする (凍結した文字列は参照のまま渡せる)
+ * 圧縮フォーマットでは確保した領域の大半が余るので、ここで切り詰める。
+ */
+static int
+is_shareable_requested(VALUE opt, VALUE into)
+{
+  if (opt == Qundef || !RTEST(opt)) return 0;
+
+  if (into != Qundef && into != Qnil) {
+    rb_raise(rb_eArgError, "shareable frame can not be captured into buffer.");
+  }
+
+  return !0;
+}
+
+static VALUE
+make_shareable(VALUE frame)
+{
+  if (frame != Qnil) {
+    rb_str_resize(frame, RSTRING_LEN(frame));
+    rb_obj_freeze(frame);
+  }
+
+  return frame;
+}
+
+static VALUE
+rb_camera_capture(int argc, VALUE* argv, VALUE self)
+{
+  camera_t* ptr;
+  VALUE opts;
+  ID kw[3];
+  VALUE into;
+  VALUE val[3];
+  VALUE ret;
+  int shareable;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  // キーワード引数はハッシュの生成を伴うので、位置引数でも受け付ける
+  rb_scan_args(argc, argv, "01:", &into, &opts);
+
+  val[0] = Qundef;
+  val[1] = Qundef;
+  val[2] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_into;
+    kw[1] = id_timeout;
+    kw[2] = id_shareable;
+    rb_get_kwargs(opts, kw, 0, 3, val);
+
+    if (val[0] != Qundef) {
+      if (into != Qnil) {
+        rb_raise(rb_eArgError, "target buffer specified twice.");
+      }
+
+      into = val[0];
+    }
+  }
+
+  shareable = is_shareable_requested(val[2], into);
+
+  /*
+   * do capture
+   */
+  ret = capture_cooperatively(self, ptr, into, to_timeout_msec(val[1]));
+
+  return (shareable)? make_shareable(ret): ret;
+}
+
+static VALUE
+rb_camera_try_capture(int argc, VALUE* argv, VALUE self)
+{
+  camera_t* ptr;
+  VALUE opts;
+  ID kw[2];
+  VALUE into;
+  VALUE val[2];
+  VALUE ret;
+  int shareable;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "01:", &into, &opts);
+
+  val[0] = Qundef;
+  val[1] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_into;
+    kw[1] = id_shareable;
+    rb_get_kwargs(opts, kw, 0, 2, val);
+
+    if (val[0] != Qundef) {
+      if (into != Qnil) {
+        rb_raise(rb_eArgError, "target buffer specified twice.");
+      }
+
+      into = val[0];
+    }
+  }
+
+  shareable = is_shareable_requested(val[1], into);
+
+  /*
+   * do capture (フレームが届いていない場合は待たずにnilを返す)
+   */
+  ret = capture(ptr, into, 0);
+
+  return (shareable)? make_shareable(ret): ret;
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+/*
+ * strictが偽の場合、既に返却済み(あるいはstop等で回収済み)のバッファは
+ * 何もせずに無視する
+ */
+static VALUE
+return_lent_buffer(VALUE self, VALUE buf, int strict)
+{
+  camera_t* ptr;
+  VALUE lent;
+  VALUE idx;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * check argument
+   */
+  lent = rb_attr_get(self, id_lent);
+  idx  = (lent != Qnil)? rb_hash_delete(lent, buf): Qnil;
+
+  if (idx == Qnil) {
+    if (!strict) return Qnil;
+    rb_raise(rb_eArgError, "not a buffer lent by this camera.");
+  }
+
+  /*
+   * invalidate buffer object and give back to the driver
+   */
+  invalidate_lent_object(buf);
+  camera_return_image(ptr, FIX2INT(idx));
+
+  return Qnil;
+}
+
+static VALUE
+rb_camera_release(VALUE self, VALUE buf)
+{
+  return return_lent_buffer(self, buf, !0);
+}
+
+static VALUE
+release_on_exit(VALUE _args)
+{
+  VALUE* args = (VALUE*)_args;
+
+  /*
+   * ブロック内で返却済みの場合にここで例外を上げると、ブロック内で発生
+   * した例外を上書きしてしまうので照合はしない
+   */
+  return return_lent_buffer(args[0], args[1], 0);
+}
+
+/*
+ * 貸し出したオブジェクトを記録する(ブロックが指定された場合はブロックを
+ * 抜ける時に返却する)
+ */
+static VALUE
+lend(VALUE self, VALUE obj, int idx)
+{
+  VALUE lent;
+  VALUE args[2];
+
+  lent = rb_attr_get(self, id_lent);
+  if (lent == Qnil) {
+    lent = rb_hash_new();
+    rb_funcall(lent, rb_intern("compare_by_identity"), 0);
+    rb_ivar_set(self, id_lent, lent);
+  }
+
+  rb_hash_aset(lent, obj, INT2FIX(idx));
+
+  /*
+   * when block given, give back the buffer on exit from the block
+   */
+  if (rb_block_given_p()) {
+    args[0] = self;
+    args[1] = obj;
+
+    obj = rb_ensure(rb_yield, obj, release_on_exit, (VALUE)args);
+  }
+
+  return obj;
+}
+
+static VALUE
+wrap_lent_area(VALUE self, void* data, size_t size)
+{
+  VALUE ret;
+
+  ret = rb_io_buffer_new(data,
+                         size,
+                         RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+
+  // バッファが生きている間はカメラオブジェクトを回収させない
+  rb_ivar_set(ret, id_owner, self);
+
+  return ret;
+}
+
+static VALUE
+rb_camera_borrow(VALUE self)
+{
+  camera_t* ptr;
+  int idx;
+  void* data;
+  size_t used;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * do capture (without copy)
+   */
+  err = camera_borrow_image(ptr, &idx, &data, &used);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "borrow image failed.");
+  }
+
+  /*
+   * wrap mapped area
+   */
+  return lend(self, wrap_lent_area(self, data, used), idx);
+}
+
+static VALUE
+rb_camera_borrow_planes(VALUE self)
+{
+  VALUE ret;
+  camera_t* ptr;
+  int idx;
+  void* data;
+  size_t used;
+  plane_view_t views[MAX_PLANE];
+  int n;
+  int err;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * do capture (without copy)
+   */
+  err = camera_borrow_image(ptr, &idx, &data, &used);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "borrow image failed.");
+  }
+
+  err = camera_get_plane_views(ptr, idx, views, &n);
+  if (err) {
+    camera_return_image(ptr, idx);
+    rb_raise(rb_eRuntimeError, "get plane views failed.");
+  }
+
+  /*
+   * wrap each plane (色プレーン毎のIO::Bufferの配列を返す)
+   */
+  ret = rb_ary_new_capa(n);
+
+  for (i = 0; i < n; i++) {
+    rb_ary_push(ret, wrap_lent_area(self, views[i].ptr, views[i].size));
+  }
+
+  return lend(self, ret, idx);
+}
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+static VALUE
+to_wallclock(struct timeval* ts, uint32_t flags)
+{
+  VALUE ret;
+  struct timespec rt;
+  struct timespec mt;
+  int64_t ns;
+
+  /*
+   * モノトニック時刻の場合のみ、現在時刻との差分から壁時計時刻を求める
+   */
+  if ((flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+      V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+
+    ns  = (int64_t)rt.tv_sec * 1000000000 + rt.tv_nsec;
+    ns -= (int64_t)mt.tv_sec * 1000000000 + mt.tv_nsec;
+    ns += (int64_t)ts->tv_sec * 1000000000 + (int64_t)ts->tv_usec * 1000;
+
+    ret = rb_time_nano_new(ns / 1000000000, ns % 1000000000);
+
+  } else {
+    ret = Qnil;
+  }
+
+  return ret;
+}
+
+static VALUE
+make_frame_info(frame_info_t* info)
+{
+  VALUE ret;
+  double ts;
+
+  ret = rb_obj_alloc(frame_info_klass);
+  ts  = info->timestamp.tv_sec + (info->timestamp.tv_usec / 1000000.0);
+
+  rb_ivar_set(ret, id_iv_sequence, UINT2NUM(info->sequence));
+  rb_ivar_set(ret, id_iv_timestamp, DBL2NUM(ts));
+  rb_ivar_set(ret, id_iv_time, to_wallclock(&info->timestamp, info->flags));
+  rb_ivar_set(ret, id_iv_flags, UINT2NUM(info->flags));
+  rb_ivar_set(ret, id_iv_field, UINT2NUM(info->field));
+  rb_ivar_set(ret, id_iv_skipped, UINT2NUM(info->skipped));
+  rb_ivar_set(ret, id_iv_error,
+              (info->flags & V4L2_BUF_FLAG_ERROR)? Qtrue: Qfalse);
+
+  return ret;
+}
+
+static VALUE
+rb_camera_get_frame_info(VALUE self)
+{
+  camera_t* ptr;
+  frame_info_t info;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get info of the last frame
+   */
+  err = camera_get_frame_info(ptr, &info);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get frame info failed.");
+  }
+
+  return make_frame_info(&info);
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+typedef struct {
+  int fd;
+  shared_frame_msg_t* msg;
+  int* fds;
+  int nfd;
+} send_frame_arg_t;
+
+static int
+io_to_fd(VALUE io)
+{
+  return NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+}
+
+/*
+ * ソケットへの送信 (fdは最初に送信できた部分に付加する)
+ */
+static void
+send_message(int fd, void* data, size_t size, int* fds, int nfd)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * MAX_PLANE)];
+  } ctl;
+  ssize_t n;
+
+  while (size > 0) {
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base   = data;
+    iov.iov_len    = size;
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfd > 0) {
+      memset(&ctl, 0, sizeof(ctl));
+
+      msg.msg_control    = ctl.buf;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
+
+      cmsg             = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type  = SCM_RIGHTS;
+      cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfd);
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfd);
+    }
+
+    n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        rb_thread_fd_writable(fd);
+        continue;
+      }
+
+      rb_sys_fail("sendmsg()");
+    }
+
+    data  = (uint8_t*)data + n;
+    size -= n;
+    nfd   = 0;
+  }
+}
+
+/*
+ * ソケットからの受信 (受信したfdはfdsに格納し、個数を*nfdに設定する)
+ * 何も読まないうちにEOFになった場合は0を返す。nowaitを指定した場合は、
+ * 受信できるデータが無ければ待たずに-1を返す。
+ */
+static int
+recv_message(int fd, void* data, size_t size, int* fds, int* nfd, int nowait)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * MAX_PLANE)];
+  } ctl;
+  ssize_t n;
+  size_t done;
+  int num;
+  int tmp;
+  int i;
+
+  done = 0;
+  *nfd = 0;
+
+  while (done < size) {
+    memset(&msg, 0, sizeof(msg));
+
+    iov.iov_base       = (uint8_t*)data + done;
+    iov.iov_len        = size - done;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    n = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+
+      // 未読のデータを残して切断された場合もEOFとして扱う
+      if (errno == ECONNRESET && done == 0) return 0;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (done == 0 && nowait) return -1;
+
+        rb_thread_wait_fd(fd);
+        continue;
+      }
+
+      rb_sys_fail("recvmsg()");
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg);
+         cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET) continue;
+      if (cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+      num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+      for (i = 0; i < num; i++) {
+        memcpy(&tmp, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+
+        // 受け取りきれないfdは閉じておく
+        if (*nfd < MAX_PLANE) {
+          fds[(*nfd)++] = tmp;
+        } else {
+          close(tmp);
+        }
+      }
+    }
+
+    if (n == 0) {
+      if (done == 0) return 0;
+
+      for (i = 0; i < *nfd; i++) close(fds[i]);
+      rb_raise(rb_eEOFError, "connection closed in the middle of a message.");
+    }
+
+    done += n;
+  }
+
+  return !0;
+}
+
+static VALUE
+rb_camera_get_dmabuf_export(VALUE self)
+{
+  int ret;
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * get parameter
+   */
+  err = camera_get_dmabuf_export(ptr, &ret);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "get dmabuf export mode failed.");
+  }
+
+  return (ret)? Qtrue: Qfalse;
+}
+
+static VALUE
+rb_camera_set_dmabuf_export(VALUE self, VALUE val)
+{
+  camera_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * set parameter
+   */
+  err = camera_set_dmabuf_export(ptr, RTEST(val));
+  if (err) {
+    rb_raise(rb_eRuntimeError, "set dmabuf export mode failed.");
+  }
+
+  return Qnil;
+}
+
+static VALUE
+send_frame_body(VALUE _arg)
+{
+  send_frame_arg_t* arg = (send_frame_arg_t*)_arg;
+
+  send_message(arg->fd, arg->msg, sizeof(*arg->msg), arg->fds, arg->nfd);
+
+  return Qnil;
+}
+
+static VALUE
+rb_camera_send_frame(VALUE self, VALUE sock)
+{
+  camera_t* ptr;
+  int idx;
+  void* data;
+  size_t used;
+  dmabuf_desc_t descs[MAX_PLANE];
+  int fds[MAX_PLANE];
+  int n;
+  shared_frame_msg_t msg;
+  send_frame_arg_t arg;
+  VALUE sent;
+  VALUE token;
+  int state;
+  int err;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * check statement
+   */
+  if (!ptr->export_dmabuf) {
+    rb_raise(rb_eRuntimeError, "dmabuf export is not enabled.");
+  }
+
+  arg.fd = io_to_fd(sock);
+
+  /*
+   * do capture (without copy)
+   */
+  err = camera_borrow_image(ptr, &idx, &data, &used);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "borrow image failed.");
+  }
+
+  err = camera_get_dmabuf(ptr, idx, descs, &n);
+  if (err) {
+    camera_return_image(ptr, idx);
+    rb_raise(rb_eRuntimeError, "get dmabuf failed.");
+  }
+
+  /*
+   * build message
+   */
+  token = rb_attr_get(self, id_token);
+  token = ULL2NUM((token == Qnil)? 1: NUM2ULL(token) + 1);
+
+  memset(&msg, 0, sizeof(msg));
+
+  msg.magic          = SHARED_FRAME_MAGIC;
+  msg.format         = ptr->format;
+  msg.token          = NUM2ULL(token);
+  msg.width          = ptr->width;
+  msg.height         = ptr->height;
+  msg.bytes_per_line = ptr->bytes_per_line;
+  msg.nplane         = n;
+
+  camera_get_frame_info(ptr, &msg.info);
+
+  for (i = 0; i < n; i++) {
+    fds[i]              = descs[i].fd;
+    msg.plane[i].size   = descs[i].size;
+    msg.plane[i].offset = descs[i].offset;
+    msg.plane[i].used   = descs[i].used;
+  }
+
+  /*
+   * send to the consumer
+   * (送信に失敗した場合はバッファをドライバに戻してから例外を再送出する)
+   */
+  arg.msg = &msg;
+  arg.fds = fds;
+  arg.nfd = n;
+
+  rb_protect(send_frame_body, (VALUE)&arg, &state);
+  if (state) {
+    camera_return_image(ptr, idx);
+    rb_jump_tag(state);
+  }
+
+  /*
+   * record sent buffer (返却通知を受けるまでドライバには戻さない)
+   */
+  sent = rb_attr_get(self, id_sent);
+  if (sent == Qnil) {
+    sent = rb_hash_new();
+    rb_ivar_set(self, id_sent, sent);
+  }
+
+  rb_hash_aset(sent, token, rb_assoc_new(INT2FIX(idx), sock));
+  rb_ivar_set(self, id_token, token);
+
+  return token;
+}
+
+static int
+collect_sent_to(VALUE token, VALUE ent, VALUE _arg)
+{
+  VALUE* arg = (VALUE*)_arg;
+
+  if (RARRAY_AREF(ent, 1) == arg[0]) rb_ary_push(arg[1], token);
+
+  return ST_CONTINUE;
+}
+
+static VALUE
+rb_camera_receive_releases(VALUE self, VALUE sock)
+{
+  camera_t* ptr;
+  shared_release_msg_t msg;
+  VALUE sent;
+  VALUE ent;
+  VALUE arg[2];
+  int fds[MAX_PLANE];
+  int nfd;
+  int fd;
+  int num;
+  int ret;
+  long i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  sent = rb_attr_get(self, id_sent);
+  fd   = io_to_fd(sock);
+  num  = 0;
+
+  /*
+   * 届いている返却通知を全て処理する (待ちはしない)
+   */
+  while (1) {
+    ret = recv_message(fd, &msg, sizeof(msg), fds, &nfd, !0);
+    while (nfd > 0) close(fds[--nfd]);
+
+    if (ret < 0) break;
+
+    if (ret == 0) {
+      /*
+       * 相手が切断した場合は、そのソケットに送ったバッファを全て回収する
+       */
+      if (sent != Qnil) {
+        arg[0] = sock;
+        arg[1] = rb_ary_new();
+
+        rb_hash_foreach(sent, collect_sent_to, (VALUE)arg);
+
+        for (i = 0; i < RARRAY_LEN(arg[1]); i++) {
+          ent = rb_hash_delete(sent, RARRAY_AREF(arg[1], i));
+          camera_return_image(ptr, FIX2INT(RARRAY_AREF(ent, 0)));
+          num++;
+        }
+      }
+      break;
+    }
+
+    if (msg.magic != SHARED_RELEASE_MAGIC) {
+      rb_raise(rb_eRuntimeError, "invalid release message.");
+    }
+
+    ent = (sent != Qnil)? rb_hash_delete(sent, ULL2NUM(msg.token)): Qnil;
+    if (ent == Qnil) continue;
+
+    camera_return_image(ptr, FIX2INT(RARRAY_AREF(ent, 0)));
+    num++;
+  }
+
+  return INT2FIX(num);
+}
+
+/*
+ * 受信側のヘルパ
+ */
+static VALUE
+rb_shared_frame_s_receive(VALUE self, VALUE sock)
+{
+  VALUE ret;
+  VALUE planes;
+  VALUE offsets;
+  VALUE io;
+  shared_frame_msg_t msg;
+  int fds[MAX_PLANE];
+  int nfd;
+  int err;
+  int i;
+
+  /*
+   * receive message
+   */
+  err = recv_message(io_to_fd(sock), &msg, sizeof(msg), fds, &nfd, 0);
+  if (err == 0) return Qnil;
+
+  if (msg.magic != SHARED_FRAME_MAGIC ||
+      msg.nplane < 1 || msg.nplane > MAX_PLANE || (int)msg.nplane != nfd) {
+    for (i = 0; i < nfd; i++) close(fds[i]);
+    rb_raise(rb_eRuntimeError, "invalid frame message.");
+  }
+
+  /*
+   * map each dmabuf
+   * (マップした後のfdは不要なので、IOオブジェクトごと閉じる)
+   */
+  planes  = rb_ary_new_capa(nfd);
+  offsets = rb_ary_new_capa(nfd);
+
+  for (i = 0; i < nfd; i++) {
+    io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2FIX(fds[i]));
+    fds[i] = -1;
+
+    rb_ary_push(planes,
+                rb_io_buffer_map(io,
+                                 msg.plane[i].offset + msg.plane[i].used,
+                                 0,
+                                 RB_IO_BUFFER_READONLY));
+    rb_ary_push(offsets, ULL2NUM(msg.plane[i].offset));
+
+    rb_io_close(io);
+  }
+
+  /*
+   * build result
+   */
+  ret = rb_obj_alloc(shared_frame_klass);
+
+  rb_ivar_set(ret, id_iv_token, ULL2NUM(msg.token));
+  rb_ivar_set(ret, id_iv_format, to_fourcc(msg.format));
+  rb_ivar_set(ret, id_iv_width, INT2NUM(msg.width));
+  rb_ivar_set(ret, id_iv_height, INT2NUM(msg.height));
+  rb_ivar_set(ret, id_iv_bytes_per_line, INT2NUM(msg.bytes_per_line));
+  rb_ivar_set(ret, id_iv_info, make_frame_info(&msg.info));
+  rb_ivar_set(ret, id_iv_planes, planes);
+  rb_ivar_set(ret, id_iv_offsets, offsets);
+
+  return ret;
+}
+
+static VALUE
+rb_shared_frame_release(VALUE self, VALUE sock)
+{
+  VALUE planes;
+  shared_release_msg_t msg;
+
+  planes = rb_attr_get(self, id_iv_planes);
+  if (planes == Qnil) {
+    rb_raise(rb_eArgError, "already released.");
+  }
+
+  /*
+   * unmap and notify to the producer
+   */
+  invalidate_lent_object(planes);
+  rb_ivar_set(self, id_iv_planes, Qnil);
+
+  memset(&msg, 0, sizeof(msg));
+
+  msg.magic = SHARED_RELEASE_MAGIC;
+  msg.token = NUM2ULL(rb_attr_get(self, id_iv_token));
+
+  send_message(io_to_fd(sock), &msg, sizeof(msg), NULL, 0);
+
+  return Qnil;
+}
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+static VALUE
+rb_camera_is_busy(VALUE self)
+{
+  camera_t* ptr;
+  int err;
+  int busy;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * do check
+   */
+  err = camera_check_busy(ptr, &busy);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "check failed.");
+  }
+
+  return (busy)? Qtrue: Qfalse;
+}
+
+static VALUE
+rb_camera_is_ready(VALUE self)
+{
+  camera_t* ptr;
+  int err;
+  int ready;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * do check
+   */
+  err = camera_check_ready(ptr, &ready);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "check failed.");
+  }
+
+  return (ready)? Qtrue: Qfalse;
+}
+
+static VALUE
+rb_camera_is_error(VALUE self)
+{
+  camera_t* ptr;
+  int err;
+  int error;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * do check
+   */
+  err = camera_check_error(ptr, &error);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "check failed.");
+  }
+
+  return (error)? Qtrue: Qfalse;
+}
+
+/*
+ * Frame (取得したフレームとそのメタデータ)
+ *
+ * 画像データはネイティブのバッファに保持し、文字列やIO::Bufferは参照され
+ * た時点で初めて生成する。メタデータだけを見て捨てるフレームについては
+ * Rubyのオブジェクトを生成しない。
+ *
+ * カメラにフレームプールを設定した場合は、プール内のフレームを使い回す。
+ * この場合の画像データはプールのフレーム毎に確保した文字列に保持し、
+ * releaseでプールに戻すまで有効となる(to_sはその文字列をそのまま返すので、
+ * release後も使う場合は複製しておくこと)。
+ */
+
+typedef struct {
+  uint8_t* data;
+  size_t used;
+  size_t capa;
+
+  uint32_t format;
+  int width;
+  int height;
+  int bytes_per_line;
+  frame_info_t info;
+
+  VALUE str;              /* to_sの結果 (プールのフレームでは画像データ) */
+  VALUE pool;             /* 返却先のプール (プールのフレームでない場合はnil) */
+  VALUE views;            /* 生成したIO::Bufferの一覧 (release時に無効化) */
+  VALUE camera;           /* 取得元のカメラ (デコーダを借りる) */
+  int released;
+} frame_t;
+
+static void
+rb_frame_mark(void* _ptr)
+{
+  frame_t* ptr;
+
+  ptr = (frame_t*)_ptr;
+
+  rb_gc_mark(ptr->str);
+  rb_gc_mark(ptr->pool);
+  rb_gc_mark(ptr->views);
+  rb_gc_mark(ptr->camera);
+}
+
+static void
+rb_frame_free(void* _ptr)
+{
+  frame_t* ptr;
+
+  ptr = (frame_t*)_ptr;
+
+  // プールのフレームの画像データは文字列側で回収される
+  if (ptr->pool == Qnil) xfree(ptr->data);
+  xfree(ptr);
+}
+
+static size_t
+rb_frame_size(const void* _ptr)
+{
+  const frame_t* ptr;
+
+  ptr = (const frame_t*)_ptr;
+
+  return sizeof(frame_t) + ((ptr->pool == Qnil)? ptr->capa: 0);
+}
+
+static const rb_data_type_t frame_data_type = {
+  .wrap_struct_name = "V4L2 frame for ruby",
+  .function = {
+    .dmark = rb_frame_mark,
+    .dfree = rb_frame_free,
+    .dsize = rb_frame_size,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+rb_frame_alloc(VALUE self)
+{
+  frame_t* ptr;
+  VALUE ret;
+
+  ret = TypedData_Make_Struct(frame_klass, frame_t, &frame_data_type, ptr);
+
+  ptr->str    = Qnil;
+  ptr->pool   = Qnil;
+  ptr->views  = Qnil;
+  ptr->camera = Qnil;
+
+  return ret;
+}
+
+static void
+record_frame_metadata(frame_t* frame, camera_t* cam)
+{
+  camera_get_frame_info(cam, &frame->info);
+
+  camera_get_output_format(cam, &frame->format, &frame->bytes_per_line);
+
+  frame->width  = cam->width;
+  frame->height = cam->height;
+}
+
+/*
+ * プールの末尾のフレームに取得する(取得できた場合のみプールから取り出す
+ * ので、タイムアウトや例外で抜けた場合もフレームはプールに残る)。
+ */
+static VALUE
+capture_pooled_frame(camera_t* ptr, VALUE pool, int timeout)
+{
+  VALUE ret;
+  frame_t* frame;
+  long n;
+
+  n = RARRAY_LEN(pool);
+  if (n == 0) {
+    rb_raise(rb_eRuntimeError, "frame pool exhausted.");
+  }
+
+  ret = RARRAY_AREF(pool, n - 1);
+  TypedData_Get_Struct(ret, frame_t, &frame_data_type, frame);
+
+  // to_sで渡した文字列(凍結済み)は書き換えずに、新しい文字列に差し替える
+  if (OBJ_FROZEN(frame->str)) {
+    RB_OBJ_WRITE(ret, &frame->str, rb_str_buf_new(ptr->image_size));
+  }
+
+  if (!capture_to_string(ptr, frame->str, timeout)) return Qnil;
+
+  rb_ary_pop(pool);
+
+  // プールに戻すまでは文字列を変更させない(画像データの領域を固定する)
+  rb_str_locktmp(frame->str);
+
+  frame->data     = (uint8_t*)RSTRING_PTR(frame->str);
+  frame->used     = RSTRING_LEN(frame->str);
+  frame->capa     = rb_str_capacity(frame->str);
+  frame->released = 0;
+
+  record_frame_metadata(frame, ptr);
+
+  return ret;
+}
+
+static VALUE
+capture_frame(VALUE self, camera_t* ptr, int timeout)
+{
+  VALUE ret;
+  frame_t* frame;
+  VALUE pool;
+  int ready;
+  int err;
+
+  /*
+   * use frame pool if configured
+   */
+  pool = rb_attr_get(self, id_pool);
+  if (pool != Qnil) return capture_pooled_frame(ptr, pool, timeout);
+
+  /*
+   * prepare frame object
+   */
+  ret = rb_frame_alloc(frame_klass);
+  TypedData_Get_Struct(ret, frame_t, &frame_data_type, frame);
+
+  frame->data = ALLOC_N(uint8_t, ptr->image_size);
+  frame->capa = ptr->image_size;
+  RB_OBJ_WRITE(ret, &frame->camera, self);
+
+  /*
+   * do capture
+   * (例外で抜けた場合もバッファはフレームオブジェクトと共に回収される)
+   */
+  err = camera_try_get_image(ptr, frame->data, &frame->used, timeout, &ready);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "capture failed.");
+  }
+
+  if (!ready) return Qnil;
+
+  /*
+   * record metadata
+   * (圧縮フォーマットでは確保した領域の大半が余るので切り詰めておく)
+   */
+  record_frame_metadata(frame, ptr);
+
+  if (frame->used > 0 && frame->used < frame->capa / 2) {
+    REALLOC_N(frame->data, uint8_t, frame->used);
+    frame->capa = frame->used;
+  }
+
+  return ret;
+}
+
+static int
+parse_frame_timeout(int argc, VALUE* argv)
+{
+  VALUE opts;
+  ID kw[1];
+  VALUE val[1];
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  val[0] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_timeout;
+    rb_get_kwargs(opts, kw, 0, 1, val);
+  }
+
+  return to_timeout_msec(val[0]);
+}
+
+static VALUE
+rb_camera_capture_frame(int argc, VALUE* argv, VALUE self)
+{
+  camera_t* ptr;
+  int timeout;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  timeout = parse_frame_timeout(argc, argv);
+
+  /*
+   * do capture
+   */
+  return capture_frame(self, ptr, timeout);
+}
+
+static frame_t*
+get_frame(VALUE self)
+{
+  frame_t* ptr;
+
+  TypedData_Get_Struct(self, frame_t, &frame_data_type, ptr);
+
+  if (ptr->released) {
+    rb_raise(rb_eRuntimeError, "frame already released.");
+  }
+
+  if (ptr->data == NULL) {
+    rb_raise(rb_eRuntimeError, "uninitialized frame.");
+  }
+
+  return ptr;
+}
+
+/*
+ * 画像データを手放す(プールのフレームはプールに戻す)。生成済みのIO::Buffer
+ * は解放後の領域を指すことになるので、ここで無効化しておく。
+ */
+static VALUE
+rb_frame_release(VALUE self)
+{
+  frame_t* ptr;
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  long i;
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  TypedData_Get_Struct(self, frame_t, &frame_data_type, ptr);
+
+  if (ptr->released || ptr->data == NULL) return Qnil;
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  if (ptr->views != Qnil) {
+    for (i = 0; i < RARRAY_LEN(ptr->views); i++) {
+      rb_io_buffer_free(RARRAY_AREF(ptr->views, i));
+    }
+
+    rb_ary_clear(ptr->views);
+  }
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  ptr->released = !0;
+
+  if (ptr->pool != Qnil) {
+    // to_sで凍結した文字列はロックを外してある
+    if (!OBJ_FROZEN(ptr->str)) rb_str_unlocktmp(ptr->str);
+    rb_ary_push(ptr->pool, self);
+
+  } else {
+    xfree(ptr->data);
+    ptr->data = NULL;
+    ptr->capa = 0;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+rb_frame_is_released(VALUE self)
+{
+  frame_t* ptr;
+
+  TypedData_Get_Struct(self, frame_t, &frame_data_type, ptr);
+
+  return (ptr->released)? Qtrue: Qfalse;
+}
+
+/*
+ * フレームプールの設定 (0またはnilでプールを使わない)
+ *
+ * プールのフレームは取得毎に生成せず、releaseで戻されたものを使い回すので
+ * 定常状態ではゴミを生成しない(to_sを呼んだフレームは、渡した文字列を残
+ * すために再利用時に文字列を確保し直す)。全てのフレームが貸し出されてい
+ * る状態でcapture_frameを呼ぶと例外になる。
+ */
+static VALUE
+rb_camera_get_frame_pool(VALUE self)
+{
+  VALUE ret;
+
+  ret = rb_attr_get(self, id_pool_size);
+
+  return (ret != Qnil)? ret: INT2FIX(0);
+}
+
+static VALUE
+rb_camera_set_frame_pool(VALUE self, VALUE val)
+{
+  camera_t* ptr;
+  VALUE pool;
+  VALUE obj;
+  frame_t* frame;
+  int n;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * check argument
+   */
+  n = (val != Qnil)? NUM2INT(val): 0;
+  if (n < 0) {
+    rb_raise(rb_eRangeError, "pool size must not be negative.");
+  }
+
+  /*
+   * build pool
+   * (貸し出し中のフレームは古いプールに戻り、そのまま回収される)
+   */
+  pool = Qnil;
+
+  if (n > 0) {
+    pool = rb_ary_new_capa(n);
+
+    for (i = 0; i < n; i++) {
+      obj   = rb_frame_alloc(frame_klass);
+      frame = DATA_PTR(obj);
+
+      frame->released = !0;
+      RB_OBJ_WRITE(obj, &frame->pool, pool);
+      RB_OBJ_WRITE(obj, &frame->camera, self);
+      RB_OBJ_WRITE(obj, &frame->str, rb_str_buf_new(ptr->image_size));
+
+      rb_ary_push(pool, obj);
+    }
+  }
+
+  rb_ivar_set(self, id_pool, pool);
+  rb_ivar_set(self, id_pool_size, INT2FIX(n));
+
+  return val;
+}
+
+/*
+ * フレームを取得してブロックに渡し、ブロックを抜ける度にreleaseする。
+ * タイムアウトした場合はループを終了する。
+ */
+static VALUE
+rb_camera_each_frame(int argc, VALUE* argv, VALUE self)
+{
+  camera_t* ptr;
+  VALUE frame;
+  int timeout;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, camera_t, &camera_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  timeout = parse_frame_timeout(argc, argv);
+
+  /*
+   * capture loop
+   */
+  while (1) {
+    frame = capture_frame(self, ptr, timeout);
+    if (frame == Qnil) break;
+
+    rb_ensure(rb_yield, frame, rb_frame_release, frame);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+rb_frame_format(VALUE self)
+{
+  return to_fourcc(get_frame(self)->format);
+}
+
+static VALUE
+rb_frame_width(VALUE self)
+{
+  return INT2NUM(get_frame(self)->width);
+}
+
+static VALUE
+rb_frame_height(VALUE self)
+{
+  return INT2NUM(get_frame(self)->height);
+}
+
+static VALUE
+rb_frame_bytes_per_line(VALUE self)
+{
+  return INT2NUM(get_frame(self)->bytes_per_line);
+}
+
+static VALUE
+rb_frame_bytesize(VALUE self)
+{
+  return SIZET2NUM(get_frame(self)->used);
+}
+
+static VALUE
+rb_frame_sequence(VALUE self)
+{
+  return UINT2NUM(get_frame(self)->info.sequence);
+}
+
+static VALUE
+rb_frame_timestamp(VALUE self)
+{
+  frame_t* ptr;
+
+  ptr = get_frame(self);
+
+  return DBL2NUM(ptr->info.timestamp.tv_sec +
+                 (ptr->info.timestamp.tv_usec / 1000000.0));
+}
+
+static VALUE
+rb_frame_time(VALUE self)
+{
+  frame_t* ptr;
+
+  ptr = get_frame(self);
+
+  return to_wallclock(&ptr->info.timestamp, ptr->info.flags);
+}
+
+static VALUE
+rb_frame_info(VALUE self)
+{
+  return make_frame_info(&get_frame(self)->info);
+}
+
+static VALUE
+rb_frame_to_s(VALUE self)
+{
+  frame_t* ptr;
+
+  ptr = get_frame(self);
+
+  /*
+   * 最初に参照された時に生成し、以降は同じ文字列を返す
+   * (フレームの内容を書き換えさせないよう凍結しておく)
+   *
+   * プールのフレームは画像データを持つ文字列をそのまま凍結して返す。凍結
+   * した文字列は以降のキャプチャで書き換えず、フレームを再利用する時に新
+   * しい文字列に差し替えるので、release後も内容は変わらない(その代わり
+   * 差し替える分だけ確保が発生する)。凍結すれば領域は動かないので、貸し
+   * 出し中のロックはここで外しておく。
+   */
+  if (ptr->pool != Qnil) {
+    if (!OBJ_FROZEN(ptr->str)) {
+      rb_str_unlocktmp(ptr->str);
+      rb_obj_freeze(ptr->str);
+    }
+
+    return ptr->str;
+  }
+
+  if (ptr->str == Qnil) {
+    RB_OBJ_WRITE(self, &ptr->str,
+                 rb_obj_freeze(rb_str_new((char*)ptr->data, ptr->used)));
+  }
+
+  return ptr->str;
+}
+
+/*
+ * RGB系の画素配置への変換
+ *
+ * intoに文字列かIO::Bufferを指定した場合はそこに書き込む(captureと同様に、
+ * IO::Bufferの場合は書き込んだバイト数を返す)。変換はGVLを保持したまま
+ * 行う(開放すると別スレッドからのreleaseと競合するため)。
+ */
+static int
+to_conv_matrix(VALUE val)
+{
+  int ret;
+
+  if (val == Qundef || val == Qnil || EQ_STR(val, "bt601")) {
+    ret = CONV_BT601;
+
+  } else if (EQ_STR(val, "bt709")) {
+    ret = CONV_BT709;
+
+  } else {
+    rb_raise(rb_eArgError, "matrix must be :bt601 or :bt709.");
+  }
+
+  return ret;
+}
+
+static int
+to_conv_range(VALUE val)
+{
+  int ret;
+
+  if (val == Qundef || val == Qnil || EQ_STR(val, "limited")) {
+    ret = 0;
+
+  } else if (EQ_STR(val, "full")) {
+    ret = !0;
+
+  } else {
+    rb_raise(rb_eArgError, "range must be :limited or :full.");
+  }
+
+  return ret;
+}
+
+/*
+ * 変換結果の書き込み先を用意する(intoがnilの場合は新しい文字列)。文字列
+ * の場合は書き込み後に長さを設定すること。
+ */
+static VALUE
+prepare_output(VALUE into, size_t size, void** dst)
+{
+  VALUE ret;
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  size_t capa;
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  if (into == Qnil) into = rb_str_buf_new(size);
+
+  if (RB_TYPE_P(into, T_STRING)) {
+    if (rb_str_capacity(into) < size) {
+      rb_str_modify_expand(into, size - RSTRING_LEN(into));
+    } else {
+      rb_str_modify(into);
+    }
+
+    rb_enc_associate(into, rb_ascii8bit_encoding());
+
+    ret  = into;
+    *dst = RSTRING_PTR(into);
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  } else if (rb_obj_is_kind_of(into, rb_cIOBuffer)) {
+    rb_io_buffer_get_bytes_for_writing(into, dst, &capa);
+
+    if (capa < size) {
+      rb_io_buffer_resize(into, size);
+      rb_io_buffer_get_bytes_for_writing(into, dst, &capa);
+    }
+
+    ret = SIZET2NUM(size);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  } else {
+    rb_raise(rb_eTypeError, "into: must be String or IO::Buffer.");
+  }
+
+  return ret;
+}
+
+static VALUE
+convert_frame(int argc, VALUE* argv, VALUE self, int layout)
+{
+  VALUE ret;
+  frame_t* ptr;
+  VALUE into;
+  VALUE opts;
+  ID kw[3];
+  VALUE val[3];
+  conv_param_t param;
+  int stride;
+  size_t size;
+  void* dst;
+  int err;
+
+  /*
+   * strip object
+   */
+  ptr = get_frame(self);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "01:", &into, &opts);
+
+  val[0] = Qundef;
+  val[1] = Qundef;
+  val[2] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_into;
+    kw[1] = id_matrix;
+    kw[2] = id_range;
+    rb_get_kwargs(opts, kw, 0, 3, val);
+
+    if (val[0] != Qundef) {
+      if (into != Qnil) {
+        rb_raise(rb_eArgError, "target buffer specified twice.");
+      }
+
+      into = val[0];
+    }
+  }
+
+  param.layout     = layout;
+  param.matrix     = to_conv_matrix(val[1]);
+  param.full_range = to_conv_range(val[2]);
+
+  if (!convert_is_supported(ptr->format)) {
+    rb_raise(rb_eRuntimeError, "unsupported format.");
+  }
+
+  stride = ptr->width * convert_bytes_per_pixel(layout);
+  size   = (size_t)stride * ptr->height;
+
+  /*
+   * prepare output buffer
+   */
+  ret = prepare_output(into, size, &dst);
+
+  /*
+   * do convert
+   */
+  err = convert_to_rgb(ptr->format, ptr->data, ptr->used,
+                       ptr->bytes_per_line, ptr->width, ptr->height,
+                       dst, stride, &param);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "convert failed.");
+  }
+
+  if (RB_TYPE_P(ret, T_STRING)) rb_str_set_len(ret, size);
+
+  return ret;
+}
+
+static VALUE
+rb_frame_to_rgb(int argc, VALUE* argv, VALUE self)
+{
+  return convert_frame(argc, argv, self, CONV_RGB24);
+}
+
+static VALUE
+rb_frame_to_bgr(int argc, VALUE* argv, VALUE self)
+{
+  return convert_frame(argc, argv, self, CONV_BGR24);
+}
+
+static VALUE
+rb_frame_to_rgba(int argc, VALUE* argv, VALUE self)
+{
+  return convert_frame(argc, argv, self, CONV_RGBA32);
+}
+
+/*
+ * YUV系のフォーマット間の並べ替え (YUYV→YU12でエンコーダに渡す場合など)
+ * 出力は行間を詰めたレイアウトになる。
+ */
+static VALUE
+rb_frame_to_yuv(int argc, VALUE* argv, VALUE self)
+{
+  VALUE ret;
+  frame_t* ptr;
+  VALUE fmt;
+  VALUE into;
+  VALUE opts;
+  ID kw[1];
+  VALUE val[1];
+  uint32_t format;
+  size_t size;
+  void* dst;
+  int err;
+
+  /*
+   * strip object
+   */
+  ptr = get_frame(self);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "11:", &fmt, &into, &opts);
+
+  val[0] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_into;
+    rb_get_kwargs(opts, kw, 0, 1, val);
+
+    if (val[0] != Qundef) {
+      if (into != Qnil) {
+        rb_raise(rb_eArgError, "target buffer specified twice.");
+      }
+
+      into = val[0];
+    }
+  }
+
+  format = to_pixfmt(fmt);
+  size   = convert_yuv_size(format, ptr->width, ptr->height);
+
+  if (size == 0) {
+    rb_raise(rb_eArgError, "unsupported output format.");
+  }
+
+  if (!convert_is_supported(ptr->format)) {
+    rb_raise(rb_eRuntimeError, "unsupported format.");
+  }
+
+  /*
+   * do convert
+   */
+  ret = prepare_output(into, size, &dst);
+
+  err = convert_yuv(ptr->format, ptr->data, ptr->used, ptr->bytes_per_line,
+                    ptr->width, ptr->height, format, dst);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "convert failed.");
+  }
+
+  if (RB_TYPE_P(ret, T_STRING)) rb_str_set_len(ret, size);
+
+  return ret;
+}
+
+static int
+to_decode_scale(VALUE val)
+{
+  double scale;
+  int ret;
+
+  if (val == Qundef || val == Qnil) return 1;
+
+  scale = NUM2DBL(val);
+  ret   = (scale > 0.0)? (int)((1.0 / scale) + 0.5): 0;
+
+  if ((ret != 1 && ret != 2 && ret != 4 && ret != 8) ||
+      (scale * ret) < 0.999 || (scale * ret) > 1.001) {
+    rb_raise(rb_eArgError, "scale must be 1, 1/2r, 1/4r or 1/8r.");
+  }
+
+  return ret;
+}
+
+static int
+to_decode_color(VALUE val)
+{
+  int ret;
+
+  if (val == Qundef || val == Qnil || EQ_STR(val, "rgb")) {
+    ret = CODEC_RGB;
+
+  } else if (EQ_STR(val, "gray")) {
+    ret = CODEC_GRAY;
+
+  } else {
+    rb_raise(rb_eArgError, "color must be :rgb or :gray.");
+  }
+
+  return ret;
+}
+
+/*
+ * MJPEGのフレームを縮小しながらデコードし、GREYかRGB3のフレームとして返
+ * す。デコーダは取得元のカメラのものを使い回す(カメラを閉じた後は一時的
+ * に作る)。変換と同様にGVLを保持したまま行う。
+ */
+static VALUE
+rb_frame_decode(int argc, VALUE* argv, VALUE self)
+{
+  VALUE ret;
+  frame_t* ptr;
+  frame_t* dst;
+  camera_t* cam;
+  codec_decoder_t* dec;
+  codec_decoder_t* tmp;
+  VALUE opts;
+  ID kw[2];
+  VALUE val[2];
+  int denom;
+  int color;
+  const void* out;
+  size_t used;
+  int width;
+  int height;
+  int err;
+
+  /*
+   * strip object
+   */
+  ptr = get_frame(self);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  val[0] = Qundef;
+  val[1] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_scale;
+    kw[1] = id_color;
+    rb_get_kwargs(opts, kw, 0, 2, val);
+  }
+
+  denom = to_decode_scale(val[0]);
+  color = to_decode_color(val[1]);
+
+  if (!codec_is_available()) {
+    rb_raise(rb_eNotImpError, "built without libjpeg.");
+  }
+
+  if (ptr->format != V4L2_PIX_FMT_MJPEG && ptr->format != V4L2_PIX_FMT_JPEG) {
+    rb_raise(rb_eRuntimeError, "unsupported format.");
+  }
+
+  /*
+   * select decoder
+   */
+  tmp = NULL;
+  cam = NULL;
+
+  if (ptr->camera != Qnil) {
+    TypedData_Get_Struct(ptr->camera, camera_t, &camera_data_type, cam);
+    if (cam->fd < 0) cam = NULL;
+  }
+
+  if (cam != NULL) {
+    if (cam->decoder == NULL) cam->decoder = codec_decoder_new();
+    dec = cam->decoder;
+  } else {
+    dec = tmp = codec_decoder_new();
+  }
+
+  if (dec == NULL) {
+    rb_raise(rb_eNoMemError, "create decoder failed.");
+  }
+
+  /*
+   * do decode
+   */
+  err = codec_decode_jpeg(dec, ptr->data, ptr->used, denom, color,
+                          &out, &used, &width, &height);
+  if (err) {
+    codec_decoder_destroy(tmp);
+    rb_raise(rb_eRuntimeError, "decode failed.");
+  }
+
+  /*
+   * build result frame
+   */
+  ret = rb_frame_alloc(frame_klass);
+  TypedData_Get_Struct(ret, frame_t, &frame_data_type, dst);
+
+  dst->data = ALLOC_N(uint8_t, used);
+  dst->used = used;
+  dst->capa = used;
+  memcpy(dst->data, out, used);
+
+  dst->format         = (color == CODEC_GRAY)?
+                          V4L2_PIX_FMT_GREY: V4L2_PIX_FMT_RGB24;
+  dst->width          = width;
+  dst->height         = height;
+  dst->bytes_per_line = (int)(used / height);
+  dst->info           = ptr->info;
+
+  codec_decoder_destroy(tmp);
+
+  return ret;
+}
+
+static VALUE
+rb_conversion_kernel(VALUE self)
+{
+  return rb_str_new_cstr(convert_kernel_name());
+}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+static VALUE
+wrap_frame_area(VALUE self, void* data, size_t size)
+{
+  VALUE ret;
+  frame_t* ptr;
+
+  ret = rb_io_buffer_new(data,
+                         size,
+                         RB_IO_BUFFER_EXTERNAL | RB_IO_BUFFER_READONLY);
+
+  // バッファが生きている間はフレームを回収させない
+  rb_ivar_set(ret, id_owner, self);
+
+  // releaseで無効化できるよう記録しておく
+  ptr = DATA_PTR(self);
+  if (ptr->views == Qnil) {
+    RB_OBJ_WRITE(self, &ptr->views, rb_ary_new());
+  }
+
+  rb_ary_push(ptr->views, ret);
+
+  return ret;
+}
+
+static VALUE
+rb_frame_to_io_buffer(VALUE self)
+{
+  frame_t* ptr;
+
+  ptr = get_frame(self);
+
+  return wrap_frame_area(self, ptr->data, ptr->used);
+}
+
+static VALUE
+rb_frame_planes(VALUE self)
+{
+  VALUE ret;
+  frame_t* ptr;
+  plane_view_t views[MAX_PLANE];
+  int n;
+  int err;
+  int i;
+
+  ptr = get_frame(self);
+
+  err = camera_split_image(ptr->format, ptr->bytes_per_line, ptr->height,
+                           ptr->data, ptr->used, views, &n);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "split image failed.");
+  }
+
+  ret = rb_ary_new_capa(n);
+
+  for (i = 0; i < n; i++) {
+    rb_ary_push(ret, wrap_frame_area(self, views[i].ptr, views[i].size));
+  }
+
+  return ret;
+}
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+/*
+ * Poller (複数のカメラを1つのスレッドでまとめて待ち受ける)
+ *
+ * 登録されたカメラのデバイスを1つのepollで監視し、フレームが届いたカメラ
+ * からまとめてフレームを取り出す。デバイスはカメラのstop/start等でオープ
+ * ンし直されるので、epollへの登録はwait時に同期する。
+ */
+
+#define WAKEUP_MARK                     UINT64_MAX
+
+typedef struct {
+  VALUE cam;
+  int fd;
+  uint32_t serial;
+  int registered;
+} poller_entry_t;
+
+typedef struct {
+  int epfd;
+  int wakeup[2];
+  int waiting;
+  int n;
+  int capa;
+  poller_entry_t* ent;
+  struct epoll_event* ev;
+} poller_t;
+
+static void
+rb_poller_mark(void* _ptr)
+{
+  poller_t* ptr;
+  int i;
+
+  ptr = (poller_t*)_ptr;
+
+  for (i = 0; i < ptr->n; i++) {
+    rb_gc_mark(ptr->ent[i].cam);
+  }
+}
+
+static void
+rb_poller_free(void* _ptr)
+{
+  poller_t* ptr;
+
+  ptr = (poller_t*)_ptr;
+
+  if (ptr->epfd >= 0) close(ptr->epfd);
+  if (ptr->wakeup[0] >= 0) close(ptr->wakeup[0]);
+  if (ptr->wakeup[1] >= 0) close(ptr->wakeup[1]);
+
+  xfree(ptr->ent);
+  xfree(ptr->ev);
+  xfree(ptr);
+}
+
+static size_t
+rb_poller_size(const void* _ptr)
+{
+  const poller_t* ptr;
+
+  ptr = (const poller_t*)_ptr;
+
+  return sizeof(poller_t) +
+         (ptr->capa * (sizeof(poller_entry_t) + sizeof(struct epoll_event)));
+}
+
+static const rb_data_type_t poller_data_type = {
+  .wrap_struct_name = "V4L2 poller for ruby",
+  .function = {
+    .dmark = rb_poller_mark,
+    .dfree = rb_poller_free,
+    .dsize = rb_poller_size,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+rb_poller_alloc(VALUE self)
+{
+  poller_t* ptr;
+  VALUE ret;
+
+  ret = TypedData_Make_Struct(poller_klass, poller_t, &poller_data_type, ptr);
+
+  ptr->epfd      = -1;
+  ptr->wakeup[0] = -1;
+  ptr->wakeup[1] = -1;
+
+  return ret;
+}
+
+static VALUE
+rb_poller_initialize(VALUE self)
+{
+  poller_t* ptr;
+  struct epoll_event ev;
+  int err;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, poller_t, &poller_data_type, ptr);
+
+  /*
+   * create epoll instance and pipe for interrupt the waiting
+   */
+  ptr->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (ptr->epfd < 0) {
+    rb_raise(rb_eRuntimeError, "epoll_create1() failed.");
+  }
+
+  err = pipe(ptr->wakeup);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "pipe() failed.");
+  }
+
+  for (i = 0; i < 2; i++) {
+    fcntl(ptr->wakeup[i], F_SETFD, FD_CLOEXEC);
+    fcntl(ptr->wakeup[i], F_SETFL, O_NONBLOCK);
+  }
+
+  ptr->capa = 8;
+  ptr->ent  = ALLOC_N(poller_entry_t, ptr->capa);
+  ptr->ev   = ALLOC_N(struct epoll_event, ptr->capa + 1);
+
+  ev.events   = EPOLLIN;
+  ev.data.u64 = WAKEUP_MARK;
+
+  err = epoll_ctl(ptr->epfd, EPOLL_CTL_ADD, ptr->wakeup[0], &ev);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "epoll_ctl() failed.");
+  }
+
+  return self;
+}
+
+static void
+check_poller_idle(poller_t* ptr)
+{
+  if (ptr->waiting) {
+    rb_raise(rb_eRuntimeError, "poller is busy.");
+  }
+}
+
+static int
+find_entry(poller_t* ptr, VALUE cam)
+{
+  int i;
+
+  for (i = 0; i < ptr->n; i++) {
+    if (ptr->ent[i].cam == cam) return i;
+  }
+
+  return -1;
+}
+
+static VALUE
+rb_poller_add(VALUE self, VALUE cam)
+{
+  poller_t* ptr;
+  camera_t* cp;
+  poller_entry_t* ent;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, poller_t, &poller_data_type, ptr);
+  TypedData_Get_Struct(cam, camera_t, &camera_data_type, cp);
+
+  /*
+   * check argument
+   */
+  check_poller_idle(ptr);
+
+  // バックグラウンドキャプチャ中のカメラはスレッド側がデキューしている
+  if (cp->background) {
+    rb_raise(rb_eArgError, "background capture camera can't be polled.");
+  }
+
+  if (find_entry(ptr, cam) >= 0) return self;
+
+  /*
+   * append entry
+   */
+  if (ptr->n == ptr->capa) {
+    ptr->capa *= 2;
+    REALLOC_N(ptr->ent, poller_entry_t, ptr->capa);
+    REALLOC_N(ptr->ev, struct epoll_event, ptr->capa + 1);
+  }
+
+  ent             = ptr->ent + ptr->n++;
+  ent->cam        = cam;
+  ent->fd         = -1;
+  ent->serial     = 0;
+  ent->registered = 0;
+
+  RB_OBJ_WRITTEN(self, Qundef, cam);
+
+  return self;
+}
+
+static VALUE
+rb_poller_remove(VALUE self, VALUE cam)
+{
+  poller_t* ptr;
+  camera_t* cp;
+  poller_entry_t* ent;
+  struct epoll_event ev;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, poller_t, &poller_data_type, ptr);
+
+  /*
+   * check argument
+   */
+  check_poller_idle(ptr);
+
+  i = find_entry(ptr, cam);
+  if (i < 0) return Qnil;
+
+  /*
+   * remove entry
+   */
+  ent = ptr->ent + i;
+  TypedData_Get_Struct(cam, camera_t, &camera_data_type, cp);
+
+  if (ent->registered && ent->serial == cp->fd_serial) {
+    epoll_ctl(ptr->epfd, EPOLL_CTL_DEL, ent->fd, NULL);
+  }
+
+  // 末尾のエントリを空いた位置に移動する (登録済みなら識別値も更新する)
+  *ent = ptr->ent[--ptr->n];
+
+  if (i < ptr->n && ent->registered) {
+    ev.events   = EPOLLIN;
+    ev.data.u64 = i;
+
+    epoll_ctl(ptr->epfd, EPOLL_CTL_MOD, ent->fd, &ev);
+  }
+
+  return cam;
+}
+
+static VALUE
+rb_poller_cameras(VALUE self)
+{
+  poller_t* ptr;
+  VALUE ret;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, poller_t, &poller_data_type, ptr);
+
+  /*
+   * build array
+   */
+  ret = rb_ary_new_capa(ptr->n);
+
+  for (i = 0; i < ptr->n; i++) {
+    rb_ary_push(ret, ptr->ent[i].cam);
+  }
+
+  return ret;
+}
+
+/*
+ * キャプチャ中のカメラだけがepollに登録されている状態にする
+ */
+static void
+sync_entries(poller_t* ptr)
+{
+  poller_entry_t* ent;
+  camera_t* cp;
+  struct epoll_event ev;
+  int ready;
+  int err;
+  int i;
+
+  /*
+   * 先に登録を外してから登録する (閉じられたfdの番号が再利用されている場合
+   * に、新しく登録したものを外さないようにするため)
+   */
+  for (i = 0; i < ptr->n; i++) {
+    ent = ptr->ent + i;
+    if (!ent->registered) continue;
+
+    TypedData_Get_Struct(ent->cam, camera_t, &camera_data_type, cp);
+
+    if (ent->serial != cp->fd_serial) {
+      // 閉じられたfdはepollから自動的に外れている
+      ent->registered = 0;
+      continue;
+    }
+
+    camera_check_ready(cp, &ready);
+
+    if (!ready || cp->background) {
+      epoll_ctl(ptr->epfd, EPOLL_CTL_DEL, ent->fd, NULL);
+      ent->registered = 0;
+    }
+  }
+
+  for (i = 0; i < ptr->n; i++) {
+    ent = ptr->ent + i;
+    if (ent->registered) continue;
+
+    TypedData_Get_Struct(ent->cam, camera_t, &camera_data_type, cp);
+    camera_check_ready(cp, &ready);
+
+    if (!ready || cp->background) continue;
+
+    ev.events   = EPOLLIN;
+    ev.data.u64 = i;
+
+    err = epoll_ctl(ptr->epfd, EPOLL_CTL_ADD, cp->fd, &ev);
+    if (err && errno == EEXIST) {
+      err = epoll_ctl(ptr->epfd, EPOLL_CTL_MOD, cp->fd, &ev);
+    }
+
+    if (err) {
+      rb_raise(rb_eRuntimeError, "epoll_ctl() failed.");
+    }
+
+    ent->fd         = cp->fd;
+    ent->serial     = cp->fd_serial;
+    ent->registered = !0;
+  }
+}
+
+typedef struct {
+  poller_t* ptr;
+  int timeout;
+  int nev;
+  int brk;
+} poller_wait_arg_t;
+
+static void*
+poller_wait_body(void* _arg)
+{
+  poller_wait_arg_t* arg;
+  poller_t* ptr;
+  char buf[16];
+  int n;
+  int i;
+
+  arg = (poller_wait_arg_t*)_arg;
+  ptr = arg->ptr;
+
+  n = epoll_wait(ptr->epfd, ptr->ev, ptr->n + 1, arg->timeout);
+
+  if (n < 0) {
+    arg->brk = (errno == EINTR);
+    arg->nev = (arg->brk)? 0: -1;
+
+  } else {
+    arg->nev = 0;
+    arg->brk = 0;
+
+    for (i = 0; i < n; i++) {
+      if (ptr->ev[i].data.u64 == WAKEUP_MARK) {
+        while (read(ptr->wakeup[0], buf, sizeof(buf)) > 0);
+        arg->brk = !0;
+
+      } else {
+        ptr->ev[arg->nev++] = ptr->ev[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void
+poller_unblock(void* _ptr)
+{
+  poller_t* ptr;
+  ssize_t n;
+
+  ptr = (poller_t*)_ptr;
+  n   = write(ptr->wakeup[1], "", 1);
+  (void)n;
+}
+
+typedef struct {
+  camera_t* cam;
+  void* ptr;
+  size_t used;
+  int ready;
+  int err;
+} poller_fetch_t;
+
+typedef struct {
+  poller_fetch_t* fetch;
+  int n;
+  int done;
+} poller_fetch_arg_t;
+
+static void*
+poller_fetch_body(void* _arg)
+{
+  poller_fetch_arg_t* arg;
+  poller_fetch_t* f;
+  int i;
+
+  arg = (poller_fetch_arg_t*)_arg;
+
+  for (i = 0; i < arg->n; i++) {
+    f = arg->fetch + i;
+
+    // 確保できなかったカメラ(他のスレッドで取得中等)は対象外
+    if (f->cam == NULL) continue;
+
+    f->err = camera_fetch_image(f->cam, f->ptr, &f->used, &f->ready);
+  }
+
+  arg->done = !0;
+
+  return NULL;
+}
+
+static VALUE
+rb_poller_wait(int argc, VALUE* argv, VALUE self)
+{
+  VALUE ret;
+  poller_t* ptr;
+  VALUE timeout;
+  poller_wait_arg_t arg;
+  poller_fetch_arg_t farg;
+  poller_fetch_t* f;
+  VALUE cams;
+  VALUE bufs;
+  VALUE cam;
+  VALUE str;
+  int64_t deadline;
+  int64_t now;
+  uint64_t idx;
+  int i;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, poller_t, &poller_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "01", &timeout);
+
+  check_poller_idle(ptr);
+
+  arg.ptr     = ptr;
+  arg.timeout = to_timeout_msec(timeout);
+
+  deadline = (arg.timeout >= 0)? camera_monotonic_msec() + arg.timeout: -1;
+
+  /*
+   * wait for frames (GVLを開放して待つ)
+   */
+  while (1) {
+    sync_entries(ptr);
+
+    // 保留中の割り込みがある場合は本体が呼ばれないので割り込み扱いにしておく
+    arg.nev = 0;
+    arg.brk = !0;
+
+    ptr->waiting = !0;
+    rb_thread_call_without_gvl2(poller_wait_body, &arg, poller_unblock, ptr);
+    ptr->waiting = 0;
+
+    if (arg.nev < 0) {
+      rb_raise(rb_eRuntimeError, "epoll_wait() failed.");
+    }
+
+    if (arg.nev > 0 || !arg.brk) break;
+
+    rb_thread_check_ints();
+
+    if (deadline >= 0) {
+      now         = camera_monotonic_msec();
+      arg.timeout = (deadline > now)? (int)(deadline - now): 0;
+    }
+  }
+
+  /*
+   * prepare buffers
+   */
+  cams = rb_ary_new_capa(arg.nev);
+  bufs = rb_ary_new_capa(arg.nev);
+  f    = ALLOCA_N(poller_fetch_t, arg.nev);
+
+  farg.fetch = f;
+  farg.n     = 0;
+
+  for (i = 0; i < arg.nev; i++) {
+    idx = ptr->ev[i].data.u64;
+    if (idx >= (uint64_t)ptr->n) continue;
+
+    cam = ptr->ent[idx].cam;
+    str = rb_str_buf_new(0);
+
+    TypedData_Get_Struct(cam, camera_t, &camera_data_type, f[farg.n].cam);
+
+    rb_str_modify_expand(str, f[farg.n].cam->image_size);
+    rb_enc_associate(str, rb_ascii8bit_encoding());
+
+    f[farg.n].ptr   = RSTRING_PTR(str);
+    f[farg.n].used  = 0;
+    f[farg.n].ready = 0;
+    f[farg.n].err   = 0;
+
+    rb_ary_push(cams, cam);
+    rb_ary_push(bufs, str);
+    farg.n++;
+  }
+
+  /*
+   * claim cameras
+   * (GVLを保持している間に取得中の状態にしておき、GVLを開放している間に
+   * 別のスレッドから同じカメラのcapture等が走らないようにする。ここから
+   * 取り出しが終わるまでは例外を上げないこと)
+   */
+  for (i = 0; i < farg.n; i++) {
+    if (camera_claim_image(f[i].cam)) f[i].cam = NULL;
+  }
+
+  /*
+   * fetch frames from all ready cameras at once
+   * (待ちは発生しないのでアンブロック関数は指定しない)
+   */
+  farg.done = 0;
+
+  ptr->waiting = !0;
+  rb_thread_call_without_gvl2(poller_fetch_body, &farg, NULL, NULL);
+  ptr->waiting = 0;
+
+  // 割り込みが保留されていると本体が呼ばれないので、確保したカメラを
+  // 戻すためにGVLを保持したまま取り出す(待ちは発生しない)
+  if (!farg.done) poller_fetch_body(&farg);
+
+  /*
+   * build result
+   * (エラーになったカメラはerror?で確認できるので結果には含めない)
+   */
+  ret = rb_ary_new_capa(farg.n);
+
+  for (i = 0; i < farg.n; i++) {
+    if (f[i].cam == NULL || f[i].err || !f[i].ready) continue;
+
+    str = RARRAY_AREF(bufs, i);
+    rb_str_set_len(str, f[i].used);
+
+    rb_ary_push(ret, rb_assoc_new(RARRAY_AREF(cams, i), str));
+  }
+
+  RB_GC_GUARD(cams);
+  RB_GC_GUARD(bufs);
+
+  return ret;
+}
+
+/*
+ * 共有メモリのリングによるフレームの配信
+ *
+ * SharedPublisherはカメラから取得したフレームを共有メモリ上のリングに直接
+ * 書き込み、SharedReaderは他のプロセスからそのリングに接続して最新のフレー
+ * ムを読み出す。読み出し側は書き込み側を待たせることも、書き込み側を待つ
+ * こともない(新しいフレームを待つ場合を除く)。
+ */
+
+#define DEFAULT_RING_SLOTS              4
+
+typedef struct {
+  ring_t ring;
+  VALUE cam;
+} publisher_t;
+
+typedef struct {
+  ring_t ring;
+  ring_slot_t slot;       /* 最後に読んだフレームのメタデータ */
+} reader_t;
+
+/*
+ * 共有メモリはこのプロセスで作成したものなので、GCにメモリ使用量として
+ * 通知しておく(読み出し側はdsizeで報告するのみ)。
+ */
+static void
+detach_publisher(publisher_t* ptr)
+{
+  if (ptr->ring.base != NULL) {
+    ring_detach(&ptr->ring);
+    rb_gc_adjust_memory_usage(-(ssize_t)ptr->ring.size);
+  }
+}
+
+static void
+rb_publisher_mark(void* _ptr)
+{
+  publisher_t* ptr;
+
+  ptr = (publisher_t*)_ptr;
+
+  rb_gc_mark(ptr->cam);
+}
+
+static void
+rb_publisher_free(void* _ptr)
+{
+  publisher_t* ptr;
+
+  ptr = (publisher_t*)_ptr;
+
+  detach_publisher(ptr);
+
+  xfree(ptr);
+}
+
+static size_t
+rb_publisher_size(const void* _ptr)
+{
+  const publisher_t* ptr;
+
+  ptr = (const publisher_t*)_ptr;
+
+  return sizeof(publisher_t) + ((ptr->ring.base != NULL)? ptr->ring.size: 0);
+}
+
+static const rb_data_type_t publisher_data_type = {
+  .wrap_struct_name = "V4L2 shared ring publisher for ruby",
+  .function = {
+    .dmark = rb_publisher_mark,
+    .dfree = rb_publisher_free,
+    .dsize = rb_publisher_size,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void
+rb_reader_free(void* _ptr)
+{
+  reader_t* ptr;
+
+  ptr = (reader_t*)_ptr;
+
+  if (ptr->ring.base != NULL) ring_detach(&ptr->ring);
+
+  xfree(ptr);
+}
+
+static size_t
+rb_reader_size(const void* _ptr)
+{
+  const reader_t* ptr;
+
+  ptr = (const reader_t*)_ptr;
+
+  return sizeof(reader_t) + ((ptr->ring.base != NULL)? ptr->ring.size: 0);
+}
+
+static const rb_data_type_t reader_data_type = {
+  .wrap_struct_name = "V4L2 shared ring reader for ruby",
+  .function = {
+    .dfree = rb_reader_free,
+    .dsize = rb_reader_size,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE
+rb_publisher_alloc(VALUE self)
+{
+  publisher_t* ptr;
+
+  return TypedData_Make_Struct(publisher_klass,
+                               publisher_t, &publisher_data_type, ptr);
+}
+
+static VALUE
+rb_publisher_initialize(int argc, VALUE* argv, VALUE self)
+{
+  publisher_t* ptr;
+  camera_t* cam;
+  VALUE cam_obj;
+  VALUE name;
+  VALUE opts;
+  ID kw[2];
+  VALUE val[2];
+  int nslot;
+  size_t size;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, publisher_t, &publisher_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "2:", &cam_obj, &name, &opts);
+
+  TypedData_Get_Struct(cam_obj, camera_t, &camera_data_type, cam);
+  ExportStringValue(name);
+
+  val[0] = Qundef;
+  val[1] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = rb_intern("slots");
+    kw[1] = rb_intern("slot_size");
+    rb_get_kwargs(opts, kw, 0, 2, val);
+  }
+
+  nslot = (val[0] != Qundef)? NUM2INT(val[0]): DEFAULT_RING_SLOTS;
+
+  // 指定が無い場合はカメラの画像サイズ(start後は実際の値)に合わせる
+  size  = (val[1] != Qundef)? NUM2SIZET(val[1]): cam->image_size;
+
+  if (nslot < MIN_RING_SLOTS || nslot > MAX_RING_SLOTS) {
+    rb_raise(rb_eRangeError, "slots must be between %d and %d.",
+             MIN_RING_SLOTS, MAX_RING_SLOTS);
+  }
+
+  if (ptr->ring.base != NULL) {
+    rb_raise(rb_eRuntimeError, "already initialized.");
+  }
+
+  /*
+   * create ring
+   */
+  err = ring_create(&ptr->ring, StringValueCStr(name), nslot, size);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "create shared ring failed.");
+  }
+
+  rb_gc_adjust_memory_usage((ssize_t)ptr->ring.size);
+
+  RB_OBJ_WRITE(self, &ptr->cam, cam_obj);
+
+  return self;
+}
+
+static publisher_t*
+get_publisher(VALUE self)
+{
+  publisher_t* ptr;
+
+  TypedData_Get_Struct(self, publisher_t, &publisher_data_type, ptr);
+
+  if (ptr->ring.base == NULL) {
+    rb_raise(rb_eIOError, "closed publisher.");
+  }
+
+  return ptr;
+}
+
+typedef struct {
+  publisher_t* pub;
+  camera_t* cam;
+  int timeout;
+  int ready;
+} publish_arg_t;
+
+static VALUE
+publish_body(VALUE _arg)
+{
+  publish_arg_t* arg;
+  frame_info_t info;
+  uint32_t format;
+  int bpl;
+  void* data;
+  size_t size;
+  size_t used;
+  int err;
+
+  arg = (publish_arg_t*)_arg;
+
+  err = ring_begin_write(&arg->pub->ring, &data, &size);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "begin write failed.");
+  }
+
+  /*
+   * スロットに直接取り込む (GVLはcamera_try_get_image()の中で開放される)
+   */
+  err = camera_try_get_image(arg->cam, data, &used, arg->timeout, &arg->ready);
+  if (err) {
+    rb_raise(rb_eRuntimeError, "capture failed.");
+  }
+
+  if (arg->ready) {
+    camera_get_frame_info(arg->cam, &info);
+    camera_get_output_format(arg->cam, &format, &bpl);
+
+    err = ring_commit_write(&arg->pub->ring, used, format,
+                            arg->cam->width, arg->cam->height, bpl, &info);
+    if (err) {
+      rb_raise(rb_eRuntimeError, "commit write failed.");
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE
+publish_ensure(VALUE _arg)
+{
+  publish_arg_t* arg;
+
+  arg = (publish_arg_t*)_arg;
+
+  // 公開されずに終わった場合(タイムアウト、例外)はスロットを閉じる
+  if (arg->pub->ring.writing != 0) ring_cancel_write(&arg->pub->ring);
+
+  return Qnil;
+}
+
+static VALUE
+rb_publisher_publish(int argc, VALUE* argv, VALUE self)
+{
+  publish_arg_t arg;
+  VALUE opts;
+  ID kw[1];
+  VALUE val[1];
+
+  /*
+   * strip object
+   */
+  arg.pub = get_publisher(self);
+
+  TypedData_Get_Struct(arg.pub->cam, camera_t, &camera_data_type, arg.cam);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  val[0] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_timeout;
+    rb_get_kwargs(opts, kw, 0, 1, val);
+  }
+
+  arg.timeout = to_timeout_msec(val[0]);
+  arg.ready   = 0;
+
+  if (arg.cam->image_size > arg.pub->ring.hdr->slot_size) {
+    rb_raise(rb_eRuntimeError, "image size exceeds the slot size.");
+  }
+
+  /*
+   * do publish
+   */
+  rb_ensure(publish_body, (VALUE)&arg, publish_ensure, (VALUE)&arg);
+
+  return (arg.ready)? UINT2NUM(arg.pub->ring.hdr->latest): Qnil;
+}
+
+static VALUE
+rb_publisher_name(VALUE self)
+{
+  return rb_str_new_cstr(get_publisher(self)->ring.name);
+}
+
+static VALUE
+rb_publisher_close(VALUE self)
+{
+  publisher_t* ptr;
+
+  TypedData_Get_Struct(self, publisher_t, &publisher_data_type, ptr);
+
+  detach_publisher(ptr);
+
+  return Qnil;
+}
+
+static VALUE
+rb_reader_alloc(VALUE self)
+{
+  reader_t* ptr;
+
+  return TypedData_Make_Struct(reader_klass, reader_t, &reader_data_type, ptr);
+}
+
+static VALUE
+rb_reader_initialize(VALUE self, VALUE name)
+{
+  reader_t* ptr;
+  int err;
+
+  /*
+   * strip object
+   */
+  TypedData_Get_Struct(self, reader_t, &reader_data_type, ptr);
+
+  ExportStringValue(name);
+
+  if (ptr->ring.base != NULL) {
+    rb_raise(rb_eRuntimeError, "already initialized.");
+  }
+
+  /*
+   * attach to the ring
+   */
+  err = ring_attach(&ptr->ring, StringValueCStr(name));
+  if (err) {
+    rb_raise(rb_eRuntimeError, "attach shared ring failed.");
+  }
+
+  return self;
+}
+
+static reader_t*
+get_reader(VALUE self)
+{
+  reader_t* ptr;
+
+  TypedData_Get_Struct(self, reader_t, &reader_data_type, ptr);
+
+  if (ptr->ring.base == NULL) {
+    rb_raise(rb_eIOError, "closed reader.");
+  }
+
+  return ptr;
+}
+
+typedef struct {
+  ring_t* ring;
+  int timeout;
+  int ready;
+  int err;
+} reader_wait_arg_t;
+
+static void*
+reader_wait_body(void* _arg)
+{
+  reader_wait_arg_t* arg;
+
+  arg      = (reader_wait_arg_t*)_arg;
+  arg->err = ring_wait(arg->ring, arg->timeout, &arg->ready);
+
+  return NULL;
+}
+
+static void
+reader_unblock(void* ring)
+{
+  ring_interrupt((ring_t*)ring);
+}
+
+static VALUE
+rb_reader_read(int argc, VALUE* argv, VALUE self)
+{
+  reader_t* ptr;
+  VALUE opts;
+  ID kw[2];
+  VALUE val[2];
+  VALUE ret;
+  reader_wait_arg_t arg;
+  int64_t deadline;
+  int64_t now;
+  size_t size;
+  int ready;
+  int err;
+
+  /*
+   * strip object
+   */
+  ptr = get_reader(self);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  val[0] = Qundef;
+  val[1] = Qundef;
+
+  if (opts != Qnil) {
+    kw[0] = id_into;
+    kw[1] = id_timeout;
+    rb_get_kwargs(opts, kw, 0, 2, val);
+  }
+
+  if (val[0] == Qundef || val[0] == Qnil) {
+    ret = rb_str_buf_new(0);
+  } else {
+    ret = val[0];
+    StringValue(ret);
+  }
+
+  size = ptr->ring.hdr->slot_size;
+
+  rb_str_modify_expand(ret, (size > (size_t)RSTRING_LEN(ret))?
+                                size - RSTRING_LEN(ret): 0);
+  rb_enc_associate(ret, rb_ascii8bit_encoding());
+
+  arg.ring    = &ptr->ring;
+  arg.timeout = to_timeout_msec(val[1]);
+  deadline    = (arg.timeout >= 0)? camera_monotonic_msec() + arg.timeout: -1;
+
+  /*
+   * read the newest frame
+   * (前回から更新されていなければ、新しいフレームが公開されるまで待つ)
+   */
+  while (1) {
+    err = ring_read(&ptr->ring, RSTRING_PTR(ret), size, &ptr->slot, &ready);
+    if (err) {
+      rb_raise(rb_eRuntimeError, "read shared ring failed.");
+    }
+
+    if (ready) {
+      rb_str_set_len(ret, ptr->slot.used);
+      break;
+    }
+
+    if (arg.timeout == 0) {
+      ret = Qnil;
+      break;
+    }
+
+    arg.ready = 0;
+    arg.err   = 0;
+
+    rb_thread_call_without_gvl2(reader_wait_body, &arg,
+                                reader_unblock, &ptr->ring);
+
+    if (arg.err) {
+      rb_raise(rb_eRuntimeError, "wait shared ring failed.");
+    }
+
+    rb_thread_check_ints();
+
+    if (deadline >= 0) {
+      now         = camera_monotonic_msec();
+      arg.timeout = (deadline > now)? (int)(deadline - now): 0;
+    }
+  }
+
+  return ret;
+}
+
+static VALUE
+rb_reader_frame_info(VALUE self)
+{
+  reader_t* ptr;
+
+  ptr = get_reader(self);
+
+  return (ptr->slot.frame != 0)? make_frame_info(&ptr->slot.info): Qnil;
+}
+
+static VALUE
+rb_reader_format(VALUE self)
+{
+  reader_t* ptr;
+
+  ptr = get_reader(self);
+
+  return (ptr->slot.frame != 0)? to_fourcc(ptr->slot.format): Qnil;
+}
+
+static VALUE
+rb_reader_image_width(VALUE self)
+{
+  reader_t* ptr;
+
+  ptr = get_reader(self);
+
+  return (ptr->slot.frame != 0)? INT2NUM(ptr->slot.width): Qnil;
+}
+
+static VALUE
+rb_reader_image_height(VALUE self)
+{
+  reader_t* ptr;
+
+  ptr = get_reader(self);
+
+  return (ptr->slot.frame != 0)? INT2NUM(ptr->slot.height): Qnil;
+}
+
+static VALUE
+rb_reader_bytes_per_line(VALUE self)
+{
+  reader_t* ptr;
+
+  ptr = get_reader(self);
+
+  return (ptr->slot.frame != 0)? INT2NUM(ptr->slot.bytes_per_line): Qnil;
+}
+
+static VALUE
+rb_reader_close(VALUE self)
+{
+  reader_t* ptr;
+
+  TypedData_Get_Struct(self, reader_t, &reader_data_type, ptr);
+
+  if (ptr->ring.base != NULL) ring_detach(&ptr->ring);
+
+  return Qnil;
+}
+
+void
+Init_v4l2()
+{
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif /* defined(HAVE_RB_EXT_RACTOR_SAFE) */
+
+  rb_require("monitor");
 
   module           = rb_define_module("Video4Linux2");
+  rb_define_module_function(module,
+                            "conversion_kernel", rb_conversion_kernel, 0);
   camera_klass     = rb_define_class_under(module, "Camera", rb_cObject);
 
   rb_define_alloc_func(camera_klass, rb_camera_alloc);
@@ -1035,12 +4794,60 @@ Init_v4l2()
   rb_define_method(camera_klass, "image_width=", rb_camera_set_image_width, 1);
   rb_define_method(camera_klass, "image_height", rb_camera_get_image_height,0);
   rb_define_method(camera_klass, "image_height=", rb_camera_set_image_height,1);
+  rb_define_method(camera_klass, "image_size", rb_camera_get_image_size, 0);
+  rb_define_method(camera_klass,
+                   "bytes_per_line", rb_camera_get_bytes_per_line, 0);
   rb_define_method(camera_klass, "framerate", rb_camera_get_framerate, 0);
   rb_define_method(camera_klass, "framerate=", rb_camera_set_framerate, 1);
+  rb_define_method(camera_klass, "buffer_count", rb_camera_get_buffer_count, 0);
+  rb_define_method(camera_klass,
+                   "buffer_count=", rb_camera_set_buffer_count, 1);
+  rb_define_method(camera_klass,
+                   "background_capture", rb_camera_get_background, 0);
+  rb_define_method(camera_klass,
+                   "background_capture=", rb_camera_set_background, 1);
+  rb_define_method(camera_klass, "low_latency", rb_camera_get_low_latency, 0);
+  rb_define_method(camera_klass,
+                   "low_latency=", rb_camera_set_low_latency, 1);
+  rb_define_method(camera_klass, "jpeg_output", rb_camera_get_jpeg_output, 0);
+  rb_define_method(camera_klass,
+                   "jpeg_output=", rb_camera_set_jpeg_output, 1);
+  rb_define_method(camera_klass,
+                   "jpeg_quality", rb_camera_get_jpeg_quality, 0);
+  rb_define_method(camera_klass,
+                   "jpeg_quality=", rb_camera_set_jpeg_quality, 1);
+  rb_define_method(camera_klass, "jpeg_check", rb_camera_get_jpeg_check, 0);
+  rb_define_method(camera_klass, "jpeg_check=", rb_camera_set_jpeg_check, 1);
+  rb_define_method(camera_klass, "memory", rb_camera_get_memory, 0);
+  rb_define_method(camera_klass, "memory=", rb_camera_set_memory, 1);
+  rb_define_method(camera_klass, "hugepage", rb_camera_get_hugepage, 0);
+  rb_define_method(camera_klass, "hugepage=", rb_camera_set_hugepage, 1);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  rb_define_method(camera_klass,
+                   "dmabuf_export", rb_camera_get_dmabuf_export, 0);
+  rb_define_method(camera_klass,
+                   "dmabuf_export=", rb_camera_set_dmabuf_export, 1);
+  rb_define_method(camera_klass, "send_frame", rb_camera_send_frame, 1);
+  rb_define_method(camera_klass,
+                   "receive_releases", rb_camera_receive_releases, 1);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
   rb_define_method(camera_klass, "state", rb_camera_state, 0);
   rb_define_method(camera_klass, "start", rb_camera_start, 0);
   rb_define_method(camera_klass, "stop", rb_camera_stop, 0);
-  rb_define_method(camera_klass, "capture", rb_camera_capture, 0);
+  rb_define_method(camera_klass, "capture", rb_camera_capture, -1);
+  rb_define_method(camera_klass,
+                   "capture_frame", rb_camera_capture_frame, -1);
+  rb_define_method(camera_klass, "each_frame", rb_camera_each_frame, -1);
+  rb_define_method(camera_klass, "frame_pool", rb_camera_get_frame_pool, 0);
+  rb_define_method(camera_klass, "frame_pool=", rb_camera_set_frame_pool, 1);
+  rb_define_method(camera_klass, "try_capture", rb_camera_try_capture, -1);
+  rb_define_method(camera_klass, "to_io", rb_camera_to_io, 0);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  rb_define_method(camera_klass, "borrow", rb_camera_borrow, 0);
+  rb_define_method(camera_klass, "borrow_planes", rb_camera_borrow_planes, 0);
+  rb_define_method(camera_klass, "release", rb_camera_release, 1);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+  rb_define_method(camera_klass, "frame_info", rb_camera_get_frame_info, 0);
   rb_define_method(camera_klass, "busy?", rb_camera_is_busy, 0);
   rb_define_method(camera_klass, "ready?", rb_camera_is_ready, 0);
   rb_define_method(camera_klass, "error?", rb_camera_is_error, 0);
@@ -1088,6 +4895,94 @@ Init_v4l2()
   rb_define_attr(fmt_desc_klass, "fcc", !0, 0);
   rb_define_attr(fmt_desc_klass, "description", !0, 0);
 
+  frame_info_klass = rb_define_class_under(camera_klass,
+                                           "FrameInfo", rb_cObject);
+  rb_define_attr(frame_info_klass, "sequence", !0, 0);
+  rb_define_attr(frame_info_klass, "timestamp", !0, 0);
+  rb_define_attr(frame_info_klass, "time", !0, 0);
+  rb_define_attr(frame_info_klass, "flags", !0, 0);
+  rb_define_attr(frame_info_klass, "field", !0, 0);
+  rb_define_attr(frame_info_klass, "error", !0, 0);
+  rb_define_attr(frame_info_klass, "skipped", !0, 0);
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  shared_frame_klass = rb_define_class_under(module,
+                                             "SharedFrame", rb_cObject);
+  rb_define_singleton_method(shared_frame_klass,
+                             "receive", rb_shared_frame_s_receive, 1);
+  rb_define_method(shared_frame_klass, "release", rb_shared_frame_release, 1);
+  rb_define_attr(shared_frame_klass, "token", !0, 0);
+  rb_define_attr(shared_frame_klass, "format", !0, 0);
+  rb_define_attr(shared_frame_klass, "width", !0, 0);
+  rb_define_attr(shared_frame_klass, "height", !0, 0);
+  rb_define_attr(shared_frame_klass, "bytes_per_line", !0, 0);
+  rb_define_attr(shared_frame_klass, "info", !0, 0);
+  rb_define_attr(shared_frame_klass, "planes", !0, 0);
+  rb_define_attr(shared_frame_klass, "offsets", !0, 0);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  frame_klass = rb_define_class_under(module, "Frame", rb_cObject);
+
+  rb_undef_alloc_func(frame_klass);
+  rb_undef_method(frame_klass, "initialize_copy");
+  rb_define_method(frame_klass, "format", rb_frame_format, 0);
+  rb_define_method(frame_klass, "width", rb_frame_width, 0);
+  rb_define_method(frame_klass, "height", rb_frame_height, 0);
+  rb_define_method(frame_klass, "bytes_per_line", rb_frame_bytes_per_line, 0);
+  rb_define_method(frame_klass, "stride", rb_frame_bytes_per_line, 0);
+  rb_define_method(frame_klass, "bytesize", rb_frame_bytesize, 0);
+  rb_define_method(frame_klass, "sequence", rb_frame_sequence, 0);
+  rb_define_method(frame_klass, "timestamp", rb_frame_timestamp, 0);
+  rb_define_method(frame_klass, "time", rb_frame_time, 0);
+  rb_define_method(frame_klass, "info", rb_frame_info, 0);
+  rb_define_method(frame_klass, "to_s", rb_frame_to_s, 0);
+  rb_define_method(frame_klass, "release", rb_frame_release, 0);
+  rb_define_method(frame_klass, "to_rgb", rb_frame_to_rgb, -1);
+  rb_define_method(frame_klass, "to_bgr", rb_frame_to_bgr, -1);
+  rb_define_method(frame_klass, "to_rgba", rb_frame_to_rgba, -1);
+  rb_define_method(frame_klass, "to_yuv", rb_frame_to_yuv, -1);
+  rb_define_method(frame_klass, "decode", rb_frame_decode, -1);
+  rb_define_method(frame_klass, "released?", rb_frame_is_released, 0);
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  rb_define_method(frame_klass, "to_io_buffer", rb_frame_to_io_buffer, 0);
+  rb_define_method(frame_klass, "planes", rb_frame_planes, 0);
+#endif /* defined(HAVE_RUBY_IO_BUFFER_H) */
+
+  poller_klass = rb_define_class_under(module, "Poller", rb_cObject);
+
+  rb_define_alloc_func(poller_klass, rb_poller_alloc);
+  rb_define_method(poller_klass, "initialize", rb_poller_initialize, 0);
+  rb_undef_method(poller_klass, "initialize_copy");
+  rb_define_method(poller_klass, "add", rb_poller_add, 1);
+  rb_define_method(poller_klass, "<<", rb_poller_add, 1);
+  rb_define_method(poller_klass, "remove", rb_poller_remove, 1);
+  rb_define_method(poller_klass, "cameras", rb_poller_cameras, 0);
+  rb_define_method(poller_klass, "wait", rb_poller_wait, -1);
+
+  publisher_klass = rb_define_class_under(module,
+                                          "SharedPublisher", rb_cObject);
+
+  rb_define_alloc_func(publisher_klass, rb_publisher_alloc);
+  rb_define_method(publisher_klass, "initialize", rb_publisher_initialize, -1);
+  rb_undef_method(publisher_klass, "initialize_copy");
+  rb_define_method(publisher_klass, "publish", rb_publisher_publish, -1);
+  rb_define_method(publisher_klass, "name", rb_publisher_name, 0);
+  rb_define_method(publisher_klass, "close", rb_publisher_close, 0);
+
+  reader_klass = rb_define_class_under(module, "SharedReader", rb_cObject);
+
+  rb_define_alloc_func(reader_klass, rb_reader_alloc);
+  rb_define_method(reader_klass, "initialize", rb_reader_initialize, 1);
+  rb_undef_method(reader_klass, "initialize_copy");
+  rb_define_method(reader_klass, "read", rb_reader_read, -1);
+  rb_define_method(reader_klass, "frame_info", rb_reader_frame_info, 0);
+  rb_define_method(reader_klass, "format", rb_reader_format, 0);
+  rb_define_method(reader_klass, "image_width", rb_reader_image_width, 0);
+  rb_define_method(reader_klass, "image_height", rb_reader_image_height, 0);
+  rb_define_method(reader_klass,
+                   "bytes_per_line", rb_reader_bytes_per_line, 0);
+  rb_define_method(reader_klass, "close", rb_reader_close, 0);
+
   id_iv_name    = rb_intern_const("@name");
   id_iv_driver  = rb_intern_const("@driver");
   id_iv_bus     = rb_intern_const("@bus");
@@ -1103,4 +4998,32 @@ Init_v4l2()
   id_iv_rate    = rb_intern_const("@rate");
   id_iv_fcc     = rb_intern_const("@fcc");
   id_iv_desc    = rb_intern_const("@description");
+  id_iv_sequence  = rb_intern_const("@sequence");
+  id_iv_timestamp = rb_intern_const("@timestamp");
+  id_iv_time      = rb_intern_const("@time");
+  id_iv_flags     = rb_intern_const("@flags");
+  id_iv_field     = rb_intern_const("@field");
+  id_iv_error     = rb_intern_const("@error");
+  id_iv_skipped   = rb_intern_const("@skipped");
+  id_lent       = rb_intern_const("lent");
+  id_owner      = rb_intern_const("owner");
+  id_into       = rb_intern_const("into");
+  id_scale      = rb_intern_const("scale");
+  id_color      = rb_intern_const("color");
+  id_timeout    = rb_intern_const("timeout");
+  id_io         = rb_intern_const("io");
+  id_io_serial  = rb_intern_const("io_serial");
+  id_sent       = rb_intern_const("sent");
+  id_shareable  = rb_intern_const("shareable");
+  id_token      = rb_intern_const("token");
+  id_iv_token   = rb_intern_const("@token");
+  id_iv_format  = rb_intern_const("@format");
+  id_iv_info    = rb_intern_const("@info");
+  id_iv_planes  = rb_intern_const("@planes");
+  id_iv_offsets = rb_intern_const("@offsets");
+  id_pool       = rb_intern_const("pool");
+  id_pool_size  = rb_intern_const("pool_size");
+  id_matrix     = rb_intern_const("matrix");
+  id_range      = rb_intern_const("range");
+  id_iv_bytes_per_line = rb_intern_const("@bytes_per_line");
 }
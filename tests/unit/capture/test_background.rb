@@ -0,0 +1,99 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestBackground < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "background capture" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_false(cam.background_capture)
+    assert_nothing_raised {cam.background_capture = true}
+    assert_true(cam.background_capture)
+
+    cam.start {
+      assert_raise_kind_of(RuntimeError) {cam.background_capture = false}
+
+      10.times {
+        data = assert_nothing_raised {cam.capture}
+        assert_not_equal(0, data.bytesize)
+
+        p data.bytesize if Config.show_data?
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "under ruby load" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.background_capture = true
+
+    cam.start {
+      sleep 0.5
+      assert_nothing_raised {cam.capture}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  def abandon
+    cam = klass.open(Config.device)
+    cam.background_capture = true
+    cam.start
+    cam.capture
+    nil
+  end
+
+  test "collected while capturing" do
+    # 停止しないまま参照を失ったカメラもGCで回収され、キャプチャスレッド
+    # も終了する(GCが保守的に残すことがあるので多少の差は許容する)
+    tasks = Dir.children("/proc/self/task").size
+
+    5.times {
+      abandon
+      GC.start
+    }
+
+    assert_operator(Dir.children("/proc/self/task").size - tasks, :<=, 2)
+
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.background_capture = true
+
+    cam.start {assert_nothing_raised {cam.capture}}
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "borrow is not available" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.background_capture = true
+
+    cam.start {
+      assert_raise_kind_of(RuntimeError) {cam.borrow {}}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
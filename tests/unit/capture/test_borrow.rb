@@ -0,0 +1,161 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestBorrow < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "borrow with block" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      buf = nil
+
+      assert_nothing_raised {
+        cam.borrow { |b|
+          assert_kind_of(IO::Buffer, b)
+          assert_true(b.readonly?)
+          assert_not_equal(0, b.size)
+
+          buf = b
+        }
+      }
+
+      assert_true(buf.null?)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "borrow and release" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      buf = assert_nothing_raised {cam.borrow}
+
+      assert_nothing_raised {cam.capture}
+      assert_nothing_raised {cam.release(buf)}
+      assert_raise_kind_of(ArgumentError) {cam.release(buf)}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "release inside block" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      assert_nothing_raised {
+        cam.borrow { |b| cam.release(b)}
+      }
+
+      # ブロック内で上がった例外はそのまま伝わる
+      assert_raise(ZeroDivisionError) {
+        cam.borrow { |b|
+          cam.release(b)
+          1 / 0
+        }
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "stop inside block" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start
+    buf = nil
+
+    assert_nothing_raised {
+      cam.borrow { |b|
+        buf = b
+        cam.stop
+      }
+    }
+
+    assert_true(buf.null?)
+    assert_false(cam.ready?)
+
+    cam.start
+    assert_raise(ZeroDivisionError) {
+      cam.borrow { |b|
+        cam.stop
+        1 / 0
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "revoke on stop" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start
+    buf = cam.borrow
+    cam.stop
+
+    assert_true(buf.null?)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "borrow planes" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    omit_unless(cam.support_formats.any? {|fmt| fmt.fcc == "NV12"},
+                "NV12 is not supported by the device")
+
+    cam.format       = :NV12
+    cam.image_width  = 640
+    cam.image_height = 480
+
+    cam.start {
+      planes = nil
+
+      assert_nothing_raised {
+        cam.borrow_planes { |pl|
+          assert_kind_of(Array, pl)
+          assert_equal(2, pl.size)
+          assert_true(pl.all? {|b| b.readonly?})
+
+          luma = cam.bytes_per_line * cam.image_height
+          assert_equal(luma, pl[0].size)
+          assert_equal(luma / 2, pl[1].size)
+
+          planes = pl
+        }
+      }
+
+      assert_true(planes.all?(&:null?))
+
+      planes = cam.borrow_planes
+      assert_nothing_raised {cam.release(planes)}
+      assert_raise_kind_of(ArgumentError) {cam.release(planes)}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,82 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+Warning[:experimental] = false
+
+using TestUtil
+
+class TestCaptureFrame < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "frame metadata" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      frame = assert_nothing_raised {cam.capture_frame}
+
+      assert_kind_of(Video4Linux2::Frame, frame)
+      assert_equal(cam.image_width, frame.width)
+      assert_equal(cam.image_height, frame.height)
+      assert_equal(cam.bytes_per_line, frame.stride)
+      assert_kind_of(String, frame.format)
+      assert_kind_of(Integer, frame.sequence)
+      assert_kind_of(Float, frame.timestamp)
+      assert_kind_of(Video4Linux2::Camera::FrameInfo, frame.info)
+      assert_not_equal(0, frame.bytesize)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "lazy views" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      frame = cam.capture_frame
+
+      str = assert_nothing_raised {frame.to_s}
+      assert_equal(frame.bytesize, str.bytesize)
+      assert_true(str.frozen?)
+      assert_same(str, frame.to_s)
+
+      buf = assert_nothing_raised {frame.to_io_buffer}
+      assert_true(buf.readonly?)
+      assert_equal(str, buf.get_string)
+
+      planes = assert_nothing_raised {frame.planes}
+      assert_equal(frame.bytesize, planes.sum(&:size))
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "timeout" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.framerate = 1/5r
+    cam.start {
+      cam.capture_frame
+      assert_nil(cam.capture_frame(timeout: 0))
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,74 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestCaptureInto < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "into string" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      buf = String.new
+
+      3.times {
+        ret = assert_nothing_raised {cam.capture(into: buf)}
+
+        assert_same(buf, ret)
+        assert_not_equal(0, buf.bytesize)
+        assert_equal(Encoding::ASCII_8BIT, buf.encoding)
+      }
+
+      assert_same(buf, cam.capture(buf))
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "into io buffer" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      buf = IO::Buffer.new(16)
+
+      used = assert_nothing_raised {cam.capture(into: buf)}
+
+      assert_kind_of(Integer, used)
+      assert_operator(buf.size, :>=, used)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "illeagal target" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      assert_raise_kind_of(TypeError) {cam.capture(into: [])}
+      assert_raise_kind_of(FrozenError) {cam.capture(into: "".freeze)}
+      assert_raise_kind_of(ArgumentError) {cam.capture(foo: 1)}
+      assert_raise_kind_of(ArgumentError) {cam.capture("", into: "")}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,84 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'socket'
+require 'v4l2'
+
+using TestUtil
+
+class TestDmabuf < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "dmabuf export mode" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_false(cam.dmabuf_export)
+    assert_raise_kind_of(RuntimeError) {cam.start {cam.send_frame(nil)}}
+
+    assert_nothing_raised {cam.dmabuf_export = true}
+    assert_true(cam.dmabuf_export)
+
+    # USERPTRのバッファはエクスポートできない
+    assert_raise_kind_of(RuntimeError) {cam.memory = :userptr}
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "send and release frame" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.dmabuf_export = true
+
+    begin
+      cam.start
+    rescue RuntimeError
+      omit("VIDIOC_EXPBUF is not supported by the device")
+    end
+
+    tx, rx = UNIXSocket.pair
+
+    begin
+      token = assert_nothing_raised {cam.send_frame(tx)}
+      frame = assert_nothing_raised {Video4Linux2::SharedFrame.receive(rx)}
+
+      assert_equal(token, frame.token)
+      assert_equal(cam.image_width, frame.width)
+      assert_equal(cam.image_height, frame.height)
+      assert_kind_of(Video4Linux2::Camera::FrameInfo, frame.info)
+      assert_not_equal(0, frame.planes.size)
+      assert_true(frame.planes.all? {|b| b.size > 0})
+
+      assert_equal(0, cam.receive_releases(tx))
+      assert_nothing_raised {frame.release(rx)}
+      assert_raise_kind_of(ArgumentError) {frame.release(rx)}
+      assert_equal(1, cam.receive_releases(tx))
+
+      # 受信側が切断した場合は送信済みのバッファを回収する
+      assert_nothing_raised {cam.send_frame(tx)}
+      rx.close
+      assert_equal(1, cam.receive_releases(tx))
+
+      assert_nothing_raised {cam.capture}
+    ensure
+      cam.stop
+      tx.close
+      rx.close unless rx.closed?
+    end
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,138 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestFiberScheduler < Test::Unit::TestCase
+  #
+  # テスト用の最小限のFiberスケジューラ (io_waitとsleepのみ対応)
+  #
+  class Scheduler
+    def initialize
+      @readable = {}
+      @waiting  = {}
+      @ready    = []
+    end
+
+    attr_reader :io_waits
+
+    def io_wait(io, events, timeout)
+      @io_waits = (@io_waits || 0) + 1
+      @readable[Fiber.current] = io
+      @waiting[Fiber.current]  = now + timeout if timeout
+      Fiber.yield
+      @waiting.delete(Fiber.current)
+      @readable.delete(Fiber.current) ? false : events
+    end
+
+    def kernel_sleep(duration = nil)
+      @waiting[Fiber.current] = now + (duration || 0)
+      Fiber.yield
+    end
+
+    def block(blocker, timeout = nil)
+      kernel_sleep(timeout || 0.01)
+    end
+
+    def unblock(blocker, fiber)
+      @ready << fiber
+    end
+
+    def fiber(&blk)
+      Fiber.new(blocking: false, &blk).tap(&:resume)
+    end
+
+    def close
+      until @readable.empty? && @waiting.empty? && @ready.empty?
+        tmo = @waiting.values.min
+        tmo = tmo && [tmo - now, 0].max
+
+        rd, = IO.select(@readable.values, nil, nil, tmo)
+
+        resume = @ready.slice!(0..-1)
+        @readable.each {|f, io| resume << f if rd&.include?(io)}
+        resume.each {|f| @readable.delete(f); @waiting.delete(f)}
+
+        @waiting.select {|_, t| t <= now}.each_key {|f|
+          @waiting.delete(f)
+          resume << f
+        }
+
+        resume.uniq.each {|f| f.resume if f.alive?}
+      end
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+  end
+
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "to_io" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    io = assert_nothing_raised {cam.to_io}
+    assert_kind_of(IO, io)
+    assert_same(io, cam.to_io)
+
+    cam.start {
+      cam.capture
+
+      rd, = IO.select([cam], nil, nil, 3)
+      assert_equal([cam], rd)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "capture in non-blocking fiber" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 1
+
+    cam.start {
+      cam.capture
+
+      frame  = nil
+      missed = :none
+      ticks  = 0
+      sched  = Scheduler.new
+
+      th = Thread.new {
+        Fiber.set_scheduler(sched)
+
+        Fiber.schedule {frame = cam.capture}
+        Fiber.schedule {10.times {ticks += 1; sleep 0.01}}
+        Fiber.schedule {missed = cam.capture(timeout: 0.05)}
+      }
+      th.join
+
+      assert_kind_of(String, frame)
+      assert_nil(missed)
+      assert_equal(10, ticks)
+      assert_operator(sched.io_waits, :>=, 2)
+      assert_true(cam.ready?)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
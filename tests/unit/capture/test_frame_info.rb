@@ -0,0 +1,50 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestFrameInfo < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "frame info" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      cam.capture
+      info1 = assert_nothing_raised {cam.frame_info}
+
+      cam.capture
+      info2 = assert_nothing_raised {cam.frame_info}
+
+      assert_kind_of(Video4Linux2::Camera::FrameInfo, info1)
+      assert_operator(info2.sequence, :>, info1.sequence)
+      assert_operator(info2.timestamp, :>, info1.timestamp)
+      assert_false(info2.error)
+
+      if info2.time
+        assert_kind_of(Time, info2.time)
+        assert_in_delta(Time.now, info2.time, 5.0)
+      end
+
+      p info2 if Config.show_data?
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,139 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+Warning[:experimental] = false
+
+using TestUtil
+
+class TestFramePool < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "pool size" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_equal(0, cam.frame_pool)
+    assert_nothing_raised {cam.frame_pool = 2}
+    assert_equal(2, cam.frame_pool)
+    assert_raise_kind_of(RangeError) {cam.frame_pool = -1}
+    assert_nothing_raised {cam.frame_pool = nil}
+    assert_equal(0, cam.frame_pool)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "reuse pooled frames" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.frame_pool = 2
+
+    cam.start {
+      f1 = assert_nothing_raised {cam.capture_frame}
+      f2 = assert_nothing_raised {cam.capture_frame}
+      assert_not_same(f1, f2)
+
+      assert_raise_kind_of(RuntimeError) {cam.capture_frame}
+
+      str = f1.to_s
+      assert_equal(f1.bytesize, str.bytesize)
+      assert_true(str.frozen?)
+      assert_raise(FrozenError) {str << "x"}
+
+      copy = str.dup
+
+      buf = f1.to_io_buffer
+      assert_nothing_raised {f1.release}
+      assert_true(f1.released?)
+      assert_true(buf.null?)
+      assert_raise_kind_of(RuntimeError) {f1.width}
+
+      assert_raise_kind_of(RuntimeError) {f1.to_s}
+
+      f3 = assert_nothing_raised {cam.capture_frame}
+      assert_same(f1, f3)
+      assert_false(f3.released?)
+
+      # 渡した文字列は再利用時に差し替えられ、書き換えられない
+      assert_not_same(str, f3.to_s)
+      assert_equal(copy, str)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "release unpooled frame" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      frame = cam.capture_frame
+      str   = frame.to_s
+
+      assert_nothing_raised {frame.release}
+      assert_true(frame.released?)
+      assert_raise_kind_of(RuntimeError) {frame.to_s}
+      assert_nothing_raised {frame.release}
+      assert_not_equal(0, str.bytesize)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "each frame" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.frame_pool = 1
+
+    assert_kind_of(Enumerator, cam.each_frame)
+
+    cam.start {
+      frames = []
+
+      cam.each_frame {|frame|
+        frames << frame
+        assert_false(frame.released?)
+        break if frames.size == 3
+      }
+
+      assert_equal(1, frames.uniq.size)
+      assert_true(frames[0].released?)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "no garbage in steady state" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.frame_pool = 2
+
+    cam.start {
+      n = 0
+      cam.each_frame {|frame| frame.bytesize; break if (n += 1) == 2}
+
+      n = 0
+      before = GC.stat(:total_allocated_objects)
+      cam.each_frame {|frame| frame.bytesize; break if (n += 1) == 10}
+      after = GC.stat(:total_allocated_objects)
+
+      assert_operator(after - before, :<, 5)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,63 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'timeout'
+require 'v4l2'
+
+using TestUtil
+
+class TestInterrupt < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "interrupt waiting" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 1
+
+    cam.start {
+      cam.capture
+
+      assert_raise_kind_of(Timeout::Error) {
+        Timeout.timeout(0.1) {cam.capture}
+      }
+
+      assert_true(cam.ready?)
+      assert_nothing_raised {cam.capture}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "other threads run while waiting" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 1
+
+    cam.start {
+      cam.capture
+
+      count = 0
+      th    = Thread.new {loop {count += 1; sleep 0.01}}
+
+      cam.capture
+      th.kill
+
+      assert_operator(count, :>, 10)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,89 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestJpegCheck < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "check mode" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_equal(:none, cam.jpeg_check)
+
+    [:flag, :drop, :none].each { |mode|
+      assert_nothing_raised {cam.jpeg_check = mode}
+      assert_equal(mode, cam.jpeg_check)
+    }
+
+    assert_nothing_raised {cam.jpeg_check = nil}
+    assert_equal(:none, cam.jpeg_check)
+
+    assert_raise(ArgumentError) {cam.jpeg_check = :repair}
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "standalone frames" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.format = "MJPEG"
+
+    # DHTは検査方法によらず補われる
+    [:none, :flag].each { |mode|
+      cam.jpeg_check = mode
+
+      cam.start {
+        5.times {
+          data = cam.capture
+
+          # 破損していないフレームはDHTを含む完結したJPEGになる
+          next if cam.frame_info.error
+          next if data.byteslice(-2, 2) != "\xff\xd9".b
+
+          assert_equal("\xff\xd8".b, data.byteslice(0, 2))
+
+          dht = data.index("\xff\xc4".b)
+          sos = data.index("\xff\xda".b)
+
+          assert_not_nil(dht)
+          assert_operator(dht, :<, sos)
+        }
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "drop corrupt frames" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.format     = "MJPEG"
+    cam.jpeg_check = :drop
+
+    cam.start {
+      5.times {
+        assert_nothing_raised {cam.capture}
+        assert_false(cam.frame_info.error)
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
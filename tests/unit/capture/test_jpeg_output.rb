@@ -0,0 +1,107 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestJpegOutput < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  def jpeg?(data)
+    data.byteslice(0, 2) == "\xff\xd8".b and data.byteslice(-2, 2) == "\xff\xd9".b
+  end
+
+  test "quality" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_false(cam.jpeg_output)
+    assert_equal(85, cam.jpeg_quality)
+
+    assert_nothing_raised {cam.jpeg_quality = 50}
+    assert_equal(50, cam.jpeg_quality)
+
+    assert_raise(ArgumentError) {cam.jpeg_quality = 0}
+    assert_raise(ArgumentError) {cam.jpeg_quality = 101}
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "encode yuyv" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.format = "YUYV"
+
+    assert_nothing_raised {cam.jpeg_output = true}
+    assert_true(cam.jpeg_output)
+
+    cam.start {
+      frame = cam.capture_frame
+
+      assert_true(jpeg?(frame.to_s))
+      assert_equal("MJPG", frame.format)
+      assert_equal(0, frame.bytes_per_line)
+      assert_operator(frame.to_s.bytesize, :<, cam.image_size)
+
+      assert_raise(RuntimeError) {cam.jpeg_output = false}
+      assert_raise(RuntimeError) {frame.to_rgb}
+
+      # 品質はキャプチャ中でも変更できる
+      cam.jpeg_quality = 95
+      high = cam.capture
+
+      cam.jpeg_quality = 10
+      low = cam.capture
+
+      assert_true(jpeg?(high))
+      assert_true(jpeg?(low))
+      assert_operator(low.bytesize, :<, high.bytesize)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "encode nv12 in background" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.format             = "NV12"
+    cam.jpeg_output        = true
+    cam.background_capture = true
+
+    cam.start {
+      3.times {assert_true(jpeg?(cam.capture))}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "pass through mjpeg" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.format      = "MJPEG"
+    cam.jpeg_output = true
+
+    cam.start {
+      frame = cam.capture_frame
+
+      assert_equal("MJPG", frame.format)
+      assert_equal("\xff\xd8".b, frame.to_s.byteslice(0, 2))
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,66 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestLowLatency < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "drain to newest" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 30
+
+    assert_false(cam.low_latency)
+    assert_nothing_raised {cam.low_latency = true}
+    assert_true(cam.low_latency)
+
+    cam.start {
+      cam.capture
+      seq = cam.frame_info.sequence
+
+      sleep 0.3
+
+      assert_nothing_raised {cam.capture}
+      info = cam.frame_info
+
+      assert_operator(info.skipped, :>, 0)
+      assert_operator(info.sequence, :>=, seq + info.skipped + 1)
+
+      p info.skipped if Config.show_data?
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "normal mode" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 30
+
+    cam.start {
+      cam.capture
+      sleep 0.3
+      cam.capture
+
+      assert_equal(0, cam.frame_info.skipped)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
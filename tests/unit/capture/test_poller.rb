@@ -0,0 +1,95 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'timeout'
+require 'v4l2'
+
+using TestUtil
+
+class TestPoller < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "wait for frames" do
+    cam    = assert_nothing_raised {klass.open(Config.device)}
+    poller = assert_nothing_raised {Video4Linux2::Poller.new}
+
+    poller << cam
+    assert_equal([cam], poller.cameras)
+
+    cam.start {
+      5.times {
+        list = poller.wait(3)
+        assert_equal(1, list.size)
+
+        c, frame = list.first
+        assert_same(cam, c)
+        assert_kind_of(String, frame)
+        assert_equal(Encoding::ASCII_8BIT, frame.encoding)
+        p frame.bytesize if Config.show_data?
+      }
+
+      assert_true(cam.ready?)
+    }
+
+    # 停止中のカメラは待ち受け対象にならない
+    assert_equal([], poller.wait(0.1))
+
+    # 再開後は再び待ち受け対象になる
+    cam.start {
+      assert_equal(1, poller.wait(3).size)
+    }
+
+    assert_same(cam, poller.remove(cam))
+    assert_nil(poller.remove(cam))
+    assert_equal([], poller.cameras)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "timeout and interrupt" do
+    cam    = assert_nothing_raised {klass.open(Config.device)}
+    poller = Video4Linux2::Poller.new
+    poller.add(cam)
+
+    cam.framerate = 1
+
+    cam.start {
+      poller.wait
+
+      assert_equal([], poller.wait(0.05))
+
+      assert_raise_kind_of(Timeout::Error) {
+        Timeout.timeout(0.1) {poller.wait}
+      }
+
+      assert_equal(1, poller.wait(3).size)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "reject background capture camera" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.background_capture = true
+
+    assert_raise(ArgumentError) {Video4Linux2::Poller.new.add(cam)}
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
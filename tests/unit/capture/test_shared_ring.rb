@@ -0,0 +1,76 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestSharedRing < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+    @name = "/v4l2-ruby-test-#{Process.pid}"
+  end
+
+  def teardown
+  end
+
+  test "publish and read" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      pub = assert_nothing_raised {
+        Video4Linux2::SharedPublisher.new(cam, @name, slots: 3)
+      }
+
+      reader = assert_nothing_raised {Video4Linux2::SharedReader.new(@name)}
+
+      begin
+        assert_nil(reader.read(timeout: 0))
+        assert_nil(reader.frame_info)
+
+        seq = assert_nothing_raised {pub.publish}
+        assert_kind_of(Integer, seq)
+
+        frame = assert_nothing_raised {reader.read(timeout: 0)}
+        assert_kind_of(String, frame)
+        assert_not_equal(0, frame.bytesize)
+        assert_equal(cam.image_width, reader.image_width)
+        assert_equal(cam.image_height, reader.image_height)
+        assert_kind_of(Video4Linux2::Camera::FrameInfo, reader.frame_info)
+
+        # 同じフレームは2度返さない
+        assert_nil(reader.read(timeout: 0))
+
+        # 読み出し側は常に最新のフレームを読む
+        3.times {pub.publish}
+        assert_not_nil(reader.read(into: frame))
+        assert_nil(reader.read(timeout: 0))
+
+        # 新しいフレームを待つ
+        th = Thread.new {sleep 0.1; pub.publish}
+        assert_not_nil(reader.read(timeout: 3))
+        th.join
+
+      ensure
+        reader.close
+        pub.close
+      end
+
+      assert_raise_kind_of(IOError) {pub.publish}
+      assert_raise_kind_of(RuntimeError) {
+        Video4Linux2::SharedReader.new(@name)
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -3,6 +3,7 @@
 
 require 'test/unit'
 require 'v4l2'
+require 'objspace'
 
 using TestUtil
 
@@ -46,4 +47,47 @@ class TestStart < Test::Unit::TestCase
   ensure
     cam&.close if defined? cam
   end
+
+  test "restart" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    io  = cam.to_io
+
+    3.times {
+      cam.start {assert_kind_of(String, cam.capture)}
+    }
+
+    # 設定を変更していなければデバイスは開いたまま
+    assert_same(io, cam.to_io)
+
+    cam.image_width  = 320
+    cam.image_height = 240
+
+    cam.start {
+      assert_true(cam.ready?)
+      assert_kind_of(String, cam.capture)
+    }
+
+    assert_not_same(io, cam.to_io)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "memsize includes buffers" do
+    cam  = assert_nothing_raised {klass.open(Config.device)}
+    size = ObjectSpace.memsize_of(cam)
+
+    # MJPEGの画像サイズはDHTを補う分だけバッファより大きくなるので、
+    # 非圧縮のフォーマットで確認する
+    cam.format = "YUYV"
+
+    cam.start {
+      # 少なくともバッファ数分の画像サイズは確保している
+      assert_operator(ObjectSpace.memsize_of(cam),
+                      :>=, size + (cam.buffer_count * cam.image_size))
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
 end
@@ -0,0 +1,83 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestTryCapture < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "try capture" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 1
+
+    cam.start {
+      cam.capture
+
+      assert_nil(cam.try_capture)
+
+      buf = "previous".b
+      assert_nil(cam.try_capture(into: buf))
+      assert_equal("previous", buf)
+
+      sleep 1.5
+      assert_kind_of(String, cam.try_capture)
+      assert_true(cam.ready?)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "capture with timeout" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.framerate = 1
+
+    cam.start {
+      cam.capture
+
+      t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      assert_nil(cam.capture(timeout: 0.1))
+      t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      assert_operator(t1 - t0, :<, 0.5)
+      assert_true(cam.ready?)
+
+      data = assert_nothing_raised {cam.capture(timeout: 3)}
+      assert_kind_of(String, data)
+      p data.bytesize if Config.show_data?
+
+      assert_raise(ArgumentError) {cam.capture(timeout: -1)}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "timeout in background mode" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.background_capture = true
+
+    cam.start {
+      assert_kind_of(String, cam.capture(timeout: 3))
+      assert_kind_of(String, cam.try_capture)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,73 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestUserPtr < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "memory type" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_equal(:mmap, cam.memory)
+    assert_nothing_raised {cam.memory = :userptr}
+    assert_equal(:userptr, cam.memory)
+    assert_raise_kind_of(ArgumentError) {cam.memory = :dmabuf}
+
+    assert_false(cam.hugepage)
+    assert_nothing_raised {cam.hugepage = true}
+    assert_true(cam.hugepage)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "capture with userptr" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.memory = :userptr
+
+    begin
+      cam.start
+    rescue RuntimeError
+      omit("USERPTR is not supported by the device")
+    end
+
+    begin
+      frame = assert_nothing_raised {cam.capture}
+      assert_not_equal(0, frame.bytesize)
+
+      buf = assert_nothing_raised {cam.borrow}
+      assert_not_equal(0, buf.size)
+      assert_nothing_raised {cam.release(buf)}
+    ensure
+      cam.stop
+    end
+
+    # バッファを保持したままの再開
+    assert_nothing_raised {cam.start}
+    assert_nothing_raised {cam.capture}
+    cam.stop
+
+    # メモリ種別の変更は確保し直しになる
+    assert_nothing_raised {cam.memory = :mmap}
+    assert_nothing_raised {cam.start {cam.capture}}
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,64 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+using TestUtil
+
+class TestBufferCount < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  test "default buffer count" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_equal(3, cam.buffer_count)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "set buffer count" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    assert_nothing_raised {cam.buffer_count = 2}
+    assert_equal(2, cam.buffer_count)
+
+    assert_nothing_raised {cam.buffer_count = 16}
+    assert_equal(16, cam.buffer_count)
+
+    assert_raise_kind_of(RuntimeError) {cam.buffer_count = 1}
+    assert_raise_kind_of(RuntimeError) {cam.buffer_count = 1000}
+    assert_raise_kind_of(TypeError) {cam.buffer_count = "4"}
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "granted buffer count" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.buffer_count = 8
+    cam.start {
+      assert_operator(cam.buffer_count, :>=, 2)
+      assert_raise_kind_of(RuntimeError) {cam.buffer_count = 4}
+
+      p cam.buffer_count if Config.show_data?
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -39,6 +39,8 @@ class TestFramerate < Test::Unit::TestCase
   test "set frame rate" do
     cam = assert_nothing_raised {klass.open(Config.device)}
 
+    assert_equal(1/30r, cam.framerate)
+
     assert_nothing_raised {cam.framerate = 10}
     assert_equal(1/10r, cam.framerate)
 
@@ -54,4 +56,24 @@ class TestFramerate < Test::Unit::TestCase
   ensure
     cam&.close if defined? cam
   end
+
+  test "change after capture" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.start {cam.capture}
+
+    io = cam.to_io
+
+    # フレームレートの変更ではデバイスを開き直さない
+    assert_nothing_raised {cam.framerate = 10}
+    assert_equal(1/10r, cam.framerate)
+    assert_same(io, cam.to_io)
+
+    cam.start {
+      assert_kind_of(String, cam.capture)
+      assert_equal(1/10r, cam.framerate)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
 end
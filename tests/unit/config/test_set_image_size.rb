@@ -82,4 +82,29 @@ class TestImageSize < Test::Unit::TestCase
   ensure
     cam&.close if defined? cam
   end
+
+  test "negotiated size" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.format       = :YUYV
+    cam.image_width  = 640
+    cam.image_height = 480
+
+    assert_equal(640 * 480 * 2, cam.image_size)
+    assert_equal(640 * 2, cam.bytes_per_line)
+
+    cam.start {
+      assert_operator(cam.bytes_per_line, :>=, cam.image_width * 2)
+      assert_operator(cam.image_size, :>=,
+                      cam.bytes_per_line * cam.image_height)
+
+      data = cam.capture
+      assert_operator(data.bytesize, :<=, cam.image_size)
+      p [cam.image_width, cam.image_height, cam.bytes_per_line,
+         cam.image_size, cam.framerate] if Config.show_data?
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
 end
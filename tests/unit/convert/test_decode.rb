@@ -0,0 +1,110 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+Warning[:experimental] = false
+
+using TestUtil
+
+class TestDecode < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  def capture(cam, fmt)
+    cam.format       = fmt
+    cam.image_width  = 640
+    cam.image_height = 480
+
+    cam.start {return cam.capture_frame}
+  end
+
+  test "scaled gray" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "MJPEG")
+
+    [[1, 640, 480], [1/2r, 320, 240], [1/4r, 160, 120], [1/8r, 80, 60]].each {
+      |scale, w, h|
+      gray = assert_nothing_raised {frame.decode(scale: scale, color: :gray)}
+
+      assert_equal("GREY", gray.format)
+      assert_equal(w, gray.width)
+      assert_equal(h, gray.height)
+      assert_equal(w, gray.bytes_per_line)
+      assert_equal(w * h, gray.to_s.bytesize)
+      assert_equal(frame.sequence, gray.sequence)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "scaled rgb" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "MJPEG")
+    rgb   = assert_nothing_raised {frame.decode(scale: 0.25)}
+
+    assert_equal("RGB3", rgb.format)
+    assert_equal([160, 120], [rgb.width, rgb.height])
+    assert_equal(160 * 120 * 3, rgb.to_s.bytesize)
+
+    # 輝度だけを復号した結果と大きくはずれない
+    gray = frame.decode(scale: 1/4r, color: :gray).to_s.bytes
+    diff = rgb.to_s.bytes.each_slice(3).zip(gray).map { |(r, g, b), y|
+      ((0.299 * r) + (0.587 * g) + (0.114 * b) - y).abs
+    }
+
+    assert_operator(diff.max, :<=, 3)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "reuse after close" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "MJPEG")
+    cam.close
+
+    assert_equal(320, frame.decode(scale: 1/2r).width)
+  end
+
+  test "encoded frame" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+    cam.jpeg_output = true
+
+    frame = capture(cam, "YUYV")
+    gray  = assert_nothing_raised {frame.decode(scale: 1/2r, color: :gray)}
+
+    assert_equal([frame.width / 2, frame.height / 2], [gray.width, gray.height])
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "invalid arguments" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "MJPEG")
+
+    assert_raise(ArgumentError) {frame.decode(scale: 1/3r)}
+    assert_raise(ArgumentError) {frame.decode(scale: 0)}
+    assert_raise(ArgumentError) {frame.decode(color: :yuv)}
+
+    raw = capture(cam, "YUYV")
+    assert_raise(RuntimeError) {raw.decode}
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,129 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+Warning[:experimental] = false
+
+using TestUtil
+
+class TestToRGB < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  # BT.601 limited rangeでの期待値(1画素分)
+  def reference(y, u, v)
+    y = 1.164383 * (y - 16)
+    u = u - 128
+    v = v - 128
+
+    [
+      y + (1.596027 * v),
+      y - (0.391762 * u) - (0.812968 * v),
+      y + (2.017232 * u),
+    ].map {|x| x.round.clamp(0, 255)}
+  end
+
+  def capture_yuyv(cam)
+    cam.format       = "YUYV"
+    cam.image_width  = 160
+    cam.image_height = 120
+
+    cam.start {return cam.capture_frame}
+  end
+
+  test "conversion kernel" do
+    assert_include(%w[avx2 sse2 neon scalar], Video4Linux2.conversion_kernel)
+  end
+
+  test "convert yuyv" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture_yuyv(cam)
+    src   = frame.to_s.bytes
+    w     = frame.width
+    h     = frame.height
+
+    rgb  = assert_nothing_raised {frame.to_rgb}
+    bgr  = assert_nothing_raised {frame.to_bgr}
+    rgba = assert_nothing_raised {frame.to_rgba}
+
+    assert_equal(w * h * 3, rgb.bytesize)
+    assert_equal(w * h * 4, rgba.bytesize)
+    assert_equal(Encoding::ASCII_8BIT, rgb.encoding)
+
+    [0, 1, 17, (w * h) - 1].each {|i|
+      off = ((i / w) * frame.stride) + ((i % w) * 2)
+      y   = src[off]
+      u   = src[(off & ~3) + 1]
+      v   = src[(off & ~3) + 3]
+      exp = reference(y, u, v)
+
+      pix = rgb.byteslice(i * 3, 3).bytes
+      exp.zip(pix) {|e, a| assert_in_delta(e, a, 1)}
+
+      assert_equal(pix.reverse, bgr.byteslice(i * 3, 3).bytes)
+      assert_equal(pix + [255], rgba.byteslice(i * 4, 4).bytes)
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "options" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture_yuyv(cam)
+
+    assert_nothing_raised {frame.to_rgb(matrix: :bt709, range: :full)}
+    assert_not_equal(frame.to_rgb, frame.to_rgb(matrix: :bt709))
+    assert_not_equal(frame.to_rgb, frame.to_rgb(range: :full))
+
+    assert_raise_kind_of(ArgumentError) {frame.to_rgb(matrix: :bt2020)}
+    assert_raise_kind_of(ArgumentError) {frame.to_rgb(range: :wide)}
+    assert_raise_kind_of(TypeError) {frame.to_rgb(into: 1)}
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "convert into buffer" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture_yuyv(cam)
+    size  = frame.width * frame.height * 3
+
+    str = String.new
+    assert_same(str, frame.to_rgb(into: str))
+    assert_equal(frame.to_rgb, str)
+
+    buf = IO::Buffer.new(16)
+    assert_equal(size, frame.to_rgb(buf))
+    assert_equal(frame.to_rgb, buf.get_string(0, size))
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "unsupported format" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.format = :MJPG
+    cam.start {
+      frame = cam.capture_frame
+      assert_raise_kind_of(RuntimeError) {frame.to_rgb}
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -0,0 +1,109 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+require 'test/unit'
+require 'v4l2'
+
+Warning[:experimental] = false
+
+using TestUtil
+
+class TestToYUV < Test::Unit::TestCase
+  class << self
+    def startup
+    end
+
+    def shutdown
+    end
+  end
+
+  def setup
+  end
+
+  def teardown
+  end
+
+  def capture(cam, fmt)
+    cam.format       = fmt
+    cam.image_width  = 160
+    cam.image_height = 120
+
+    cam.start {return cam.capture_frame}
+  end
+
+  test "yuyv to i420" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "YUYV")
+    src   = frame.to_s.bytes
+    w     = frame.width
+    h     = frame.height
+
+    i420 = assert_nothing_raised {frame.to_yuv(:I420)}
+    assert_equal((w * h * 3) / 2, i420.bytesize)
+
+    # 輝度は各行の偶数バイト目
+    y = i420.byteslice(0, w * h).bytes
+    assert_equal(src[0, w * 2].each_slice(2).map(&:first), y[0, w])
+    assert_equal(src[frame.stride * (h - 1), w * 2].each_slice(2).map(&:first),
+                 y[w * (h - 1), w])
+
+    # 色差は2行の平均
+    u = i420.byteslice(w * h, (w / 2) * (h / 2)).bytes
+    v = i420.byteslice((w * h) + ((w / 2) * (h / 2)), (w / 2) * (h / 2)).bytes
+    assert_equal((src[1] + src[frame.stride + 1] + 1) / 2, u[0])
+    assert_equal((src[3] + src[frame.stride + 3] + 1) / 2, v[0])
+
+    assert_equal(frame.to_s, frame.to_yuv(:YUYV))
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "repack nv12" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "NV12")
+    w     = frame.width
+    h     = frame.height
+    n     = w * h
+
+    i420 = assert_nothing_raised {frame.to_yuv("YU12")}
+    yv12 = assert_nothing_raised {frame.to_yuv(:YV12)}
+    nv21 = assert_nothing_raised {frame.to_yuv(:NV21)}
+    nv12 = assert_nothing_raised {frame.to_yuv(:NV12)}
+
+    assert_equal(frame.to_s.byteslice(0, (n * 3) / 2), nv12)
+
+    uv = frame.to_s.byteslice(n, n / 2).bytes
+    u  = uv.each_slice(2).map(&:first)
+    v  = uv.each_slice(2).map(&:last)
+
+    assert_equal(u, i420.byteslice(n, n / 4).bytes)
+    assert_equal(v, i420.byteslice(n + (n / 4), n / 4).bytes)
+    assert_equal(v, yv12.byteslice(n, n / 4).bytes)
+    assert_equal(v.zip(u).flatten, nv21.byteslice(n, n / 2).bytes)
+
+    yuyv = assert_nothing_raised {frame.to_yuv(:YUYV)}
+    assert_equal(n * 2, yuyv.bytesize)
+
+  ensure
+    cam&.close if defined? cam
+  end
+
+  test "nv12 to rgb" do
+    cam   = assert_nothing_raised {klass.open(Config.device)}
+    frame = capture(cam, "NV12")
+    w     = frame.width
+    h     = frame.height
+
+    rgb = assert_nothing_raised {frame.to_rgb}
+    assert_equal(w * h * 3, rgb.bytesize)
+
+    assert_raise_kind_of(ArgumentError) {frame.to_yuv(:MJPG)}
+
+    buf = IO::Buffer.new(16)
+    assert_equal((w * h * 3) / 2, frame.to_yuv(:I420, into: buf))
+
+  ensure
+    cam&.close if defined? cam
+  end
+end
@@ -56,6 +56,89 @@ class TestRactor < Test::Unit::TestCase
     }
   end
 
+  test "shareable frame" do
+    r = Ractor.new(Config.device) { |device|
+      begin
+        cam = Video4Linux2::Camera.open(device)
+
+        cam.start {
+          3.times {
+            Ractor.yield(cam.capture(shareable: true))
+          }
+        }
+
+      ensure
+        cam&.close if defined? cam
+      end
+
+      :END
+    }
+
+    loop {
+      data = r.take
+      break if data == :END
+
+      assert_true(data.frozen?)
+      assert_true(Ractor.shareable?(data))
+      assert_not_equal(0, data.bytesize)
+    }
+  end
+
+  test "moved frame" do
+    r = Ractor.new(Config.device) { |device|
+      begin
+        cam = Video4Linux2::Camera.open(device)
+
+        cam.start {
+          3.times {
+            # 所有権ごと渡すので、フレームの内容は複製されない
+            data = cam.capture
+            Ractor.yield(data, move: true)
+
+            Ractor.yield(
+              begin
+                data.bytesize
+                :ACCESSIBLE
+              rescue Ractor::MovedError
+                :MOVED
+              end
+            )
+          }
+        }
+
+      ensure
+        cam&.close if defined? cam
+      end
+
+      :END
+    }
+
+    loop {
+      data = r.take
+      break if data == :END
+
+      assert_kind_of(String, data)
+      assert_false(data.frozen?)
+      assert_not_equal(0, data.bytesize)
+
+      # 送り出した側からは参照できなくなる
+      assert_equal(:MOVED, r.take)
+    }
+  end
+
+  test "shareable frame with buffer" do
+    cam = assert_nothing_raised {klass.open(Config.device)}
+
+    cam.start {
+      assert_raise_kind_of(ArgumentError) {
+        cam.capture(into: String.new, shareable: true)
+      }
+    }
+
+  ensure
+    cam&.close if defined? cam
+  end
+
   test "unshareble" do 
     cam = assert_nothing_raised {klass.open(Config.device)}
 